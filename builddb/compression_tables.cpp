@@ -1,27 +1,27 @@
 #include "builddb/compression_tables.h"
 #include "egdb/egdb_intl.h"
-#include <stdlib.h>
+#include "engine/table.h"
 
 namespace egdb_interface {
 
 /*
  * skip numbers range from 5...MAXSKIP defined above, there are SKIPS of them.
  */
-int skip[SKIPS] = {
+constexpr int skip[SKIPS] = {
 	5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,
 	31,32,36,40,44,48,52,56,60,70,80,90,100,150,200,250,300,400,500,650,800,
 	1000,1200,1400,1600,2000,2400,3200,4000,5000,7500,MAXSKIP
 };
 
 /* skip table for incomplete databases. */
-int skip_inc[SKIPS_INC] = {
+constexpr int skip_inc[SKIPS_INC] = {
 	3,4,5,6,7,8,9,10,11,12,
 	13,14,15,16,17,18,19,20,21,22,
 	23,24,25,26,27,28,29,30,31,32,
 	33,34,35,70,106,MAXSKIP_INC
 };
 
-int mtc_skip[MTC_SKIPS] = {
+constexpr int mtc_skip[MTC_SKIPS] = {
 /* 0 */		1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
 /* 1 */		11, 12, 13, 14, 15, 16, 17, 18, 19, 20,	
 /* 2 */		21, 22, 23, 24, 25, 26, 27, 28, 29, 30,
@@ -34,113 +34,67 @@ int mtc_skip[MTC_SKIPS] = {
 /* 9 */		10000000, 30000000, 100000000, MAX_MTCSKIP
 };
 
-int skipindex[MAXSKIP + 1]; // holds the index of the next smaller or equal skip.
-int skipindex_inc[MAXSKIP_INC + 1];
-
-int runlength[256];					/* holds the run length for every byte. */
-int runlength_inc[256];				/* holds the run length for every byte. */
-int runlength_4val[256];
-int runlength_mtc[256];
-unsigned short runlength16[65536];	/* the run length of each 2 bytes. */
-unsigned int *runlength16_mtc;
-int compressed_value[256];			/* holds the value for every byte. */
-int compressed_value_inc[256];		/* holds the value for every byte. */
-int compressed_value_4val[256];
-
-
 /*
- * Initialize skipindex.
+ * The functions that give the value of each table entry, so the tables are built at
+ * compile time.
  */
-void init_skips()
+
+/* The index of the largest skip <= i, or 0 if there is none. */
+constexpr int skipindex_value(int const *skips, int j, int i)
 {
-	int i, j;
-
-	for (i = 0; i <= MAXSKIP; i++) {
-		for (j = SKIPS - 1; j >= 0; j--) {
-			if (skip[j] <= i) {
-				skipindex[i] = j;
-				break;
-			}
-		}
-	}
+	return(j < 0 ? 0 : skips[j] <= i ? j : skipindex_value(skips, j - 1, i));
 }
 
-
-void init_skips_inc()
+constexpr int runlength_value(int i)
 {
-	int i, j;
-
-	for (i = 0; i <= MAXSKIP_INC; i++) {
-		for (j = SKIPS_INC - 1; j >= 0; j--) {
-			if (skip_inc[j] <= i) {
-				skipindex_inc[i] = j;
-				break;
-			}
-		}
-	}
+	return(i < 81 ? 4 : skip[(i - 81) % SKIPS]);
 }
 
-
-/*
- * Initialize tables of runlengths and compressed values.
- */
-void init_runlengths()
+constexpr int runlength_inc_value(int i)
 {
-	int i;
-
-	/* Init WLD runlengths. */
-	for (i = 0; i < 81; i++)
-		runlength[i] = 4;
-	for (i = 81; i < 256; i++) {
-		runlength[i] = skip[(i - 81) % SKIPS];
-		compressed_value[i] = ((i - 81) / SKIPS);
-	}
-	for (i = 0; i < 65536; ++i)
-		runlength16[i] = runlength[i & 0xff] + runlength[i >> 8];
-
-	/* Init MTC runlengths. */
-	for (i = 0; i < 256; ++i)
-		if (i < MTC_SKIPS)
-			runlength_mtc[i] = mtc_skip[i];
-		else
-			runlength_mtc[i] = 1;
+	return(i < 36 ? 2 : skip_inc[(i - 36) % SKIPS_INC]);
 }
 
-
-void init_runlengths_inc()
+constexpr int runlength_mtc_value(int i)
 {
-	int i;
-
-	/* Init WLD runlengths. */
-	for (i = 0; i < 36; i++)
-		runlength_inc[i] = 2;
-	for (i = 36; i < 256; i++) {
-		runlength_inc[i] = skip_inc[(i - 36) % SKIPS_INC];
-		compressed_value_inc[i] = ((i - 36) / SKIPS_INC);
-	}
+	return(i < MTC_SKIPS ? mtc_skip[i] : 1);
 }
 
+constexpr int compressed_value_value(int i)
+{
+	return(i < 81 ? 0 : (i - 81) / SKIPS);
+}
 
-void init_runlength16_mtc()
+constexpr int compressed_value_inc_value(int i)
 {
-	int i;
+	return(i < 36 ? 0 : (i - 36) / SKIPS_INC);
+}
 
-	if (!runlength16_mtc) {
-		runlength16_mtc = (unsigned int *)malloc(65536 * sizeof(*runlength16_mtc));
-		for (i = 0; i < 65536; ++i)
-			runlength16_mtc[i] = runlength_mtc[i & 0xff] + runlength_mtc[i >> 8];
-	}
+#define SKIPINDEX(i) skipindex_value(skip, SKIPS - 1, i)
+#define SKIPINDEX_INC(i) skipindex_value(skip_inc, SKIPS_INC - 1, i)
+#define RUNLENGTH16(i) (unsigned short)(runlength_value((i) & 0xff) + runlength_value((i) >> 8))
+#define RUNLENGTH16_INC(i) (unsigned short)(runlength_inc_value((i) & 0xff) + runlength_inc_value((i) >> 8))
+#define RUNLENGTH16_MTC(i) (unsigned int)(runlength_mtc_value((i) & 0xff) + runlength_mtc_value((i) >> 8))
 
-}
+static_assert(MAXSKIP == 10000 && MAXSKIP_INC == 500, "the skipindex initializers are written for 10001 and 501 entries");
 
+/* The index of the next smaller or equal skip. */
+constexpr int skipindex[MAXSKIP + 1] = {
+	TABLE_8192(SKIPINDEX, 0), TABLE_1024(SKIPINDEX, 8192), TABLE_512(SKIPINDEX, 9216),
+	TABLE_256(SKIPINDEX, 9728), TABLE_16(SKIPINDEX, 9984), SKIPINDEX(10000)
+};
+constexpr int skipindex_inc[MAXSKIP_INC + 1] = {
+	TABLE_256(SKIPINDEX_INC, 0), TABLE_128(SKIPINDEX_INC, 256), TABLE_64(SKIPINDEX_INC, 384),
+	TABLE_32(SKIPINDEX_INC, 448), TABLE_16(SKIPINDEX_INC, 480), TABLE_4(SKIPINDEX_INC, 496), SKIPINDEX_INC(500)
+};
 
-void init_compression_tables()
-{
-	init_skips();
-	init_runlengths();
-	init_skips_inc();
-	init_runlengths_inc();
-}
+constexpr int runlength[256] = {TABLE_256(runlength_value, 0)};						/* the run length for every byte. */
+constexpr int runlength_inc[256] = {TABLE_256(runlength_inc_value, 0)};				/* the run length for every byte. */
+constexpr int runlength_mtc[256] = {TABLE_256(runlength_mtc_value, 0)};
+constexpr unsigned short runlength16[65536] = {TABLE_65536(RUNLENGTH16, 0)};			/* the run length of each 2 bytes. */
+constexpr unsigned short runlength16_inc[65536] = {TABLE_65536(RUNLENGTH16_INC, 0)};
+constexpr unsigned int runlength16_mtc[65536] = {TABLE_65536(RUNLENGTH16_MTC, 0)};
+constexpr int compressed_value[256] = {TABLE_256(compressed_value_value, 0)};			/* the value for every byte. */
+constexpr int compressed_value_inc[256] = {TABLE_256(compressed_value_inc_value, 0)};	/* the value for every byte. */
 
 }	// namespace egdb_interface
-
@@ -20,20 +20,19 @@ namespace egdb_interface {
 
 #define SINGLEVALUE_CODES ".+-=?!"
 
-void init_compression_tables();
-void init_runlength16_mtc();
-
-extern int skip[];
-extern int skip_inc[];
-extern int mtc_skip[];
-extern int skipindex[MAXSKIP + 1];			/* index of the next smaller or equal skip. */
-extern int skipindex_inc[MAXSKIP_INC + 1];	/* index of the next smaller or equal skip (for incomplete dbs). */
-
-extern int runlength[256];					/* run length for every byte. */
-extern int runlength_inc[256];				/* run length for every byte (for incomplete dbs). */
-extern unsigned short runlength16[65536];	/* run length of each 2 bytes. */
-extern int compressed_value[256];			/* the db value for every byte. */
-extern int compressed_value_inc[256];		/* the db value for every byte (for incomplete dbs). */
-extern int runlength_mtc[256];
-extern unsigned int *runlength16_mtc;
+/* The tables are built at compile time. */
+extern const int skip[SKIPS];
+extern const int skip_inc[SKIPS_INC];
+extern const int mtc_skip[MTC_SKIPS];
+extern const int skipindex[MAXSKIP + 1];			/* index of the next smaller or equal skip. */
+extern const int skipindex_inc[MAXSKIP_INC + 1];	/* index of the next smaller or equal skip (for incomplete dbs). */
+
+extern const int runlength[256];					/* run length for every byte. */
+extern const int runlength_inc[256];				/* run length for every byte (for incomplete dbs). */
+extern const unsigned short runlength16[65536];		/* run length of each 2 bytes. */
+extern const unsigned short runlength16_inc[65536];	/* run length of each 2 bytes (for incomplete dbs). */
+extern const int compressed_value[256];				/* the db value for every byte. */
+extern const int compressed_value_inc[256];			/* the db value for every byte (for incomplete dbs). */
+extern const int runlength_mtc[256];
+extern const unsigned int runlength16_mtc[65536];
 }	// namespace egdb_interface
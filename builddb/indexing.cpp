@@ -1,19 +1,20 @@
 #include "builddb/indexing.h"
 #include "egdb/egdb_intl.h"
+#include "egdb/platform.h"
 #include "engine/bicoef.h"
 #include "engine/bitcount.h"
 #include "engine/board.h"
 #include "engine/bool.h"
 #include "engine/project.h"
+#include "engine/table.h"
 #include <algorithm>
 #include <stdint.h>
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
 
 namespace egdb_interface {
 
-static bool did_build_man_index_base;
-
 
 BITBOARD free_square_bitboard_fwd(int logical_square, BITBOARD occupied)
 {
@@ -109,30 +110,90 @@ BITBOARD index2bitboard_rev(unsigned int index, int num_squares, int num_pieces,
 }
 
 
+/*
+ * The number of men configurations with bm0 black men on black's backrank, for building
+ * man_index_base at compile time.
+ */
+constexpr int64_t man_index_partial(int bm, int wm, int bm0)
+{
+	return((int64_t)binomial_coefficient(MAXSQUARE - 2 * ROWSIZE, bm - bm0) *
+			(int64_t)binomial_coefficient(MAXSQUARE - ROWSIZE - bm + bm0, wm) *
+			(int64_t)binomial_coefficient(ROWSIZE, bm0));
+}
+
+
+/*
+ * The first man index with bm0 black men on the backrank.  Index 0 has the most
+ * black men on the backrank.
+ */
+constexpr int64_t man_index_base_value(int bm, int wm, int bm0)
+{
+	return(bm0 >= (bm < ROWSIZE ? bm : ROWSIZE) ? 0 :
+			man_index_partial(bm, wm, bm0 + 1) + man_index_base_value(bm, wm, bm0 + 1));
+}
+
+#define MAN_INDEX_BM0(bm, wm) {man_index_base_value(bm, wm, 0), man_index_base_value(bm, wm, 1), \
+				man_index_base_value(bm, wm, 2), man_index_base_value(bm, wm, 3), man_index_base_value(bm, wm, 4), \
+				man_index_base_value(bm, wm, 5)}
+#define MAN_INDEX_WM(bm) {MAN_INDEX_BM0(bm, 0), MAN_INDEX_BM0(bm, 1), MAN_INDEX_BM0(bm, 2), \
+				MAN_INDEX_BM0(bm, 3), MAN_INDEX_BM0(bm, 4), MAN_INDEX_BM0(bm, 5)}
+
+static_assert(MAXPIECE == 5 && RANK0MAX == 5, "the man_index_base initializer is written for 6 x 6 x 6");
+
 /* base man index[bm][wm][bm0] */
-static int64_t man_index_base[MAXPIECE + 1][MAXPIECE + 1][RANK0MAX + 1];
+static constexpr int64_t man_index_base[MAXPIECE + 1][MAXPIECE + 1][RANK0MAX + 1] = {
+	MAN_INDEX_WM(0), MAN_INDEX_WM(1), MAN_INDEX_WM(2), MAN_INDEX_WM(3), MAN_INDEX_WM(4), MAN_INDEX_WM(5)
+};
 
 
-int64_t position_to_index_slice(EGDB_POSITION const *p, int bm, int bk, int wm, int wk)
+/*
+ * Combine the indices of each piece type into the slice index.
+ */
+static inline int64_t combine_slice_index(int bm, int bk, int wm, int wk, int bm0, uint32_t bmindex,
+				uint32_t bm0index, uint32_t wmindex, uint32_t bkindex, uint32_t wkindex)
 {
-	BITBOARD bm0_mask;
-	BITBOARD bmmask, bkmask, wmmask, wkmask;
-	int bm0;
-	uint32_t bmindex, bkindex, wmindex, wkindex, bm0index;
 	uint32_t bmrange, bm0range, bkrange, wkrange;
 	int64_t index64;
 	int64_t checker_index_base, checker_index;
 
-	bmmask = p->black & ~p->king;
-	bm0_mask = bmmask & ROW0;
-	bm0 = bitcount64(bm0_mask);
-
 	/* Indices in this subdb are assigned with index 0 having the highest
 	 * number of black men on rank0, ...
 	 */
-	assert(did_build_man_index_base);
 	checker_index_base = man_index_base[bm][wm][bm0];
 
+	bmrange = choose(MAXSQUARE - 2 * ROWSIZE, bm - bm0);
+	bm0range = choose(ROWSIZE, bm0);
+	bkrange = choose(MAXSQUARE - bm - wm, bk);
+	wkrange = choose(MAXSQUARE - bm - wm - bk, wk);
+
+	/* Calculate the checker (man) index. */
+	checker_index = bm0index + checker_index_base +
+					bmindex * bm0range +
+					(int64_t)wmindex * (int64_t)bm0range * (int64_t)bmrange;
+
+	index64 = (int64_t)wkindex + 
+				(int64_t)bkindex * (int64_t)wkrange +
+				(int64_t)(checker_index) * (int64_t)bkrange * (int64_t)wkrange;
+	return(index64);
+}
+
+
+/*
+ * The slice index with the bitcounts of bitcount64_isa<popcnt>().  It is inlined into 
+ * position_to_index_slice_portable() and position_to_index_slice_popcnt(), so each gets
+ * the bitcount of its own target.
+ */
+template <bool popcnt> ALWAYS_INLINE int64_t position_to_index_slice_isa(EGDB_POSITION const *p, int bm, int bk, int wm, int wk)
+{
+	BITBOARD bm0_mask;
+	BITBOARD bmmask, bkmask, wmmask, wkmask;
+	int bm0;
+	uint32_t bmindex, bkindex, wmindex, wkindex, bm0index;
+
+	bmmask = p->black & ~p->king;
+	bm0_mask = bmmask & ROW0;
+	bm0 = bitcount64_isa<popcnt>(bm0_mask);
+
 	/* Set the index for the black men that are not on rank0. */
 	bmindex = index_pieces_1_type(bmmask ^ bm0_mask, ROWSIZE);
 
@@ -143,34 +204,482 @@ int64_t position_to_index_slice(EGDB_POSITION const *p, int bm, int bk, int wm,
 	 * accounting for any interferences from the black men.
 	 */
 	wmmask = p->white & ~p->king;
-	wmindex = index_pieces_1_type_reverse(wmmask, bmmask);
+	wmindex = index_pieces_1_type_reverse<popcnt>(wmmask, bmmask);
 
 	/* Set the index for the black kings, accounting for any interferences
 	 * from the black men and white men.
 	 */
 	bkmask = p->black & p->king;
-	bkindex = index_pieces_1_type(bkmask, bmmask | wmmask);
+	bkindex = index_pieces_1_type<popcnt>(bkmask, bmmask | wmmask);
 
 	/* Set the index for the white kings, accounting for any interferences
 	 * from the black men, white men, and black kings.
 	 */
 	wkmask = p->white & p->king;
-	wkindex = index_pieces_1_type(wkmask, bmmask | wmmask | bkmask);
+	wkindex = index_pieces_1_type<popcnt>(wkmask, bmmask | wmmask | bkmask);
 
-	bmrange = choose(MAXSQUARE - 2 * ROWSIZE, bm - bm0);
-	bm0range = choose(ROWSIZE, bm0);
-	bkrange = choose(MAXSQUARE - bm - wm, bk);
-	wkrange = choose(MAXSQUARE - bm - wm - bk, wk);
+	return(combine_slice_index(bm, bk, wm, wk, bm0, bmindex, bm0index, wmindex, bkindex, wkindex));
+}
 
-	/* Calculate the checker (man) index. */
-	checker_index = bm0index + checker_index_base +
-					bmindex * bm0range +
-					(int64_t)wmindex * (int64_t)bm0range * (int64_t)bmrange;
 
-	index64 = (int64_t)wkindex + 
-				(int64_t)bkindex * (int64_t)wkrange +
-				(int64_t)(checker_index) * (int64_t)bkrange * (int64_t)wkrange;
-	return(index64);
+static int64_t position_to_index_slice_portable(EGDB_POSITION const *p, int bm, int bk, int wm, int wk)
+{
+	return(position_to_index_slice_isa<false>(p, bm, bk, wm, wk));
+}
+
+
+template <bool popcnt> ALWAYS_INLINE void get_piece_counts_isa(EGDB_POSITION const *p, int *bm, int *bk, int *wm, int *wk)
+{
+	*bm = bitcount64_isa<popcnt>(p->black & ~p->king);
+	*bk = bitcount64_isa<popcnt>(p->black & p->king);
+	*wm = bitcount64_isa<popcnt>(p->white & ~p->king);
+	*wk = bitcount64_isa<popcnt>(p->white & p->king);
+}
+
+
+static void get_piece_counts_portable(EGDB_POSITION const *p, int *bm, int *bk, int *wm, int *wk)
+{
+	get_piece_counts_isa<false>(p, bm, bk, wm, wk);
+}
+
+#ifdef EGDB_POPCNT
+
+TARGET_POPCNT
+static int64_t position_to_index_slice_popcnt(EGDB_POSITION const *p, int bm, int bk, int wm, int wk)
+{
+	return(position_to_index_slice_isa<true>(p, bm, bk, wm, wk));
+}
+
+
+TARGET_POPCNT
+static void get_piece_counts_popcnt(EGDB_POSITION const *p, int *bm, int *bk, int *wm, int *wk)
+{
+	get_piece_counts_isa<true>(p, bm, bk, wm, wk);
+}
+
+#endif
+
+#ifdef EGDB_BMI2
+
+/*
+ * The index of pieces whose squares are the set bits of squares, counting
+ * the pieces from square 0 up.
+ */
+TARGET_BMI2
+static inline uint32_t index_compact_squares(BITBOARD squares)
+{
+	int piece;
+	uint32_t index;
+
+	for (index = 0, piece = 1; squares; ++piece) {
+		index += choose(LSB64(squares), piece);
+		squares = clear_lsb(squares);
+	}
+	return(index);
+}
+
+
+/*
+ * The index of pieces whose squares are the set bits of squares, counting
+ * the pieces down from square num_squares - 1.
+ */
+TARGET_BMI2
+static inline uint32_t index_compact_squares_reverse(BITBOARD squares, int num_squares)
+{
+	int piece, bitnum;
+	uint32_t index;
+
+	for (index = 0, piece = 1; squares; ++piece) {
+		bitnum = MSB64(squares);
+		squares ^= (BITBOARD)1 << bitnum;
+		index += choose(num_squares - 1 - bitnum, piece);
+	}
+	return(index);
+}
+
+
+/*
+ * The same indices as position_to_index_slice_portable().  Extracting each piece type
+ * with _pext_u64 by the mask of the squares it can be on removes the ghost squares and
+ * the interfering pieces, so the bit number of each piece is already its logical square.
+ */
+TARGET_BMI2
+static int64_t position_to_index_slice_bmi2(EGDB_POSITION const *p, int bm, int bk, int wm, int wk)
+{
+	BITBOARD bm0_mask;
+	BITBOARD bmmask, bkmask, wmmask, wkmask;
+	int bm0;
+	uint32_t bmindex, bkindex, wmindex, wkindex, bm0index;
+
+	bmmask = p->black & ~p->king;
+	wmmask = p->white & ~p->king;
+	bkmask = p->black & p->king;
+	wkmask = p->white & p->king;
+	bm0_mask = bmmask & ROW0;
+	bm0 = bitcount64_isa<true>(bm0_mask);
+
+	/* Rank0 is bits 0 to 4, so the black men there are already compact. */
+	bmindex = index_compact_squares(_pext_u64(bmmask ^ bm0_mask, ALL_SQUARES) >> ROWSIZE);
+	bm0index = index_compact_squares(bm0_mask);
+	wmindex = index_compact_squares_reverse(_pext_u64(wmmask, ALL_SQUARES & ~bmmask), MAXSQUARE - bm);
+	bkindex = index_compact_squares(_pext_u64(bkmask, ALL_SQUARES & ~(bmmask | wmmask)));
+	wkindex = index_compact_squares(_pext_u64(wkmask, ALL_SQUARES & ~(bmmask | wmmask | bkmask)));
+
+	return(combine_slice_index(bm, bk, wm, wk, bm0, bmindex, bm0index, wmindex, bkindex, wkindex));
+}
+
+
+/*
+ * Add to index[j] the index of the pieces on the set bits of squares[j], for m bitboards
+ * at once.  Each step handles the next piece of every bitboard, so the choose() loads 
+ * of different bitboards are independent and overlap.
+ */
+TARGET_BMI2
+static inline void index_compact_squares_n(BITBOARD *squares, uint32_t *index, int m)
+{
+	int j, piece;
+	BITBOARD remaining;
+
+	for (piece = 1, remaining = 1; remaining; ++piece) {
+		remaining = 0;
+		for (j = 0; j < m; ++j) {
+			if (squares[j]) {
+				index[j] += choose(LSB64(squares[j]), piece);
+				squares[j] = clear_lsb(squares[j]);
+				remaining |= squares[j];
+			}
+		}
+	}
+}
+
+
+TARGET_BMI2
+static inline void index_compact_squares_reverse_n(BITBOARD *squares, int const *num_squares, uint32_t *index, int m)
+{
+	int j, piece, bitnum;
+	BITBOARD remaining;
+
+	for (piece = 1, remaining = 1; remaining; ++piece) {
+		remaining = 0;
+		for (j = 0; j < m; ++j) {
+			if (squares[j]) {
+				bitnum = MSB64(squares[j]);
+				squares[j] ^= (BITBOARD)1 << bitnum;
+				index[j] += choose(num_squares[j] - 1 - bitnum, piece);
+				remaining |= squares[j];
+			}
+		}
+	}
+}
+
+
+/*
+ * position_to_index_slice_bmi2() for up to INDEX_BATCH_WIDTH positions, with the 
+ * piece loops of all the positions interleaved.
+ */
+TARGET_BMI2
+static void position_to_index_slice_batch_bmi2(int n, BITBOARD const *black, BITBOARD const *white, BITBOARD const *king,
+				int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices)
+{
+	int j, bm0[INDEX_BATCH_WIDTH], wm_squares[INDEX_BATCH_WIDTH];
+	BITBOARD bmmask, bkmask, wmmask, bm0_mask;
+	BITBOARD fwd[4 * INDEX_BATCH_WIDTH], rev[INDEX_BATCH_WIDTH];
+	uint32_t fwd_index[4 * INDEX_BATCH_WIDTH], rev_index[INDEX_BATCH_WIDTH];
+
+	/* fwd[] holds the bm, bm0, bk, and wk squares of each position, rev[] the wm squares. */
+	for (j = 0; j < n; ++j) {
+		bmmask = black[j] & ~king[j];
+		wmmask = white[j] & ~king[j];
+		bkmask = black[j] & king[j];
+		bm0_mask = bmmask & ROW0;
+		bm0[j] = bitcount64_isa<true>(bm0_mask);
+		fwd[4 * j] = _pext_u64(bmmask ^ bm0_mask, ALL_SQUARES) >> ROWSIZE;
+		fwd[4 * j + 1] = bm0_mask;
+		fwd[4 * j + 2] = _pext_u64(bkmask, ALL_SQUARES & ~(bmmask | wmmask));
+		fwd[4 * j + 3] = _pext_u64(white[j] & king[j], ALL_SQUARES & ~(bmmask | wmmask | bkmask));
+		rev[j] = _pext_u64(wmmask, ALL_SQUARES & ~bmmask);
+		wm_squares[j] = MAXSQUARE - bm[j];
+	}
+	std::fill(fwd_index, fwd_index + 4 * n, 0);
+	std::fill(rev_index, rev_index + n, 0);
+	index_compact_squares_n(fwd, fwd_index, 4 * n);
+	index_compact_squares_reverse_n(rev, wm_squares, rev_index, n);
+
+	for (j = 0; j < n; ++j)
+		indices[j] = combine_slice_index(bm[j], bk[j], wm[j], wk[j], bm0[j], fwd_index[4 * j], 
+						fwd_index[4 * j + 1], rev_index[j], fwd_index[4 * j + 2], fwd_index[4 * j + 3]);
+}
+
+#endif
+
+template <bool popcnt> ALWAYS_INLINE void position_to_index_slice_batch_isa(int n, BITBOARD const *black, BITBOARD const *white, 
+				BITBOARD const *king, int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices)
+{
+	int j;
+	EGDB_POSITION p;
+
+	for (j = 0; j < n; ++j) {
+		p.black = black[j];
+		p.white = white[j];
+		p.king = king[j];
+		indices[j] = position_to_index_slice_isa<popcnt>(&p, bm[j], bk[j], wm[j], wk[j]);
+	}
+}
+
+
+static void position_to_index_slice_batch_portable(int n, BITBOARD const *black, BITBOARD const *white, BITBOARD const *king,
+				int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices)
+{
+	position_to_index_slice_batch_isa<false>(n, black, white, king, bm, bk, wm, wk, indices);
+}
+
+#ifdef EGDB_POPCNT
+
+TARGET_POPCNT
+static void position_to_index_slice_batch_popcnt(int n, BITBOARD const *black, BITBOARD const *white, BITBOARD const *king,
+				int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices)
+{
+	position_to_index_slice_batch_isa<true>(n, black, white, king, bm, bk, wm, wk, indices);
+}
+
+#endif
+
+/* Slices numbered by their piece counts, for the tables of index functions by slice. */
+#define SLICE_SIGS ((MAXPIECE + 1) * (MAXPIECE + 1) * (MAXPIECE + 1) * (MAXPIECE + 1))
+#define SLICE_SIG(bm, bk, wm, wk) ((((bm) * (MAXPIECE + 1) + (bk)) * (MAXPIECE + 1) + (wm)) * (MAXPIECE + 1) + (wk))
+#define SIG_BM(sig) ((sig) / ((MAXPIECE + 1) * (MAXPIECE + 1) * (MAXPIECE + 1)))
+#define SIG_BK(sig) ((sig) / ((MAXPIECE + 1) * (MAXPIECE + 1)) % (MAXPIECE + 1))
+#define SIG_WM(sig) ((sig) / (MAXPIECE + 1) % (MAXPIECE + 1))
+#define SIG_WK(sig) ((sig) % (MAXPIECE + 1))
+#define SLICE_SIG_TABLE(f) TABLE_1024(f, 0), TABLE_256(f, 1024), TABLE_16(f, 1280)
+
+static_assert(SLICE_SIGS == 1296, "SLICE_SIG_TABLE is written for 6 x 6 x 6 x 6 slices");
+
+typedef int64_t (*SLICE_INDEX_FN)(EGDB_POSITION const *p, int bm, int bk, int wm, int wk);
+
+#define SLICE_INDEX_PORTABLE(sig) position_to_index_slice_portable
+
+static SLICE_INDEX_FN const slice_index_portable[SLICE_SIGS] = {
+	SLICE_SIG_TABLE(SLICE_INDEX_PORTABLE)
+};
+
+#ifdef EGDB_POPCNT
+
+#define MAXPIECES_SPECIALIZED 8		/* the largest slices with their own index function. */
+
+/*
+ * index_pieces_1_type<true>() and index_pieces_1_type_reverse<true>() for exactly n
+ * pieces, so that the loops can be unrolled.
+ */
+template <int n> ALWAYS_INLINE uint32_t index_pieces_n(BITBOARD bb, BITBOARD interfering)
+{
+	int piece, bitnum;
+	uint32_t index;
+
+	for (index = 0, piece = 1; piece <= n; ++piece) {
+		bitnum = LSB64(bb);
+		bb = clear_lsb(bb);
+		index += choose(bitnum_to_square0(bitnum) - bitcount64_isa<true>(interfering & (((BITBOARD)1 << bitnum) - 1)), piece);
+	}
+	return(index);
+}
+
+
+template <int n> ALWAYS_INLINE uint32_t index_pieces_n_reverse(BITBOARD bb, BITBOARD interfering)
+{
+	int piece, bitnum;
+	uint32_t index;
+
+	for (index = 0, piece = 1; piece <= n; ++piece) {
+		bitnum = MSB64(bb);
+		bb ^= (BITBOARD)1 << bitnum;
+		index += choose(MAXSQUARE - 1 - bitnum_to_square0(bitnum) - 
+					bitcount64_isa<true>(interfering & ~(((BITBOARD)1 << bitnum) - 1)), piece);
+	}
+	return(index);
+}
+
+
+/*
+ * combine_slice_index() for one slice.  The king ranges and the man index bases are 
+ * constants; only the split of the black men between rank0 and the other squares is
+ * left to run time.
+ */
+template <int bm, int bk, int wm, int wk> ALWAYS_INLINE int64_t combine_slice_index_sig(int bm0, uint32_t bmindex,
+				uint32_t bm0index, uint32_t wmindex, uint32_t bkindex, uint32_t wkindex)
+{
+	int64_t checker_index;
+	int64_t const bkrange = binomial_coefficient(MAXSQUARE - bm - wm, bk);
+	int64_t const wkrange = binomial_coefficient(MAXSQUARE - bm - wm - bk, wk);
+
+	checker_index = bm0index + man_index_base[bm][wm][bm0] + (bmindex + 
+					(int64_t)wmindex * choose(MAXSQUARE - 2 * ROWSIZE, bm - bm0)) * choose(ROWSIZE, bm0);
+	return((int64_t)wkindex + (int64_t)bkindex * wkrange + checker_index * (bkrange * wkrange));
+}
+
+
+/*
+ * position_to_index_slice_popcnt() for one slice, with fixed length loops over the 
+ * white men and the kings.
+ */
+template <int bm, int bk, int wm, int wk> TARGET_POPCNT
+static int64_t position_to_index_slice_sig_popcnt(EGDB_POSITION const *p, int, int, int, int)
+{
+	BITBOARD bm0_mask;
+	BITBOARD bmmask, bkmask, wmmask, wkmask;
+	int bm0;
+	uint32_t bmindex, bkindex, wmindex, wkindex, bm0index;
+
+	bmmask = p->black & ~p->king;
+	wmmask = p->white & ~p->king;
+	bkmask = p->black & p->king;
+	wkmask = p->white & p->king;
+	bm0_mask = bmmask & ROW0;
+	bm0 = bitcount64_isa<true>(bm0_mask);
+
+	bmindex = index_pieces_1_type(bmmask ^ bm0_mask, ROWSIZE);
+	bm0index = index_pieces_1_type(bm0_mask, 0);
+	wmindex = index_pieces_n_reverse<wm>(wmmask, bmmask);
+	bkindex = index_pieces_n<bk>(bkmask, bmmask | wmmask);
+	wkindex = index_pieces_n<wk>(wkmask, bmmask | wmmask | bkmask);
+
+	return(combine_slice_index_sig<bm, bk, wm, wk>(bm0, bmindex, bm0index, wmindex, bkindex, wkindex));
+}
+
+#ifdef EGDB_BMI2
+
+/*
+ * index_compact_squares() and index_compact_squares_reverse() for exactly n pieces.
+ */
+template <int n> ALWAYS_INLINE uint32_t index_compact_squares_n(BITBOARD squares)
+{
+	int piece;
+	uint32_t index;
+
+	for (index = 0, piece = 1; piece <= n; ++piece) {
+		index += choose(LSB64(squares), piece);
+		squares = clear_lsb(squares);
+	}
+	return(index);
+}
+
+
+template <int n, int num_squares> ALWAYS_INLINE uint32_t index_compact_squares_reverse_n(BITBOARD squares)
+{
+	int piece, bitnum;
+	uint32_t index;
+
+	for (index = 0, piece = 1; piece <= n; ++piece) {
+		bitnum = MSB64(squares);
+		squares ^= (BITBOARD)1 << bitnum;
+		index += choose(num_squares - 1 - bitnum, piece);
+	}
+	return(index);
+}
+
+
+/*
+ * position_to_index_slice_bmi2() for one slice.
+ */
+template <int bm, int bk, int wm, int wk> TARGET_BMI2
+static int64_t position_to_index_slice_sig_bmi2(EGDB_POSITION const *p, int, int, int, int)
+{
+	BITBOARD bm0_mask;
+	BITBOARD bmmask, bkmask, wmmask, wkmask;
+	int bm0;
+	uint32_t bmindex, bkindex, wmindex, wkindex, bm0index;
+
+	bmmask = p->black & ~p->king;
+	wmmask = p->white & ~p->king;
+	bkmask = p->black & p->king;
+	wkmask = p->white & p->king;
+	bm0_mask = bmmask & ROW0;
+	bm0 = bitcount64_isa<true>(bm0_mask);
+
+	bmindex = index_compact_squares(_pext_u64(bmmask ^ bm0_mask, ALL_SQUARES) >> ROWSIZE);
+	bm0index = index_compact_squares(bm0_mask);
+	wmindex = index_compact_squares_reverse_n<wm, MAXSQUARE - bm>(_pext_u64(wmmask, ALL_SQUARES & ~bmmask));
+	bkindex = index_compact_squares_n<bk>(_pext_u64(bkmask, ALL_SQUARES & ~(bmmask | wmmask)));
+	wkindex = index_compact_squares_n<wk>(_pext_u64(wkmask, ALL_SQUARES & ~(bmmask | wmmask | bkmask)));
+
+	return(combine_slice_index_sig<bm, bk, wm, wk>(bm0, bmindex, bm0index, wmindex, bkindex, wkindex));
+}
+
+#endif
+
+/*
+ * The index functions of slice (bm, bk, wm, wk): its own instantiations up to
+ * MAXPIECES_SPECIALIZED pieces, else the generic ones.
+ */
+template <int bm, int bk, int wm, int wk, bool specialized = 
+			(bm + bk <= MAXPIECE && wm + wk <= MAXPIECE && bm + bk + wm + wk <= MAXPIECES_SPECIALIZED)>
+struct SLICE_INDEX_SIG {
+	static constexpr SLICE_INDEX_FN popcnt = position_to_index_slice_popcnt;
+#ifdef EGDB_BMI2
+	static constexpr SLICE_INDEX_FN bmi2 = position_to_index_slice_bmi2;
+#endif
+};
+
+template <int bm, int bk, int wm, int wk>
+struct SLICE_INDEX_SIG<bm, bk, wm, wk, true> {
+	static constexpr SLICE_INDEX_FN popcnt = position_to_index_slice_sig_popcnt<bm, bk, wm, wk>;
+#ifdef EGDB_BMI2
+	static constexpr SLICE_INDEX_FN bmi2 = position_to_index_slice_sig_bmi2<bm, bk, wm, wk>;
+#endif
+};
+
+#define SLICE_INDEX_POPCNT(sig) SLICE_INDEX_SIG<SIG_BM(sig), SIG_BK(sig), SIG_WM(sig), SIG_WK(sig)>::popcnt
+#define SLICE_INDEX_BMI2(sig) SLICE_INDEX_SIG<SIG_BM(sig), SIG_BK(sig), SIG_WM(sig), SIG_WK(sig)>::bmi2
+
+static SLICE_INDEX_FN const slice_index_popcnt[SLICE_SIGS] = {
+	SLICE_SIG_TABLE(SLICE_INDEX_POPCNT)
+};
+
+#ifdef EGDB_BMI2
+
+static SLICE_INDEX_FN const slice_index_bmi2[SLICE_SIGS] = {
+	SLICE_SIG_TABLE(SLICE_INDEX_BMI2)
+};
+
+#endif
+
+#endif
+
+/* The variants for this cpu, selected by init_indexing(). */
+static void (*get_piece_counts_fn)(EGDB_POSITION const *p, int *bm, int *bk, int *wm, int *wk) = get_piece_counts_portable;
+static SLICE_INDEX_FN const *slice_index_fns = slice_index_portable;
+static void (*position_to_index_slice_batch_fn)(int n, BITBOARD const *black, BITBOARD const *white, BITBOARD const *king,
+				int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices) = position_to_index_slice_batch_portable;
+
+
+/*
+ * Set the number of black men, black kings, white men and white kings of a position.
+ */
+void get_piece_counts(EGDB_POSITION const *p, int *bm, int *bk, int *wm, int *wk)
+{
+	(*get_piece_counts_fn)(p, bm, bk, wm, wk);
+}
+
+
+int64_t position_to_index_slice(EGDB_POSITION const *p, int bm, int bk, int wm, int wk)
+{
+	return((*slice_index_fns[SLICE_SIG(bm, bk, wm, wk)])(p, bm, bk, wm, wk));
+}
+
+
+/*
+ * Compute the slice indices of n positions given as arrays of black, white and
+ * king bitboards, and the counts of each piece type of each position.
+ */
+void position_to_index_slice_batch(int n, BITBOARD const *black, BITBOARD const *white, BITBOARD const *king,
+				int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices)
+{
+	int i, width;
+
+	for (i = 0; i < n; i += width) {
+		width = (std::min)(n - i, INDEX_BATCH_WIDTH);
+		(*position_to_index_slice_batch_fn)(width, black + i, white + i, king + i, bm + i, bk + i, wm + i, wk + i, indices + i);
+	}
 }
 
 
@@ -194,28 +703,28 @@ int64_t mirror_position_to_index_slice(EGDB_POSITION const *p, int bm, int bk, i
 	checker_index_base = man_index_base[wm][bm][wm0];
 
 	/* Set the index for the white men that are not on rank9. */
-	wmindex = index_pieces_1_type_reverse(wmmask ^ wm0_mask, ROW9);
+	wmindex = index_pieces_1_type_reverse<false>(wmmask ^ wm0_mask, ROW9);
 
 	/* Set the index for the white men that are on rank9. */
-	wm0index = index_pieces_1_type_reverse(wm0_mask, 0);
+	wm0index = index_pieces_1_type_reverse<false>(wm0_mask, 0);
 
 	/* Set the index for the black men,
 	 * accounting for any interferences from the white men.
 	 */
 	bmmask = p->black & ~p->king;
-	bmindex = index_pieces_1_type(bmmask, wmmask);
+	bmindex = index_pieces_1_type<false>(bmmask, wmmask);
 
 	/* Set the index for the white kings, accounting for any interferences
 	 * from the black men and white men.
 	 */
 	wkmask = p->white & p->king;
-	wkindex = index_pieces_1_type_reverse(wkmask, bmmask | wmmask);
+	wkindex = index_pieces_1_type_reverse<false>(wkmask, bmmask | wmmask);
 
 	/* Set the index for the black kings, accounting for any interferences
 	 * from the black men, white men, and white kings.
 	 */
 	bkmask = p->black & p->king;
-	bkindex = index_pieces_1_type_reverse(bkmask, bmmask | wmmask | wkmask);
+	bkindex = index_pieces_1_type_reverse<false>(bkmask, bmmask | wmmask | wkmask);
 
 	wmrange = choose(MAXSQUARE - 2 * ROWSIZE, wm - wm0);
 	wm0range = choose(ROWSIZE, wm0);
@@ -259,7 +768,6 @@ void indextoposition_slice(int64_t index, EGDB_POSITION *p, int bm, int bk, int
 	index -= checker_index * multiplier;
 
 	/* Find bm0. */
-	assert(did_build_man_index_base);
 	for (bm0 = (std::min)(bm, ROWSIZE); bm0 > 0; --bm0)
 		if (man_index_base[bm][wm][bm0 - 1] > checker_index)
 			break;
@@ -307,27 +815,204 @@ void indextoposition_slice(int64_t index, EGDB_POSITION *p, int bm, int bk, int
 }
 
 
-void build_man_index_base()
+/* The squares that black men who are not on rank0 can be on. */
+#define BM_SQUARES (ALL_SQUARES & ~(ROW0 | ROW9))
+
+/* The squares that white men can be on, given the black men. */
+#define WM_SQUARES(bmmask) (ALL_SQUARES & ~(ROW0 | (bmmask)))
+
+
+/*
+ * The lowest n squares of domain.
+ */
+static inline BITBOARD first_squares(BITBOARD domain, int n)
 {
-	int bm, wm, bm0;
-	int64_t base, partial;
+	BITBOARD squares;
+
+	for (squares = 0; n > 0; --n) {
+		squares |= get_lsb(domain);
+		domain = clear_lsb(domain);
+	}
+	return(squares);
+}
+
 
-	for (bm = 0; bm <= MAXPIECE; ++bm) {
-		for (wm = 0; wm <= MAXPIECE; ++wm) {
-			base = 0;
-			for (bm0 = (std::min)(ROWSIZE, bm); bm0 >= 0; --bm0) {
-				man_index_base[bm][wm][bm0] = base;
+/*
+ * Advance *squares to the next set of the same number of squares of domain, in the order of
+ * index_pieces_1_type().  That order is the numeric order of the bitboards, so this is the
+ * usual next-combination step with the carries skipping the squares outside domain.
+ * Returns false, and sets the first set of squares, when it wraps around.
+ */
+static inline bool next_squares(BITBOARD *squares, BITBOARD domain)
+{
+	BITBOARD lowest, ripple;
+	int n;
+
+	if (*squares == 0)
+		return(false);
+
+	lowest = get_lsb(*squares);
+	ripple = ((*squares | ~domain) + lowest) & domain;
+	n = bitcount64(*squares & ~ripple) - 1;
+	if (ripple == 0) {
+		*squares = first_squares(domain, n + 1);
+		return(false);
+	}
+	*squares = ripple | first_squares(domain, n);
+	return(true);
+}
 
-				/* First the number of men configurations excluding black's backrank. */
-				partial = (int64_t)choose(MAXSQUARE - 2 * ROWSIZE, bm - bm0) * (int64_t)choose(MAXSQUARE - ROWSIZE - bm + bm0, wm);
 
-				/* Add the contribution from black's kingrow. */
-				partial *= choose(ROWSIZE, bm0);
-				base += partial;
-			}
+/*
+ * The white men on the squares of domain given by wm_logical, counting from the top.
+ */
+static inline BITBOARD wm_logical_to_squares(uint64_t wm_logical, BITBOARD domain)
+{
+	int bitnum;
+	BITBOARD squares;
+
+	for (squares = 0; wm_logical; wm_logical >>= 1) {
+		bitnum = MSB64(domain);
+		domain ^= (BITBOARD)1 << bitnum;
+		if (wm_logical & 1)
+			squares |= (BITBOARD)1 << bitnum;
+	}
+	return(squares);
+}
+
+
+static inline uint64_t wm_squares_to_logical(BITBOARD squares, BITBOARD domain)
+{
+	int bitnum, j;
+	uint64_t wm_logical;
+
+	for (wm_logical = 0, j = 0; squares; ++j) {
+		bitnum = MSB64(domain);
+		domain ^= (BITBOARD)1 << bitnum;
+		if (squares & ((BITBOARD)1 << bitnum)) {
+			wm_logical |= (uint64_t)1 << j;
+			squares ^= (BITBOARD)1 << bitnum;
 		}
 	}
-	did_build_man_index_base = true;
+	return(wm_logical);
+}
+
+
+/*
+ * Start iterating over slice (bm, bk, wm, wk) at index.
+ */
+void slice_iterator_seek(SLICE_ITERATOR *it, int64_t index, int bm, int bk, int wm, int wk)
+{
+	BITBOARD bmmask;
+
+	it->bm = bm;
+	it->bk = bk;
+	it->wm = wm;
+	it->wk = wk;
+	it->index = index;
+	indextoposition_slice(index, &it->pos, bm, bk, wm, wk);
+	bmmask = it->pos.black & ~it->pos.king;
+	it->bm0 = bitcount64(bmmask & ROW0);
+	it->wm_logical = wm_squares_to_logical(it->pos.white & ~it->pos.king, WM_SQUARES(bmmask));
+}
+
+
+/*
+ * Step to the position at the next index, and return false if there are no more.
+ * The piece types advance in the order in which they are multiplied into the index:
+ * white kings, black kings, black men on rank0, the other black men, white men, and
+ * last the number of black men on rank0, which goes down.  The types before the one
+ * that advanced restart at their first squares; the white men keep their logical
+ * squares but are placed again if the black men moved.
+ */
+bool slice_iterator_next(SLICE_ITERATOR *it)
+{
+	int wm_squares;
+	uint64_t lowest, ripple;
+	BITBOARD bm0mask, bmmask, wmmask, bkmask, wkmask;
+
+	bmmask = it->pos.black & ~it->pos.king;
+	bm0mask = bmmask & ROW0;
+	bmmask ^= bm0mask;
+	wmmask = it->pos.white & ~it->pos.king;
+	bkmask = it->pos.black & it->pos.king;
+	wkmask = it->pos.white & it->pos.king;
+	++it->index;
+
+	if (next_squares(&wkmask, ALL_SQUARES & ~(bm0mask | bmmask | wmmask | bkmask)))
+		goto done;
+	if (next_squares(&bkmask, ALL_SQUARES & ~(bm0mask | bmmask | wmmask)))
+		goto white_kings;
+	if (next_squares(&bm0mask, ROW0))
+		goto black_kings;
+	if (next_squares(&bmmask, BM_SQUARES))
+		goto white_men;
+
+	/* Next white men, as logical squares. */
+	wm_squares = MAXSQUARE - ROWSIZE - (it->bm - it->bm0);
+	if (it->wm_logical) {
+		lowest = it->wm_logical & (0 - it->wm_logical);
+		ripple = it->wm_logical + lowest;
+		it->wm_logical = ripple | (((it->wm_logical ^ ripple) >> 2) / lowest);
+		if (it->wm_logical < ((uint64_t)1 << wm_squares))
+			goto white_men;
+	}
+
+	/* Next number of black men on rank0. */
+	if (it->bm0 == 0)
+		return(false);
+	--it->bm0;
+	bm0mask = first_squares(ROW0, it->bm0);
+	bmmask = first_squares(BM_SQUARES, it->bm - it->bm0);
+	it->wm_logical = ((uint64_t)1 << it->wm) - 1;
+
+white_men:
+	wmmask = wm_logical_to_squares(it->wm_logical, WM_SQUARES(bmmask));
+
+black_kings:
+	bkmask = first_squares(ALL_SQUARES & ~(bm0mask | bmmask | wmmask), it->bk);
+
+white_kings:
+	wkmask = first_squares(ALL_SQUARES & ~(bm0mask | bmmask | wmmask | bkmask), it->wk);
+
+done:
+	it->pos.black = bm0mask | bmmask | bkmask;
+	it->pos.white = wmmask | wkmask;
+	it->pos.king = bkmask | wkmask;
+	return(true);
+}
+
+
+static void select_indexing_fns()
+{
+#ifdef EGDB_POPCNT
+	if (check_cpu_has_popcount()) {
+		get_piece_counts_fn = get_piece_counts_popcnt;
+		slice_index_fns = slice_index_popcnt;
+		position_to_index_slice_batch_fn = position_to_index_slice_batch_popcnt;
+	}
+#endif
+#ifdef EGDB_BMI2
+
+	/* Where pext is slow the popcnt functions are kept. */
+	if (check_cpu_has_fast_pext()) {
+		slice_index_fns = slice_index_bmi2;
+		position_to_index_slice_batch_fn = position_to_index_slice_batch_bmi2;
+	}
+#endif
+}
+
+
+/*
+ * Select the indexing functions for this cpu, so that the lookups have no 
+ * cpu feature tests.  This is done once, by the first driver that is opened, 
+ * because lookups in other drivers may be reading the function pointers.
+ */
+void init_indexing()
+{
+	static std::once_flag selected;
+
+	std::call_once(selected, select_indexing_fns);
 }
 
 
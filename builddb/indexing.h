@@ -15,6 +15,21 @@ namespace egdb_interface {
 #define MAX_SUBSLICE_INDICES (int64_t)(0x80000000)
 #define DTW_SUBSLICE_INDICES (int64_t)(0x40000000)
 #define GHOSTS (((BITBOARD)1 << 10) | ((BITBOARD)1 << 21) | ((BITBOARD)1 << 32) | ((BITBOARD)1 << 43))
+#define INDEX_BATCH_WIDTH 4		/* positions indexed together by position_to_index_slice_batch(). */
+
+/*
+ * Visits the positions of a slice in index order.  Each piece type is advanced to its
+ * next combination of squares like a digit of a counter, so a step costs about the
+ * same as incrementing the index.  See slice_iterator_seek() and slice_iterator_next().
+ */
+typedef struct {
+	EGDB_POSITION pos;				/* the position at index. */
+	int64_t index;
+	int bm, bk, wm, wk;				/* the slice. */
+	int bm0;						/* black men on rank0. */
+	uint64_t wm_logical;			/* bit j is set if a white man is on the j'th square from the top
+									 * that is not taken by a black man. */
+} SLICE_ITERATOR;
 
 BITBOARD free_square_bitboard_fwd(int logical_square, BITBOARD occupied);
 BITBOARD free_square_bitboard_rev(int logical_square, BITBOARD occupied);
@@ -22,9 +37,14 @@ BITBOARD index2bitboard_fwd(unsigned int index, int num_squares, int first_squar
 BITBOARD index2bitboard_fwd(unsigned int index, int num_squares, int num_pieces, BITBOARD occupied);
 BITBOARD index2bitboard_rev(unsigned int index, int num_squares, int num_pieces, BITBOARD occupied);
 
+void get_piece_counts(EGDB_POSITION const *p, int *bm, int *bk, int *wm, int *wk);
 int64_t position_to_index_slice(EGDB_POSITION const *p, int bm, int bk, int wm, int wk);
+void position_to_index_slice_batch(int n, BITBOARD const *black, BITBOARD const *white, BITBOARD const *king,
+				int const *bm, int const *bk, int const *wm, int const *wk, int64_t *indices);
 void indextoposition_slice(int64_t index, EGDB_POSITION *p, int bm, int bk, int wm, int wk);
-void build_man_index_base();
+void slice_iterator_seek(SLICE_ITERATOR *it, int64_t index, int bm, int bk, int wm, int wk);
+bool slice_iterator_next(SLICE_ITERATOR *it);
+void init_indexing();
 int64_t getdatabasesize_slice(int bm, int bk, int wm, int wk);
 int64_t getslicesize_gaps(int bm, int bk, int wm, int wk);
 
@@ -32,10 +52,7 @@ inline int64_t position_to_index_slice(EGDB_POSITION *p)
 {
 	int nbm, nbk, nwm, nwk;
 
-	nbm = bitcount64(p->black & ~p->king);
-	nbk = bitcount64(p->black & p->king);
-	nwm = bitcount64(p->white & ~p->king);
-	nwk = bitcount64(p->white & p->king);
+	get_piece_counts(p, &nbm, &nbk, &nwm, &nwk);
 	return(position_to_index_slice((EGDB_POSITION *)p, nbm, nbk, nwm, nwk));
 }
 
@@ -60,7 +77,10 @@ inline uint32_t index_pieces_1_type(BITBOARD bb, int offset)
 }
 
 
-inline uint32_t index_pieces_1_type(BITBOARD bb, BITBOARD interfering)
+/*
+ * The popcnt template argument selects the bitcount, see bitcount64_isa().
+ */
+template <bool popcnt> ALWAYS_INLINE uint32_t index_pieces_1_type(BITBOARD bb, BITBOARD interfering)
 {
 	int piece, bitnum, square0;
 	uint32_t index;
@@ -75,7 +95,7 @@ inline uint32_t index_pieces_1_type(BITBOARD bb, BITBOARD interfering)
 		 * squares 0....square-1.
 		 */
 		square0 = bitnum_to_square0(bitnum);
-		square0 -= bitcount64((interfering) & (((BITBOARD)1 << bitnum) - 1)); 
+		square0 -= bitcount64_isa<popcnt>((interfering) & (((BITBOARD)1 << bitnum) - 1)); 
 
 		/* Add to his index. */
 		index += choose(square0, piece);
@@ -84,7 +104,7 @@ inline uint32_t index_pieces_1_type(BITBOARD bb, BITBOARD interfering)
 }
 
 
-inline uint32_t index_pieces_1_type_reverse(BITBOARD bb, BITBOARD interfering)
+template <bool popcnt> ALWAYS_INLINE uint32_t index_pieces_1_type_reverse(BITBOARD bb, BITBOARD interfering)
 {
 	int piece, bitnum, square0;
 	uint32_t index;
@@ -101,7 +121,7 @@ inline uint32_t index_pieces_1_type_reverse(BITBOARD bb, BITBOARD interfering)
 		 * accounting for interfering pieces.
 		 */
 		square0 = MAXSQUARE - 1 - bitnum_to_square0(bitnum);
-		square0 -= bitcount64(interfering & ~(((BITBOARD)1 << bitnum) - 1));
+		square0 -= bitcount64_isa<popcnt>(interfering & ~(((BITBOARD)1 << bitnum) - 1));
 
 		/* Add to his index. */
 		index += choose(square0, piece);
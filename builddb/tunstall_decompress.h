@@ -5,3 +5,13 @@ typedef struct {
 	unsigned short *value_runs;
 } DECOMPRESS_CATALOG;
 
+#define VALUE_RUNS_END 6		/* the value that follows the last run of a symbol in value_runs. */
+#define MAX_SYMBOL_RUNS 8
+
+/* The runs of one symbol as cumulative run ends, so that the value at an offset within 
+ * the symbol is found with one simd compare.  Unused ends are INT16_MAX.
+ */
+typedef struct {
+	alignas(16) short end[MAX_SYMBOL_RUNS];
+	unsigned char value[MAX_SYMBOL_RUNS];
+} RUN_ENDS;
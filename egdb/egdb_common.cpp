@@ -6,19 +6,219 @@
 #include "engine/bitcount.h"
 #include "engine/board.h"
 #include "engine/bool.h"
+#include "engine/config.h"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+#ifdef USE_MULTI_THREADING
+#include <thread>
+#endif
 
 namespace egdb_interface {
 
+#define PROBE_KEY_MASK 0xffffffffffff0000ULL
+#define PROBE_VALUE_MASK 0xffffULL
+#define LOOKUP_SCAN_BLOCKSIZE 0x100000	/* positions in each task of a scan done with lookups. */
+
+/* Only definite values are kept.  EGDB_NOT_IN_CACHE and EGDB_SUBDB_UNAVAILABLE can
+ * change, and the drivers also return EGDB_UNKNOWN when a read fails.
+ */
+#define PROBE_CACHEABLE(value) ((value) > EGDB_UNKNOWN && (value) < (int)PROBE_VALUE_MASK)
+
+static inline uint64_t probe_hash(EGDB_POSITION const *position, int color)
+{
+	uint64_t h;
+
+	h = position->black * 0x9E3779B97F4A7C15ULL ^ position->white * 0xC2B2AE3D27D4EB4FULL ^
+		position->king * 0x165667B19E3779F9ULL ^ (uint64_t)color * 0x94D049BB133111EBULL;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return(h);
+}
+
 int egdb_lookup(EGDB_DRIVER *handle, EGDB_POSITION const *position, int color, int cl)
 {
-	return handle->lookup(handle, const_cast<EGDB_POSITION*>(position), color, cl);
+	int value;
+	uint64_t hash, entry;
+	PROBE_CACHE *pc = handle->probe_cache;
+
+	if (!pc)
+		return handle->lookup(handle, const_cast<EGDB_POSITION*>(position), color, cl);
+
+	hash = probe_hash(position, color);
+	entry = pc->entries[hash & pc->mask].load(std::memory_order_relaxed);
+	if (entry && (entry & PROBE_KEY_MASK) == (hash & PROBE_KEY_MASK)) {
+		pc->hits.fetch_add(1, std::memory_order_relaxed);
+		return((int)(entry & PROBE_VALUE_MASK) - 1);
+	}
+	pc->misses.fetch_add(1, std::memory_order_relaxed);
+	value = handle->lookup(handle, const_cast<EGDB_POSITION*>(position), color, cl);
+
+	if (PROBE_CACHEABLE(value))
+		pc->entries[hash & pc->mask].store((hash & PROBE_KEY_MASK) | (uint64_t)(value + 1), std::memory_order_relaxed);
+	return(value);
+}
+
+/*
+ * Look up n positions.  Drivers that can do so index the positions together and sort
+ * the ones that need a block of db data by block, so that each block is found in the
+ * cache, or read from the file, once for all of its positions.  If the driver has a
+ * probe cache, the positions found there are not passed to the driver.
+ */
+void egdb_lookup_batch(EGDB_DRIVER *handle, EGDB_POSITION const *positions, int const *colors, int n,
+						int *results, int flags)
+{
+	int i, k, m, base, count, cl;
+	uint64_t hash, entry;
+	PROBE_CACHE *pc = handle->probe_cache;
+	EGDB_POSITION miss_positions[PROBE_BATCH_SIZE];
+	int miss_colors[PROBE_BATCH_SIZE], miss_results[PROBE_BATCH_SIZE], misses[PROBE_BATCH_SIZE];
+
+	cl = flags & EGDB_BATCH_CONDITIONAL;
+	if (!handle->lookup_batch) {
+		for (i = 0; i < n; ++i)
+			results[i] = egdb_lookup(handle, positions + i, colors[i], cl);
+		return;
+	}
+	if (!pc) {
+		handle->lookup_batch(handle, positions, colors, n, results, cl);
+		return;
+	}
+
+	/* Pass the probe cache misses to the driver, then store their values as egdb_lookup() does. */
+	for (base = 0; base < n; base += PROBE_BATCH_SIZE) {
+		count = (std::min)(n - base, PROBE_BATCH_SIZE);
+		for (m = 0, i = base; i < base + count; ++i) {
+			hash = probe_hash(positions + i, colors[i]);
+			entry = pc->entries[hash & pc->mask].load(std::memory_order_relaxed);
+			if (entry && (entry & PROBE_KEY_MASK) == (hash & PROBE_KEY_MASK)) {
+				pc->hits.fetch_add(1, std::memory_order_relaxed);
+				results[i] = (int)(entry & PROBE_VALUE_MASK) - 1;
+			}
+			else {
+				pc->misses.fetch_add(1, std::memory_order_relaxed);
+				miss_positions[m] = positions[i];
+				miss_colors[m] = colors[i];
+				misses[m++] = i;
+			}
+		}
+		if (!m)
+			continue;
+		handle->lookup_batch(handle, miss_positions, miss_colors, m, miss_results, cl);
+		for (k = 0; k < m; ++k) {
+			i = misses[k];
+			results[i] = miss_results[k];
+			if (PROBE_CACHEABLE(results[i])) {
+				hash = probe_hash(positions + i, colors[i]);
+				pc->entries[hash & pc->mask].store((hash & PROBE_KEY_MASK) | (uint64_t)(results[i] + 1), std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+
+/*
+ * Scan a block of LOOKUP_SCAN_BLOCKSIZE positions by stepping an iterator through
+ * them and looking up each one.  This is used for drivers that cannot decode their
+ * data in index order.
+ */
+static void lookup_scan_task(SCAN_SLICE *scan, SCAN_TASK const *task)
+{
+	EGDB_DRIVER *handle = (EGDB_DRIVER *)scan->hdat;
+	int64_t first, last;
+	SLICE_ITERATOR it;
+	SCAN_RUN run;
+
+	first = task->subslice * MAX_SUBSLICE_INDICES + (int64_t)task->first_block * LOOKUP_SCAN_BLOCKSIZE;
+	last = (std::min)(first + (int64_t)task->num_blocks * LOOKUP_SCAN_BLOCKSIZE, scan->size);
+	run.scan = scan;
+	run.index = first;
+	run.count = 0;
+	run.value = INT_MIN;
+	slice_iterator_seek(&it, first, scan->bm, scan->bk, scan->wm, scan->wk);
+	do {
+		if (add_scan_run(&run, 1, handle->lookup(handle, &it.pos, scan->color, 0)))
+			return;
+	} while (it.index + 1 < last && slice_iterator_next(&it));
+	end_scan_run(&run);
+}
+
+
+/*
+ * Call fn with runs of positions that have the same value, for every position in the
+ * slice in index order.  Drivers that can do so decode their compressed data once
+ * instead of looking up each position.  The work is split into tasks of one or more
+ * index blocks that are run by num_threads threads, or one thread for each cpu if
+ * num_threads is 0.  fn is called concurrently from these threads; the runs of each
+ * task are passed in order, but the tasks can finish in any order, and a run does not
+ * extend past the end of its task.
+ * Returns 0 if the whole slice was scanned, the nonzero value returned by fn if it
+ * stopped the scan, or 1 if the piece counts are not a slice of the db or a block
+ * cannot be read.
+ */
+int egdb_scan_slice(EGDB_DRIVER *handle, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context, int num_threads)
+{
+	int k, max_pieces, max_pieces_1side;
+	int64_t first, count;
+	SCAN_SLICE scan;
+
+	if (egdb_get_pieces(handle, &max_pieces, &max_pieces_1side))
+		return(1);
+	if (bm < 0 || bk < 0 || wm < 0 || wk < 0 || bm + bk == 0 || wm + wk == 0)
+		return(1);
+	if (bm + bk + wm + wk > max_pieces || bm + bk > max_pieces_1side || wm + wk > max_pieces_1side)
+		return(1);
+
+	/* A slice that the db stores reversed has its positions in a different order. */
+	if (handle->scan_slice && !needs_reversal(bm, bk, wm, wk, color))
+		return handle->scan_slice(handle, bm, bk, wm, wk, color, fn, context, num_threads);
+
+	init_scan_slice(&scan, handle, 0, bm, bk, wm, wk, color, fn, context);
+	for (k = 0; k < get_num_subslices(bm, bk, wm, wk, MAX_SUBSLICE_INDICES); ++k) {
+		count = (std::min)(scan.size - k * MAX_SUBSLICE_INDICES, MAX_SUBSLICE_INDICES);
+		for (first = 0; first < count; first += LOOKUP_SCAN_BLOCKSIZE) {
+			SCAN_TASK task = {k, (int)(first / LOOKUP_SCAN_BLOCKSIZE), 1};
+			scan.tasks.push_back(task);
+		}
+	}
+	run_scan_tasks(&scan, num_threads, lookup_scan_task);
+	return(scan.status);
 }
 
 int egdb_close(EGDB_DRIVER *handle)
 {
+	free_probe_cache(handle->probe_cache);
+	handle->probe_cache = 0;
 	return handle->close(handle);
 }
 
+int egdb_extend(EGDB_DRIVER *handle, int maxpieces)
+{
+	if (!handle->extend)
+		return(1);
+	return handle->extend(handle, maxpieces);
+}
+
+int egdb_set_cache_mb(EGDB_DRIVER *handle, int cache_mb)
+{
+	if (!handle->set_cache_mb)
+		return(1);
+	return handle->set_cache_mb(handle, cache_mb);
+}
+
+int egdb_shed_cache(EGDB_DRIVER *handle, int mb)
+{
+	if (!handle->shed_cache)
+		return(1);
+	return handle->shed_cache(handle, mb);
+}
+
 int egdb_verify(EGDB_DRIVER const *handle, void (*msg_fn)(char const *msg), int *abort, EGDB_VERIFY_MSGS *msgs)
 {
 	return handle->verify(handle, msg_fn, abort, msgs);
@@ -32,11 +232,21 @@ int egdb_get_pieces(EGDB_DRIVER const *handle, int *max_pieces, int *max_pieces_
 void egdb_reset_stats(EGDB_DRIVER *handle)
 {
 	handle->reset_stats(handle);
+	if (handle->probe_cache) {
+		handle->probe_cache->hits.store(0, std::memory_order_relaxed);
+		handle->probe_cache->misses.store(0, std::memory_order_relaxed);
+	}
 }
 
 EGDB_STATS *egdb_get_stats(EGDB_DRIVER const *handle)
 {
-	return handle->get_stats(const_cast<EGDB_DRIVER*>(handle));
+	EGDB_STATS *stats = handle->get_stats(const_cast<EGDB_DRIVER*>(handle));
+
+	if (stats && handle->probe_cache) {
+		stats->probe_hits = handle->probe_cache->hits.load(std::memory_order_relaxed);
+		stats->probe_misses = handle->probe_cache->misses.load(std::memory_order_relaxed);
+	}
+	return(stats);
 }
 
 EGDB_TYPE egdb_get_type(EGDB_DRIVER const *handle)
@@ -71,6 +281,45 @@ bool is_mtc(EGDB_DRIVER const *handle)
 		return(false);
 }
 
+/*
+ * Allocate a probe cache of at most mb megabytes, with a power of 2 number of entries.
+ * Returns NULL if there is not enough memory.
+ */
+PROBE_CACHE *alloc_probe_cache(int mb, LARGE_PAGE_MODE large_pages, void (*msg_fn)(char const*))
+{
+	uint64_t entries;
+	char msg[MAXMSG];
+	PROBE_CACHE *pc;
+
+	for (entries = 1; 2 * entries * sizeof(uint64_t) <= (uint64_t)mb * ONE_MB; entries *= 2)
+		;
+	pc = (PROBE_CACHE *)std::calloc(1, sizeof(PROBE_CACHE));
+	if (!pc) {
+		(*msg_fn)("Cannot allocate memory for probe cache\n");
+		return(0);
+	}
+
+	pc->entries = (std::atomic<uint64_t> *)aligned_large_alloc(entries * sizeof(uint64_t), large_pages);
+	if (!pc->entries) {
+		std::free(pc);
+		(*msg_fn)("Cannot allocate memory for probe cache\n");
+		return(0);
+	}
+	std::memset((void *)pc->entries, 0, entries * sizeof(uint64_t));
+	pc->mask = entries - 1;
+	std::sprintf(msg, "Allocated %dkb for probe cache\n", (int)(entries * sizeof(uint64_t) / 1024));
+	(*msg_fn)(msg);
+	return(pc);
+}
+
+void free_probe_cache(PROBE_CACHE *pc)
+{
+	if (!pc)
+		return;
+	virtual_free(pc->entries);
+	std::free(pc);
+}
+
 int get_num_subslices(int bm, int bk, int wm, int wk, uint32_t subslice_size)
 {
 	int64_t size, last;
@@ -89,6 +338,107 @@ int get_num_subslices(int bm, int bk, int wm, int wk, uint32_t subslice_size)
 }
 
 
+/*
+ * Compute the slice indices of probes, INDEX_BATCH_WIDTH at a time.
+ */
+void index_probes(PROBE *probes, int n)
+{
+	int i, j, width;
+	int bm[INDEX_BATCH_WIDTH], bk[INDEX_BATCH_WIDTH], wm[INDEX_BATCH_WIDTH], wk[INDEX_BATCH_WIDTH];
+	int64_t indices[INDEX_BATCH_WIDTH];
+	BITBOARD black[INDEX_BATCH_WIDTH], white[INDEX_BATCH_WIDTH], king[INDEX_BATCH_WIDTH];
+
+	for (i = 0; i < n; i += INDEX_BATCH_WIDTH) {
+		width = (std::min)(n - i, INDEX_BATCH_WIDTH);
+		for (j = 0; j < width; ++j) {
+			black[j] = probes[i + j].pos.black;
+			white[j] = probes[i + j].pos.white;
+			king[j] = probes[i + j].pos.king;
+			bm[j] = probes[i + j].bm;
+			bk[j] = probes[i + j].bk;
+			wm[j] = probes[i + j].wm;
+			wk[j] = probes[i + j].wk;
+		}
+		position_to_index_slice_batch(width, black, white, king, bm, bk, wm, wk, indices);
+		for (j = 0; j < width; ++j)
+			probes[i + j].index = indices[j];
+	}
+}
+
+
+static bool probe_block_less(PROBE const &a, PROBE const &b)
+{
+	if (a.file != b.file)
+		return(std::less<void *>()(a.file, b.file));
+	return(a.blocknum < b.blocknum);
+}
+
+
+/*
+ * Sort probes by file and cache block, so that the probes of each block are together.
+ */
+void sort_probes(PROBE *probes, int n)
+{
+	std::sort(probes, probes + n, probe_block_less);
+}
+
+
+void init_scan_slice(SCAN_SLICE *scan, void *hdat, void *subdbs, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context)
+{
+	scan->hdat = hdat;
+	scan->subdbs = subdbs;
+	scan->bm = bm;
+	scan->bk = bk;
+	scan->wm = wm;
+	scan->wk = wk;
+	scan->color = color;
+	scan->size = getdatabasesize_slice(bm, bk, wm, wk);
+	scan->fn = fn;
+	scan->context = context;
+	scan->status = 0;
+}
+
+
+/*
+ * Run the tasks of a slice scan until there are none left or the scan is stopped.
+ */
+static void scan_worker(SCAN_SLICE *scan, void (*scan_task)(SCAN_SLICE *scan, SCAN_TASK const *task))
+{
+	size_t i;
+
+	while ((i = scan->next_task++) < scan->tasks.size() && !scan->status)
+		(*scan_task)(scan, &scan->tasks[i]);
+}
+
+
+/*
+ * Run the tasks of a slice scan, taking them in order from num_threads threads, or one
+ * thread for each cpu if num_threads is 0.  The tasks that have not started when the
+ * scan status becomes nonzero are skipped.
+ */
+void run_scan_tasks(SCAN_SLICE *scan, int num_threads, void (*scan_task)(SCAN_SLICE *scan, SCAN_TASK const *task))
+{
+	scan->next_task = 0;
+#ifdef USE_MULTI_THREADING
+	int i;
+	std::vector<std::thread> threads;
+
+	if (num_threads <= 0)
+		num_threads = (std::max)((int)std::thread::hardware_concurrency(), 1);
+	num_threads = (int)(std::min)((size_t)num_threads, scan->tasks.size());
+	for (i = 1; i < num_threads; ++i)
+		threads.push_back(std::thread(scan_worker, scan, scan_task));
+	scan_worker(scan, scan_task);
+	for (i = 0; i < (int)threads.size(); ++i)
+		threads[i].join();
+#else
+	(void)num_threads;
+	scan_worker(scan, scan_task);
+#endif
+}
+
+
 /*
  * Read size bytes from a file.
  * Since the file is read using ReadFile and the handle may have 
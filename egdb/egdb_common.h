@@ -1,7 +1,9 @@
 #pragma once
 #include "egdb/egdb_intl.h"
 #include "egdb/platform.h"
+#include <atomic>
 #include <ctime>
+#include <vector>
 
 namespace egdb_interface {
 
@@ -43,6 +45,24 @@ namespace egdb_interface {
 
 typedef uint32_t INDEX;
 
+/* The egdb_open() options that are passed to the driver and kept in its handle. */
+typedef struct {
+	LARGE_PAGE_MODE large_pages;	/* how aligned_large_alloc() gets memory. */
+	bool numa;						/* replicate the hot autoloaded data on each numa node. */
+	int decoded_cache_mb;			/* size of the decoded block cache, for drivers that have one. */
+} OPEN_OPTIONS;
+
+/* A table of lookup results shared by all threads without locking.  Each
+ * entry holds the high bits of the position hash and the value + 1, so it is
+ * written and read in one 64-bit access.  An entry of 0 is empty.
+ */
+struct PROBE_CACHE {
+	std::atomic<uint64_t> *entries;
+	uint64_t mask;				/* number of entries - 1. */
+	std::atomic<unsigned int> hits;
+	std::atomic<unsigned int> misses;
+};
+
 /* The driver handle type */
 struct EGDB_DRIVER {
 	int (*lookup)(EGDB_DRIVER *handle, EGDB_POSITION const *position, int color, int cl);
@@ -52,6 +72,14 @@ struct EGDB_DRIVER {
 	int (*close)(EGDB_DRIVER *handle);
 	int (*get_pieces)(EGDB_DRIVER const *handle, int *max_pieces, int *max_pieces_1side);
 	EGDB_TYPE (*get_type)(EGDB_DRIVER const *handle);
+	int (*extend)(EGDB_DRIVER *handle, int pieces);
+	int (*set_cache_mb)(EGDB_DRIVER *handle, int cache_mb);
+	int (*shed_cache)(EGDB_DRIVER *handle, int mb);
+	int (*scan_slice)(EGDB_DRIVER *handle, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context, int num_threads);
+	void (*lookup_batch)(EGDB_DRIVER *handle, EGDB_POSITION const *positions, int const *colors, int n,
+						int *results, int cl);
+	PROBE_CACHE *probe_cache;		/* consulted by egdb_lookup() if not null. */
 	void *internal_data;
 };
 
@@ -60,8 +88,65 @@ typedef struct {
 	unsigned int crc;
 } DBCRC;
 
+/* Returned by the probe functions of a driver's lookup when the value must be read from the db data. */
+#define PROBE_PENDING -100
+
+/* A position being looked up, with the slice and color that the db stores it under. */
+typedef struct {
+	EGDB_POSITION pos;			/* reversed if the db stores the position's slice reversed. */
+	int bm, bk, wm, wk, color;
+	int64_t index;				/* slice index of pos. */
+	void *subdb;				/* the driver's subdb that holds index. */
+	void *file;					/* the driver's db file of subdb. */
+	INDEX subindex;				/* index within the subslice of subdb. */
+	int idx_blocknum;			/* index block of subdb that holds subindex. */
+	int blocknum;				/* cache block of file that holds subindex. */
+	int promote;				/* true if the index block should go to the decoded block cache. */
+	int result;					/* the probe's entry in the caller's results[]. */
+} PROBE;
+
+/* Most probes that a driver's lookup_batch() handles at a time, in an array on the stack. */
+#define PROBE_BATCH_SIZE 256
+
+#define SCAN_TASK_BLOCKS 16		/* most index blocks in a task of a slice scan. */
+
+/* A part of a slice scan: num_blocks index blocks of a subslice, starting at first_block. */
+typedef struct {
+	int subslice;
+	int first_block;
+	int num_blocks;
+} SCAN_TASK;
+
+/* A slice scan shared by the threads that run its tasks. */
+typedef struct {
+	void *hdat;
+	void *subdbs;				/* the driver's subdbs of the slice when the tasks were made, or NULL. */
+	int bm, bk, wm, wk, color;
+	int64_t size;				/* number of positions in the slice. */
+	EGDB_SCAN_FN fn;
+	void *context;
+	std::vector<SCAN_TASK> tasks;
+	std::atomic<size_t> next_task;	/* the next task for a thread to run. */
+	std::atomic<int> status;	/* set nonzero to stop the scan. */
+} SCAN_SLICE;
+
+/* The pending run of a scan task, passed to the scan callback when the value changes. */
+typedef struct {
+	SCAN_SLICE *scan;
+	int64_t index;				/* slice index of the first position in the run. */
+	int64_t count;
+	int value;
+} SCAN_RUN;
+
 int get_num_subslices(int bm, int bk, int wm, int wk, uint32_t subslice_size);
+PROBE_CACHE *alloc_probe_cache(int mb, LARGE_PAGE_MODE large_pages, void (*msg_fn)(char const*));
+void free_probe_cache(PROBE_CACHE *pc);
 int read_file(FILE_HANDLE fp, unsigned char *buf, size_t size, int pagesize);
+void index_probes(PROBE *probes, int n);
+void sort_probes(PROBE *probes, int n);
+void init_scan_slice(SCAN_SLICE *scan, void *hdat, void *subdbs, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context);
+void run_scan_tasks(SCAN_SLICE *scan, int num_threads, void (*scan_task)(SCAN_SLICE *scan, SCAN_TASK const *task));
 
 
 inline double tdiff_secs(clock_t end, clock_t start)
@@ -86,6 +171,46 @@ inline int needs_reversal(int nbm, int nbk, int nwm, int nwk, int color)
 }
 
 
+/*
+ * Add count positions with value to a scan run.  Returns nonzero if the scan should stop.
+ */
+inline int add_scan_run(SCAN_RUN *run, int64_t count, int value)
+{
+	int status;
+
+	if (value == run->value) {
+		run->count += count;
+		return(0);
+	}
+	if (run->count) {
+		status = (*run->scan->fn)(run->index, run->count, run->value, run->scan->context);
+		if (status) {
+			run->scan->status = status;
+			return(status);
+		}
+	}
+	run->index += run->count;
+	run->count = count;
+	run->value = value;
+	return(run->scan->status);
+}
+
+
+/*
+ * Pass the last run of a scan task to the scan callback.
+ */
+inline void end_scan_run(SCAN_RUN *run)
+{
+	int status;
+
+	if (run->count && !run->scan->status) {
+		status = (*run->scan->fn)(run->index, run->count, run->value, run->scan->context);
+		if (status)
+			run->scan->status = status;
+	}
+}
+
+
 /*
  * Do a binary search to find the block number that contains the target index.
  * block_starts[] has the first index in each block[i].
@@ -208,6 +333,17 @@ template <class DBHANDLE_T> int needed_cache_buffers(DBHANDLE_T *hdat)
 }
 
 
+/*
+ * Return the size of the pages the os is using for the lru cache buffers.
+ */
+template <class DBHANDLE_T> unsigned int get_cache_page_size(DBHANDLE_T *hdat)
+{
+	if (hdat->ccbs && hdat->cacheblocks > 0)
+		return((unsigned int)get_large_page_size(hdat->ccbs[0].data));
+	return((unsigned int)get_page_size());
+}
+
+
 template <class DBCRC_T> DBCRC_T *find_file_crc(char const *name, DBCRC_T *table, int size)
 {
 	int i;
@@ -25,7 +25,6 @@
 
 namespace egdb_interface {
 
-#define CACHE_MINIBLOCK_LENGTHS 0
 const int miniblock_packed_bitlength = 17;
 
 #define INDEXSIZE 4		/* set to 4 or 8. */
@@ -41,6 +40,16 @@ const int miniblock_packed_bitlength = 17;
 
 #define MAXLINE 256
 
+/* Huffman codes up to this length are decoded with one table lookup. */
+#define HUFF_LOOKUP_BITS 10
+
+/* Re-pair symbols that expand to at most this many values are stored expanded,
+ * using at most REPAIR_EXPANSION_MAX_BYTES for the whole driver.
+ */
+#define REPAIR_EXPAND_MAX_LENGTH 64
+#define REPAIR_EXPANSION_MAX_BYTES (64 * ONE_MB)
+#define NO_EXPANSION 0xffffffff
+
 #define MIN_CACHE_BUF_BYTES (10 * ONE_MB)
 
 /* Allocate cache buffers CACHE_ALLOC_COUNT at a time. */
@@ -82,14 +91,17 @@ typedef struct {
 	int num_cacheblocks;	/* number of cache blocks in this db file. */
 	HANDLE fp;
 	int *cache_bufferi;		/* An array of indices into ccbs[], indexed by block number. */
-#if !CACHE_MINIBLOCK_LENGTHS
-	FILE *fp_idx;			/* handle to index file. */
-#endif
 #if LOG_HITS
 	int hits;
 #endif
 } DBFILE;
 
+/* An entry of the Huffman decode table, indexed by the next HUFF_LOOKUP_BITS of input. */
+struct Huffdecode {
+	uint16_t value;				/* re-pair symbol. */
+	uint8_t codelength;			/* 0 if the code is longer than HUFF_LOOKUP_BITS. */
+};
+
 // definition of a structure for compressed databases
 struct CPRSUBDB {
 	CPRSUBDB() {};
@@ -98,16 +110,16 @@ struct CPRSUBDB {
 	std::vector<uint16_t> repair_lengths;
 	std::vector<Huffcode> huffcodes;
 	std::vector<Huffman::Lengthtable> lengthtable;
+	std::vector<Huffdecode> decode_table;
+	int first_long_code;			/* index in lengthtable[] of the first length > HUFF_LOOKUP_BITS. */
+	std::vector<uint32_t> expansion_start;	/* index in expansions[] of each symbol, or NO_EXPANSION. empty if none. */
+	std::vector<uint16_t> expansions;		/* the values of the expanded symbols. */
 	std::vector<uint32_t> indices;
-	Packed_array miniblock_lengths;
+	std::vector<uint32_t> miniblock_starts;	/* first index of each miniblock, plus one past the last index. */
 	int num_idx_blocks;				/* number of index blocks in this subdb. */
 	int first_idx_block;			/* index block containing the first data value. */
 	uint16_t first_miniblock;		/* number of first miniblock within first_idx_block. */
 	DBFILE *file;					/* file info for this subdb */
-#if !CACHE_MINIBLOCK_LENGTHS
-	int miniblock_lengths_offset;	/* offset in the .idx file of the raw packed length data. */
-	uint32_t miniblock_lengths_size;
-#endif
 #if LOG_HITS
 	int hits;
 #endif
@@ -137,6 +149,7 @@ struct DBHANDLE {
 		cprsubdatabase = nullptr;
 		ccbs = nullptr;
 		ccbs_top = 0;
+		expansion_bytes = 0;
 	}
 
 	EGDB_TYPE db_type;
@@ -147,6 +160,7 @@ struct DBHANDLE {
 	DBP *cprsubdatabase;
 	CCB *ccbs;
 	int ccbs_top;		/* index into ccbs[] of least recently used block. */
+	int64_t expansion_bytes;	/* memory used for re-pair expansions. */
 	std::vector<DBFILE> dbfiles;
 	EGDB_STATS lookup_stats;
 	void log_msg(const char *fmt, ...)
@@ -231,36 +245,85 @@ static int needed_cache_buffers(DBHANDLE *hdat)
 	return(count);
 }
 
-#if !CACHE_MINIBLOCK_LENGTHS
-uint32_t get_miniblock_length(CPRSUBDB *subdb, int index)
+/*
+ * Build the table that decodes the codes of up to HUFF_LOOKUP_BITS bits from the 
+ * leading bits of the input.  lengthtable[] is sorted by increasing code length, so 
+ * the entries for those codes come first, and whether one of them matches depends 
+ * only on the leading HUFF_LOOKUP_BITS bits.
+ */
+static void build_decode_table(CPRSUBDB *subdb)
 {
-	const int nbits_ = miniblock_packed_bitlength;
-	const uint64_t mask_ = ((uint64_t)1 << nbits_) - 1;
-	int bits_copied, bitoffset;
-	size_t start;
-	union bytes64 {
-		uint64_t word64;
-		uint8_t word8[8];
-	};
-	bytes64 temp;
-
-	bitoffset = (index * (uint64_t)nbits_) & 7;
-	start = (index * (uint64_t)nbits_) / 8;
-	fseek(subdb->file->fp_idx, (int32_t)start + subdb->miniblock_lengths_offset, SEEK_SET);
-	temp.word8[0] = fgetc(subdb->file->fp_idx);
-	bits_copied = 8 - bitoffset;
-	for (int i = 1; bits_copied < nbits_; ++i, bits_copied += 8)
-		temp.word8[i] = fgetc(subdb->file->fp_idx);
-
-	temp.word64 >>= bitoffset;
-	temp.word64 &= mask_;
-	return((uint32_t)temp.word64);
+	int i, symidx;
+	uint32_t prefix, code;
+
+	for (i = 0; i < (int)subdb->lengthtable.size() && subdb->lengthtable[i].codelength <= HUFF_LOOKUP_BITS; ++i)
+		;
+	subdb->first_long_code = i;
+
+	subdb->decode_table.resize(1 << HUFF_LOOKUP_BITS);
+	for (prefix = 0; prefix < (1 << HUFF_LOOKUP_BITS); ++prefix) {
+		code = prefix << (32 - HUFF_LOOKUP_BITS);
+		for (i = 0; i < subdb->first_long_code && code < subdb->lengthtable[i].huffcode; ++i)
+			;
+		if (i < subdb->first_long_code) {
+			symidx = (code - subdb->lengthtable[i].huffcode) >> (32 - subdb->lengthtable[i].codelength);
+			symidx += subdb->lengthtable[i].codetable_index;
+			subdb->decode_table[prefix].value = subdb->huffcodes[symidx].value;
+			subdb->decode_table[prefix].codelength = subdb->lengthtable[i].codelength;
+		}
+		else {
+			subdb->decode_table[prefix].value = 0;
+			subdb->decode_table[prefix].codelength = 0;
+		}
+	}
 }
-#endif
+
+
+/*
+ * Store the values of each re-pair symbol of up to REPAIR_EXPAND_MAX_LENGTH values, 
+ * so decode() can index them instead of walking the symbol's tree.  Subdbs that would
+ * take hdat over REPAIR_EXPANSION_MAX_BYTES are not expanded.
+ * Returns the number of bytes allocated.
+ */
+static int64_t build_repair_expansions(DBHANDLE *hdat, CPRSUBDB *subdb)
+{
+	int64_t size;
+	uint16_t sym;
+	std::vector<uint16_t> stack;
+
+	size = subdb->repair_lengths.size() * sizeof(subdb->expansion_start[0]);
+	for (size_t i = 0; i < subdb->repair_lengths.size(); ++i)
+		if (subdb->repair_lengths[i] > 1 && subdb->repair_lengths[i] <= REPAIR_EXPAND_MAX_LENGTH)
+			size += subdb->repair_lengths[i] * sizeof(subdb->expansions[0]);
+	if (hdat->expansion_bytes + size > REPAIR_EXPANSION_MAX_BYTES)
+		return(0);
+
+	subdb->expansion_start.resize(subdb->repair_lengths.size(), NO_EXPANSION);
+	for (size_t i = 0; i < subdb->repair_lengths.size(); ++i) {
+		if (subdb->repair_lengths[i] <= 1 || subdb->repair_lengths[i] > REPAIR_EXPAND_MAX_LENGTH)
+			continue;
+
+		subdb->expansion_start[i] = (uint32_t)subdb->expansions.size();
+		stack.push_back((uint16_t)i);
+		while (!stack.empty()) {
+			sym = stack.back();
+			stack.pop_back();
+			if (subdb->repair_lengths[sym] == 1)
+				subdb->expansions.push_back(sym);
+			else {
+				stack.push_back(subdb->repair_syms[sym].right);
+				stack.push_back(subdb->repair_syms[sym].left);
+			}
+		}
+	}
+	hdat->expansion_bytes += size;
+	return(size);
+}
+
 
 int decode(uint32_t target_index, uint8_t *datap, CPRSUBDB *subdb)
 {
-	int i, symidx;
+	int i, symidx, codelength;
 	uint16_t repair_sym;
 	uint32_t index;
 	uint32_t *block;
@@ -283,25 +346,39 @@ int decode(uint32_t target_index, uint8_t *datap, CPRSUBDB *subdb)
 			bits_in_codebuf += 32;
 		}
 
-		/* Find the bit length of the next code. */
-		for (i = 0; codebuf.word32[1] < subdb->lengthtable[i].huffcode; ++i)
-			;
-
-		/* Get the re-pair symbol. */
-		symidx = (codebuf.word32[1] - subdb->lengthtable[i].huffcode) >> (32 - subdb->lengthtable[i].codelength);
-		symidx += subdb->lengthtable[i].codetable_index;
+		/* Short codes come straight from the decode table. */
+		Huffdecode const &entry = subdb->decode_table[codebuf.word32[1] >> (32 - HUFF_LOOKUP_BITS)];
+		if (entry.codelength) {
+			repair_sym = entry.value;
+			codelength = entry.codelength;
+		}
+		else {
+			/* Find the bit length of the next code among the long codes. */
+			for (i = subdb->first_long_code; codebuf.word32[1] < subdb->lengthtable[i].huffcode; ++i)
+				;
+
+			/* Get the re-pair symbol. */
+			symidx = (codebuf.word32[1] - subdb->lengthtable[i].huffcode) >> (32 - subdb->lengthtable[i].codelength);
+			symidx += subdb->lengthtable[i].codetable_index;
+			repair_sym = subdb->huffcodes[symidx].value;
+			codelength = subdb->lengthtable[i].codelength;
+		}
 
-		repair_sym = subdb->huffcodes[symidx].value;
 		if (index + subdb->repair_lengths[repair_sym] > target_index)
 			break;			/* Found the repair symbol containing the target value. */
 
 		index += subdb->repair_lengths[repair_sym];
-		codebuf.word64 <<= subdb->lengthtable[i].codelength;
-		bits_in_codebuf -= subdb->lengthtable[i].codelength;
+		codebuf.word64 <<= codelength;
+		bits_in_codebuf -= codelength;
 	}
 
-	/* Find the symbol within repair_sym tree that corresponds to target_index. */
+	/* Find the symbol within repair_sym tree that corresponds to target_index.
+	 * Once the walk reaches a symbol that is stored expanded, index it.
+	 */
 	while (subdb->repair_lengths[repair_sym] > 1) {
+		if (!subdb->expansion_start.empty() && subdb->expansion_start[repair_sym] != NO_EXPANSION)
+			return(subdb->expansions[subdb->expansion_start[repair_sym] + target_index - index]);
+
 		uint16_t child_sym = subdb->repair_syms[repair_sym].left;
 		if (index + subdb->repair_lengths[child_sym] > target_index)
 			repair_sym = child_sym;
@@ -347,10 +424,7 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	++hdat->lookup_stats.db_requests;
 
 	/* set bm, bk, wm, wk. */
-	bm = bitcount64(p->black & ~p->king);
-	wm = bitcount64(p->white & ~p->king);
-	bk = bitcount64(p->black & p->king);
-	wk = bitcount64(p->white & p->king);
+	get_piece_counts(p, &bm, &bk, &wm, &wk);
 
 	/* if one side has nothing, return depth 0 */
 	if ((bm + bk) == 0) {
@@ -449,30 +523,20 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	else
 		first_miniblock = minis_per_block * idx_blocknum;
 
-	/* Do a linear search to find the miniblock that has the position. */
-	uint32_t base_index = dbpointer->indices[idx_blocknum];
+	/* Search the at most minis_per_block starts of this index block for the miniblock 
+	 * that has the position. The last entry of miniblock_starts is one past the last index, 
+	 * so the search always stops within the subdb.
+	 */
+	uint32_t const *starts = &dbpointer->miniblock_starts[0];
 	uint32_t tablei = first_miniblock - dbpointer->first_miniblock;
-#if !CACHE_MINIBLOCK_LENGTHS
-		for ( ; tablei < dbpointer->miniblock_lengths_size; ++tablei) {
-			int length = get_miniblock_length(dbpointer, tablei);
-			if (base_index + length > index)
-				break;
+	while (starts[tablei + 1] <= index)
+		++tablei;
+	assert(tablei + 1 < dbpointer->miniblock_starts.size());
 
-			base_index += length;
-		}
-#else
-		for ( ; tablei < dbpointer->miniblock_lengths.size(); ++tablei) {
-			if (base_index + dbpointer->miniblock_lengths[tablei] > index)
-				break;
-
-			base_index += dbpointer->miniblock_lengths[tablei];
-		}
-		assert(tablei < dbpointer->miniblock_lengths.size());
-#endif
 	uint8_t *datap;
 	int retval;
 	datap = ccbp->data + ((tablei + dbpointer->first_miniblock) % minis_per_block) * miniblock_size;
-	retval = decode(index - base_index, datap, dbpointer);
+	retval = decode(index - starts[tablei], datap, dbpointer);
 	if (benchmarks) {
 		tdiff = timer.elapsed_usec();
 		hdat->log_msg("timer: decode %.2f usec\n", tdiff);
@@ -541,14 +605,8 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, const char *fi
 
 	init_bitcount();
 
-	/* initialize binomial coefficients. */
-	initbicoef();
-
-	/* initialize runlength and lookup array. */
-	init_compression_tables();
-
-	/* initialize man index base table. */
-	build_man_index_base();
+	/* select the indexing functions. */
+	init_indexing();
 
 	/* Allocate the cprsubdatabase array. */
 	hdat->cprsubdatabase = (DBP *)calloc(DBSIZE, sizeof(DBP));
@@ -635,6 +693,8 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, const char *fi
 	}
 	sprintf(msg, "Allocated %dkb for indexing\n", (int)((allocated_bytes) / 1024));
 	(*hdat->log_msg_fn)(msg);
+	sprintf(msg, "Allocated %dkb for re-pair expansions (included in indexing)\n", (int)(hdat->expansion_bytes / 1024));
+	(*hdat->log_msg_fn)(msg);
 
 	/* Figure out how much ram is left for lru cache buffers. */
 	i = needed_cache_buffers(hdat);
@@ -789,9 +849,6 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 	}
 
 	f->is_present = 1;
-#if !CACHE_MINIBLOCK_LENGTHS
-	f->fp_idx = fp;
-#endif
 	prev = 0;
 	total_minis = 0;
 	while (1) {
@@ -804,12 +861,14 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 		if (fread(&subslice_num, sizeof(subslice_num), 1, fp) != 1) {
 			sprintf(msg, "Error reading subslice data %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 		uint8_t permutation;
 		if (fread(&permutation, sizeof(permutation), 1, fp) != 1) {
 			sprintf(msg, "Error reading permutation %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 
@@ -821,6 +880,7 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 		if (subslice[0] != nbm + nbk + nwm + nwk) {
 			sprintf(msg, "Index file %s header inconsistent\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 
@@ -836,6 +896,7 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 			*allocated_bytes += dbp->num_subslices * sizeof(CPRSUBDB);
 			if (!dbp->subdb) {
 				(*hdat->log_msg_fn)("Cannot allocate subslice subdb\n");
+				fclose(fp);
 				return(1);
 			}
 		}
@@ -847,6 +908,7 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 		if (fread(&nsyms, sizeof(nsyms), 1, fp) != 1) {
 			sprintf(msg, "Error in %s reading nsyms\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 
@@ -857,11 +919,13 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 			if (fread(&rpsym.left, sizeof(rpsym.left), 1, fp) != 1) {
 				sprintf(msg, "Error reading rp syms from %s\n", name);
 				(*hdat->log_msg_fn)(msg);
+				fclose(fp);
 				return(1);
 			}
 			if (fread(&rpsym.right, sizeof(rpsym.right), 1, fp) != 1) {
 				sprintf(msg, "Error reading rp syms from %s\n", name);
 				(*hdat->log_msg_fn)(msg);
+				fclose(fp);
 				return(1);
 			}
 			dbpointer->repair_syms.push_back(rpsym);
@@ -870,11 +934,13 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 
 		get_symbol_lengths(dbpointer->repair_syms, dbpointer->repair_lengths);
 		*allocated_bytes += dbpointer->repair_lengths.size() * sizeof(dbpointer->repair_lengths[0]);
+		*allocated_bytes += build_repair_expansions(hdat, dbpointer);
 
 		/* Read the Huffman data. */
 		if (fread(&nsyms, sizeof(nsyms), 1, fp) != 1) {
 			sprintf(msg, "Error in %s reading nsyms\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 		dbpointer->huffcodes.reserve(nsyms);
@@ -885,11 +951,13 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 			if (fread(&huffcode.value, sizeof(huffcode.value), 1, fp) != 1) {
 				sprintf(msg, "Error reading huffcodes from %s\n", name);
 				(*hdat->log_msg_fn)(msg);
+				fclose(fp);
 				return(1);
 			}
 			if (fread(&huffcode.codelength, sizeof(huffcode.codelength), 1, fp) != 1) {
 				sprintf(msg, "Error reading huffcodes from %s\n", name);
 				(*hdat->log_msg_fn)(msg);
+				fclose(fp);
 				return(1);
 			}
 			dbpointer->huffcodes.push_back(huffcode);
@@ -899,17 +967,21 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 		generate_codes(dbpointer->huffcodes);
 		build_length_table(dbpointer->huffcodes, dbpointer->lengthtable);
 		*allocated_bytes += dbpointer->lengthtable.size() * sizeof(dbpointer->lengthtable[0]);
+		build_decode_table(dbpointer);
+		*allocated_bytes += dbpointer->decode_table.size() * sizeof(dbpointer->decode_table[0]);
 
 		/* Read the start blocknum. */
 		if (fread(&dbpointer->first_idx_block, sizeof(dbpointer->first_idx_block), 1, fp) != 1) {
 			sprintf(msg, "Error reading start blocknum from %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 
 		if (fread(&dbpointer->first_miniblock, sizeof(dbpointer->first_miniblock), 1, fp) != 1) {
 			sprintf(msg, "Error reading first miniblock num from %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 
@@ -917,6 +989,7 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 		if (fread(&dbpointer->num_idx_blocks, sizeof(dbpointer->num_idx_blocks), 1, fp) != 1) {
 			sprintf(msg, "Error reading num blocks from %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 		dbpointer->indices.reserve(dbpointer->num_idx_blocks);
@@ -927,40 +1000,39 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 		if (fread(&nminis, sizeof(nminis), 1, fp) != 1) {
 			sprintf(msg, "Error reading num mini blocks from %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
 		total_minis += nminis;
-		dbpointer->miniblock_lengths = Packed_array(miniblock_packed_bitlength);
-		dbpointer->miniblock_lengths.resize(nminis);
-#if !CACHE_MINIBLOCK_LENGTHS
-		dbpointer->miniblock_lengths_offset = ftell(dbpointer->file->fp_idx);
-		dbpointer->miniblock_lengths_size = nminis;
-#endif
-		size_t bytes_read = fread(dbpointer->miniblock_lengths.raw_buf(), 1, dbpointer->miniblock_lengths.raw_size(), fp);
-		if (bytes_read != dbpointer->miniblock_lengths.raw_size()) {
+		Packed_array miniblock_lengths(miniblock_packed_bitlength);
+		miniblock_lengths.resize(nminis);
+		size_t bytes_read = fread(miniblock_lengths.raw_buf(), 1, miniblock_lengths.raw_size(), fp);
+		if (bytes_read != miniblock_lengths.raw_size()) {
 			sprintf(msg, "Error reading miniblock data from %s\n", name);
 			(*hdat->log_msg_fn)(msg);
+			fclose(fp);
 			return(1);
 		}
-#if CACHE_MINIBLOCK_LENGTHS
-		*allocated_bytes += dbpointer->miniblock_lengths.raw_size();
-#endif
 
-		/* Write the block indexes using the miniblock lengths. */
+		/* Write the miniblock starts and the block indexes using the miniblock lengths. */
 		{
 			uint32_t index, count;
 			index = 0;
+			dbpointer->miniblock_starts.reserve(nminis + 1);
+			dbpointer->miniblock_starts.push_back(0);
 			dbpointer->indices.push_back(0);
 			count = 1;
-			for (size_t i = 1; i < dbpointer->miniblock_lengths.size(); ++i) {
-				index += dbpointer->miniblock_lengths[i - 1];
-				if (((i + dbpointer->first_miniblock) % minis_per_block) == 0) {
+			for (size_t i = 1; i <= miniblock_lengths.size(); ++i) {
+				index += miniblock_lengths[i - 1];
+				dbpointer->miniblock_starts.push_back(index);
+				if (i < miniblock_lengths.size() && ((i + dbpointer->first_miniblock) % minis_per_block) == 0) {
 					dbpointer->indices.push_back(index);
 					++count;
 				}
 			}
 			assert(count == dbpointer->indices.size());
 		}
+		*allocated_bytes += dbpointer->miniblock_starts.size() * sizeof(dbpointer->miniblock_starts[0]);
 		if (verbose)
 			hdat->log_msg("db%d-%d%d%d%d-%d%c:\n"
 					"\tfirst idx block %d\n"
@@ -969,16 +1041,10 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 					"\tnum miniblocks %zd\n",
 			subslice[0], nbm, nbk, nwm, nwk, subslice_num, color == EGDB_BLACK ? 'b' : 'w',
 				dbpointer->first_idx_block, dbpointer->first_miniblock, 
-				dbpointer->num_idx_blocks, dbpointer->miniblock_lengths.size());
-#if !CACHE_MINIBLOCK_LENGTHS
-		dbpointer->miniblock_lengths.clear();
-		dbpointer->miniblock_lengths.shrink_to_fit();
-#endif
+				dbpointer->num_idx_blocks, miniblock_lengths.size());
 	}
 
-#if CACHE_MINIBLOCK_LENGTHS
-		fclose(fp);
-#endif
+	fclose(fp);
 
 	int blocks = (total_minis % minis_per_block) ? 1 + total_minis / minis_per_block : total_minis / minis_per_block;
 	sprintf(msg, "%10d index blocks: %s\n", blocks, name);
@@ -1000,7 +1066,6 @@ static void build_file_table(DBHANDLE *hdat, int maxpieces, int maxpiece, int sa
 
 	file.cache_bufferi = nullptr;
 	file.fp = INVALID_HANDLE_VALUE;
-	file.fp_idx = nullptr;
 	file.is_present = 0;
 	file.num_cacheblocks = 0;
 	hdat->dbfiles.clear();
@@ -1075,9 +1140,6 @@ static int egdb_close_dtw(EGDB_DRIVER *handle)
 
 		if (hdat->dbfiles[i].fp != INVALID_HANDLE_VALUE) {
 			close_file(hdat->dbfiles[i].fp);
-#if !CACHE_MINIBLOCK_LENGTHS
-			fclose(hdat->dbfiles[i].fp_idx);
-#endif
 		}
 	}
 	hdat->dbfiles.clear();
@@ -1223,7 +1285,11 @@ static EGDB_TYPE get_type(EGDB_DRIVER const *handle)
 }	// namespace detail
 
 
-EGDB_DRIVER *egdb_open_dtw(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type)
+/*
+ * The dtw driver does not use the open options.
+ */
+EGDB_DRIVER *egdb_open_dtw(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *)
 {
 	int status;
 	EGDB_DRIVER *handle;
@@ -1262,8 +1328,14 @@ void delete_subslices(DBP *dbp)
 		dbp->subdb[i].indices.shrink_to_fit();
 		dbp->subdb[i].lengthtable.clear();
 		dbp->subdb[i].lengthtable.shrink_to_fit();
-		dbp->subdb[i].miniblock_lengths.clear();
-		dbp->subdb[i].miniblock_lengths.shrink_to_fit();
+		dbp->subdb[i].decode_table.clear();
+		dbp->subdb[i].decode_table.shrink_to_fit();
+		dbp->subdb[i].expansion_start.clear();
+		dbp->subdb[i].expansion_start.shrink_to_fit();
+		dbp->subdb[i].expansions.clear();
+		dbp->subdb[i].expansions.shrink_to_fit();
+		dbp->subdb[i].miniblock_starts.clear();
+		dbp->subdb[i].miniblock_starts.shrink_to_fit();
 		dbp->subdb[i].repair_lengths.clear();
 		dbp->subdb[i].repair_lengths.shrink_to_fit();
 		dbp->subdb[i].repair_syms.clear();
@@ -66,11 +66,18 @@ struct EGDB_STATS {
 	unsigned int db_returns;				/* total egdb w/l/d returns. */
 	unsigned int db_not_present_requests;	/* requests for positions not in the db */
 	float avg_ht_list_length;
+	unsigned int cache_page_size;			/* bytes per page of the lru cache buffers. */
+	unsigned int decoded_hits;				/* lookups answered from the decoded block cache. */
+	unsigned int probe_hits;				/* lookups answered from the probe cache. */
+	unsigned int probe_misses;
 };
 
 /* The driver handle type */
 struct EGDB_DRIVER;
 
+/* Pass as cache_mb to egdb_open() to size the cache from the available memory. */
+const int EGDB_CACHE_MB_AUTO = -1;
+
 /* Open an endgame database driver. */
 EGDB_DRIVER *egdb_open(char const *options,
 						int cache_mb,
@@ -80,6 +87,31 @@ EGDB_DRIVER *egdb_open(char const *options,
 int egdb_lookup(EGDB_DRIVER *handle, EGDB_POSITION const *position, int color, int cl);
 int egdb_close(EGDB_DRIVER *handle);
 
+/* Pass in the flags of egdb_lookup_batch() to do conditional lookups, as cl does for egdb_lookup(). */
+const int EGDB_BATCH_CONDITIONAL = 1;
+
+/* Look up n positions, reading each block of db data they need once. */
+void egdb_lookup_batch(EGDB_DRIVER *handle, EGDB_POSITION const *positions, int const *colors, int n,
+						int *results, int flags);
+
+/* Receives the value of count consecutive positions of a slice, starting at index.
+ * Return 0 to continue the scan, or nonzero to stop it.
+ */
+typedef int (*EGDB_SCAN_FN)(int64_t index, int64_t count, int value, void *context);
+
+/* Get the value of every position in a slice, as runs of indices with the same value. */
+int egdb_scan_slice(EGDB_DRIVER *handle, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context, int num_threads);
+
+/* Attach the files for more pieces to an open driver. */
+int egdb_extend(EGDB_DRIVER *handle, int maxpieces);
+
+/* Change the amount of memory used by an open driver. */
+int egdb_set_cache_mb(EGDB_DRIVER *handle, int cache_mb);
+
+/* Release cache memory when the system is short of memory. */
+int egdb_shed_cache(EGDB_DRIVER *handle, int mb);
+
 /* Identify a db, get its size and type. */
 int egdb_identify(char const *directory, EGDB_TYPE *egdb_type, int *max_pieces);
 
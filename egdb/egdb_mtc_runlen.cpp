@@ -81,6 +81,7 @@ typedef struct {
 
 typedef struct {
 	EGDB_TYPE db_type;
+	OPEN_OPTIONS options;			/* from egdb_open(). */
 	char db_filepath[MAXFILENAME];	/* Path to database files. */
 	int dbpieces;
 	int cacheblocks;				/* Total number of db cache blocks. */
@@ -116,6 +117,7 @@ static void reset_db_stats(EGDB_DRIVER *handle)
 static EGDB_STATS *get_db_stats(EGDB_DRIVER const *handle)
 {
 	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	hdat->lookup_stats.cache_page_size = get_cache_page_size(hdat);
 	return(&hdat->lookup_stats);
 }
 
@@ -221,6 +223,7 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	unsigned char *diskblock;
 	INDEX n_idx;
 	INDEX *indices;
+	unsigned int run;
 	EGDB_POSITION revpos;
 	DBP *dbp;
 	CPRSUBDB *dbpointer;
@@ -229,10 +232,7 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	++hdat->lookup_stats.db_requests;
 
 	/* set bm, bk, wm, wk. */
-	bm = bitcount64(p->black & ~p->king);
-	wm = bitcount64(p->white & ~p->king);
-	bk = bitcount64(p->black & p->king);
-	wk = bitcount64(p->white & p->king);
+	get_piece_counts(p, &bm, &bk, &wm, &wk);
 	
 	/* If one side has nothing, return appropriate value. */
 	if ((bm + bk) == 0) {
@@ -335,9 +335,20 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 				reverse_search = 1;
 	}
 
+	/* Step 2 bytes at a time through runlength16_mtc until the pair holds index,
+	 * then find which byte.  The mtc skips are large enough that sums are compared 
+	 * against differences of indices, so they cannot overflow.
+	 */
 	if (reverse_search) {
 		n_idx = indices[idx_blocknum + 1];
 		i = IDX_BLOCKSIZE - 1;
+		while (i > 0) {
+			run = runlength16_mtc[diskblock[i - 1] | (diskblock[i] << 8)];
+			if (run >= n_idx - index)
+				break;
+			n_idx -= run;
+			i -= 2;
+		}
 		while (n_idx > index) {
 			n_idx -= runlength_mtc[diskblock[i]];
 			i--;
@@ -355,6 +366,13 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 		if (idx_blocknum == 0)
 			i = dbpointer->startbyte;
 
+		while (n_idx <= index && i + 1 < IDX_BLOCKSIZE) {
+			run = runlength16_mtc[diskblock[i] | (diskblock[i + 1] << 8)];
+			if (run > index - n_idx)
+				break;
+			n_idx += run;
+			i += 2;
+		}
 		while (n_idx <= index) {
 			n_idx += runlength_mtc[diskblock[i]];
 			i++;
@@ -435,14 +453,8 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 
 	init_bitcount();
 
-	/* initialize binomial coefficients. */
-	initbicoef();
-
-	/* initialize runlength and lookup array. */
-	init_compression_tables();
-
-	/* initialize man index base table. */
-	build_man_index_base();
+	/* select the indexing functions. */
+	init_indexing();
 
 	/* Allocate the cprsubdatabase array. */
 	hdat->cprsubdatabase = (DBP *)std::calloc(DBSIZE, sizeof(DBP));
@@ -565,7 +577,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		for (i = 0; i < hdat->cacheblocks; i += CACHE_ALLOC_COUNT) {
 			count = (std::min)(CACHE_ALLOC_COUNT, hdat->cacheblocks - i);
 			size = count * CACHE_BLOCKSIZE * sizeof(unsigned char);
-			blockp = (unsigned char *)aligned_large_alloc(size);
+			blockp = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
 			if (blockp == NULL) {
 				(*hdat->log_msg_fn)("aligned_large_alloc failure on cache buffers\n");
 				return(-1);
@@ -1038,7 +1050,8 @@ static EGDB_TYPE get_type(EGDB_DRIVER const *handle)
 
 }	// namespace detail
 
-EGDB_DRIVER *egdb_open_mtc_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type)
+EGDB_DRIVER *egdb_open_mtc_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options)
 {
 	int status;
 	EGDB_DRIVER *handle;
@@ -1054,6 +1067,7 @@ EGDB_DRIVER *egdb_open_mtc_runlen(int pieces, int cache_mb, char const *director
 		return(0);
 	}
 	((DBHANDLE *)(handle->internal_data))->db_type = db_type;
+	((DBHANDLE *)(handle->internal_data))->options = *options;
 	status = initdblookup((DBHANDLE *)handle->internal_data, pieces, cache_mb, directory, msg_fn);
 	if (status) {
 		std::free(handle->internal_data);
@@ -8,16 +8,30 @@
 
 namespace egdb_interface {
 
-EGDB_DRIVER *egdb_open_wld_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type);
-EGDB_DRIVER *egdb_open_mtc_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type);
-EGDB_DRIVER *egdb_open_wld_tun_v1(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type);
-EGDB_DRIVER *egdb_open_wld_tun_v2(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type);
-EGDB_DRIVER *egdb_open_dtw(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type);
-
-
-static void parse_options(char const *options, int *pieces)
+EGDB_DRIVER *egdb_open_wld_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options);
+EGDB_DRIVER *egdb_open_mtc_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options);
+EGDB_DRIVER *egdb_open_wld_tun_v1(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options);
+EGDB_DRIVER *egdb_open_wld_tun_v2(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options);
+EGDB_DRIVER *egdb_open_dtw(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options);
+
+
+/* Fraction of the available memory used when cache_mb is EGDB_CACHE_MB_AUTO. */
+#define DEFAULT_AUTO_CACHE_FRACTION 0.5
+
+static void parse_options(char const *options, int *pieces, double *cache_fraction, int *probe_cache_mb,
+						OPEN_OPTIONS *driver_options)
 {
 	*pieces = 0;
+	*cache_fraction = DEFAULT_AUTO_CACHE_FRACTION;
+	*probe_cache_mb = 0;
+	driver_options->large_pages = LARGE_PAGES_THP;
+	driver_options->numa = false;
+	driver_options->decoded_cache_mb = 0;
 	if (options == NULL)
 		return;
 
@@ -33,6 +47,93 @@ static void parse_options(char const *options, int *pieces)
 			*pieces = std::atoi(p);
 		}
 	}
+	{
+		char const *p = std::strstr(options, "cache_fraction");
+		if (p) {
+			p += std::strlen("cache_fraction");
+			while (*p != '=')
+				++p;
+			++p;
+			while (std::isspace(*p))
+				++p;
+			*cache_fraction = std::atof(p);
+			if (*cache_fraction <= 0 || *cache_fraction > 1)
+				*cache_fraction = DEFAULT_AUTO_CACHE_FRACTION;
+		}
+	}
+	{
+		char const *p = std::strstr(options, "hugepages");
+		if (p) {
+			p += std::strlen("hugepages");
+			while (*p != '=')
+				++p;
+			++p;
+			while (std::isspace(*p))
+				++p;
+			if (!strncasecmp(p, "off", 3))
+				driver_options->large_pages = LARGE_PAGES_OFF;
+			else if (!strncasecmp(p, "hugetlb", 7))
+				driver_options->large_pages = LARGE_PAGES_HUGETLB;
+		}
+	}
+	{
+		char const *p = std::strstr(options, "numa");
+		if (p) {
+			p += std::strlen("numa");
+			while (*p != '=')
+				++p;
+			++p;
+			while (std::isspace(*p))
+				++p;
+			if (!strncasecmp(p, "on", 2))
+				driver_options->numa = true;
+		}
+	}
+	{
+		char const *p = std::strstr(options, "decoded_cache_mb");
+		if (p) {
+			p += std::strlen("decoded_cache_mb");
+			while (*p != '=')
+				++p;
+			++p;
+			while (std::isspace(*p))
+				++p;
+			driver_options->decoded_cache_mb = std::atoi(p);
+		}
+	}
+	{
+		char const *p = std::strstr(options, "probe_cache_mb");
+		if (p) {
+			p += std::strlen("probe_cache_mb");
+			while (*p != '=')
+				++p;
+			++p;
+			while (std::isspace(*p))
+				++p;
+			*probe_cache_mb = std::atoi(p);
+		}
+	}
+}
+
+
+/*
+ * Size the cache from the memory that is available now, which is the smaller of
+ * the system's available memory and the room left under a cgroup limit.
+ */
+static int get_auto_cache_mb(double cache_fraction, void (*msg_fn)(char const*))
+{
+	int avail_mb, cgroup_mb, cache_mb;
+	char msg[MAXMSG];
+
+	avail_mb = get_mem_available_mb();
+	cgroup_mb = get_cgroup_mem_available_mb();
+	if (cgroup_mb >= 0 && cgroup_mb < avail_mb)
+		avail_mb = cgroup_mb;
+
+	cache_mb = (int)(avail_mb * cache_fraction);
+	std::sprintf(msg, "Auto cache size: %dmb of %dmb available\n", cache_mb, avail_mb);
+	(*msg_fn)(msg);
+	return(cache_mb);
 }
 
 
@@ -43,6 +144,9 @@ EGDB_DRIVER *egdb_open(char const *options,
 {
 	int stat;
 	int max_pieces, pieces;
+	int probe_cache_mb;
+	double cache_fraction;
+	OPEN_OPTIONS driver_options;
 	EGDB_TYPE db_type;
 	char msg[MAXMSG];
 	EGDB_DRIVER *handle = 0;
@@ -53,34 +157,41 @@ EGDB_DRIVER *egdb_open(char const *options,
 		(*msg_fn)(msg);
 		return(0);
 	}
-	parse_options(options, &pieces);
+	parse_options(options, &pieces, &cache_fraction, &probe_cache_mb, &driver_options);
 	if (pieces > 0)
 		pieces = (std::min)(max_pieces, pieces);
 	else
 		pieces = max_pieces;
 
+	if (cache_mb == EGDB_CACHE_MB_AUTO)
+		cache_mb = get_auto_cache_mb(cache_fraction, msg_fn);
+
 	switch (db_type) {
 	case EGDB_WLD_RUNLEN:
-		handle = egdb_open_wld_runlen(pieces, cache_mb, directory, msg_fn, db_type);
+		handle = egdb_open_wld_runlen(pieces, cache_mb, directory, msg_fn, db_type, &driver_options);
 		break;
 
 	case EGDB_WLD_TUN_V1:
-		handle = egdb_open_wld_tun_v1(pieces, cache_mb, directory, msg_fn, db_type);
+		handle = egdb_open_wld_tun_v1(pieces, cache_mb, directory, msg_fn, db_type, &driver_options);
 		break;
 
 	case EGDB_WLD_TUN_V2:
-		handle = egdb_open_wld_tun_v2(pieces, cache_mb, directory, msg_fn, db_type);
+		handle = egdb_open_wld_tun_v2(pieces, cache_mb, directory, msg_fn, db_type, &driver_options);
 		break;
 
 	case EGDB_MTC_RUNLEN:
-		handle = egdb_open_mtc_runlen(pieces, cache_mb, directory, msg_fn, db_type);
+		handle = egdb_open_mtc_runlen(pieces, cache_mb, directory, msg_fn, db_type, &driver_options);
 		break;
 
 	case EGDB_DTW:
-		handle = egdb_open_dtw(pieces, cache_mb, directory, msg_fn, db_type);
+		handle = egdb_open_dtw(pieces, cache_mb, directory, msg_fn, db_type, &driver_options);
 		break;
 	}
 
+	/* Without the probe cache the driver still works, only slower. */
+	if (handle && probe_cache_mb > 0)
+		handle->probe_cache = alloc_probe_cache(probe_cache_mb, driver_options.large_pages, msg_fn);
+
 	return(handle);
 }
 
@@ -13,6 +13,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -101,6 +102,7 @@ typedef struct {
 
 typedef struct {
 	EGDB_TYPE db_type;
+	OPEN_OPTIONS options;			/* from egdb_open(). */
 	char db_filepath[MAXFILENAME];	/* Path to database files. */
 	int dbpieces;
 	int cacheblocks;				/* Total number of db cache blocks. */
@@ -231,6 +233,7 @@ static EGDB_STATS *get_db_stats(EGDB_DRIVER const *handle)
 		}
 	}
 #endif
+	hdat->lookup_stats.cache_page_size = get_cache_page_size(hdat);
 	return(&hdat->lookup_stats);
 }
 
@@ -253,47 +256,151 @@ static void read_blocknum_from_file(DBHANDLE *hdat, CCB *ccb)
 		(*hdat->log_msg_fn)("Error reading file\n");
 }
 
+
+/*
+ * Find the byte in a subindex block that holds the position at index, starting at
+ * byte i whose first index is *n_idx.  runlength16 is the table of runlength sums of
+ * each 2 bytes.  Returns the byte offset and sets *n_idx to its first index, or 
+ * returns an offset outside the block if the block does not hold it.
+ * The sums of a block's runlengths fit in 31 bits, so the simd versions can use
+ * signed compares against the index relative to *n_idx.
+ */
+typedef int (*FIND_RUN_BYTE)(int const *runlength, unsigned short const *runlength16, unsigned char const *block, int i, INDEX index, INDEX *n_idx);
+
+static int find_run_byte_scalar(int const *runlength, unsigned short const *runlength16, unsigned char const *block, int i, INDEX index, INDEX *n_idx)
+{
+	INDEX n = *n_idx;
+	int run;
+
+	if (n > index)
+		return(-1);
+
+	/* Step 2 bytes at a time until the pair holds index, then find which byte. */
+	for ( ; i + 1 < SUBINDEX_BLOCKSIZE; i += 2) {
+		run = runlength16[block[i] | (block[i + 1] << 8)];
+		if (n + run > index)
+			break;
+		n += run;
+	}
+	for ( ; i < SUBINDEX_BLOCKSIZE; ++i) {
+		if (n + runlength[block[i]] > index) {
+			*n_idx = n;
+			return(i);
+		}
+		n += runlength[block[i]];
+	}
+	return(SUBINDEX_BLOCKSIZE);
+}
+
+#ifdef EGDB_SSE2
+
+static int find_run_byte_sse2(int const *runlength, unsigned short const *, unsigned char const *block, int i, INDEX index, INDEX *n_idx)
+{
+	int c, k, mask;
+	uint32_t sums[4], runs[4];
+	__m128i run, sum, base, target, first;
+
+	if (*n_idx > index)
+		return(-1);
+	target = _mm_set1_epi32((int)(std::min)(index - *n_idx, (INDEX)INT32_MAX));
+	first = _mm_set1_epi32(i - 1);
+	base = _mm_setzero_si128();
+	for (c = i & ~3; c < SUBINDEX_BLOCKSIZE; c += 4) {
+		run = _mm_setr_epi32(runlength[block[c]], runlength[block[c + 1]], 
+							runlength[block[c + 2]], runlength[block[c + 3]]);
+
+		/* Zero the bytes before i. */
+		run = _mm_and_si128(run, _mm_cmpgt_epi32(_mm_setr_epi32(c, c + 1, c + 2, c + 3), first));
+
+		/* Inclusive prefix sums. */
+		sum = _mm_add_epi32(run, _mm_slli_si128(run, 4));
+		sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+		sum = _mm_add_epi32(sum, base);
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(sum, target)));
+		if (mask) {
+			k = bit_scan_forward(mask);
+			_mm_storeu_si128((__m128i *)sums, sum);
+			_mm_storeu_si128((__m128i *)runs, run);
+			*n_idx += sums[k] - runs[k];
+			return(c + k);
+		}
+		base = _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	return(SUBINDEX_BLOCKSIZE);
+}
+
+
+TARGET_AVX2
+static int find_run_byte_avx2(int const *runlength, unsigned short const *, unsigned char const *block, int i, INDEX index, INDEX *n_idx)
+{
+	int c, k, mask;
+	uint32_t sums[8], runs[8];
+	__m256i run, sum, carry, base, target, first, lanes;
+
+	if (*n_idx > index)
+		return(-1);
+	target = _mm256_set1_epi32((int)(std::min)(index - *n_idx, (INDEX)INT32_MAX));
+	first = _mm256_set1_epi32(i - 1);
+	lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	base = _mm256_setzero_si256();
+	for (c = i & ~7; c < SUBINDEX_BLOCKSIZE; c += 8) {
+		run = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)(block + c)));
+		run = _mm256_i32gather_epi32(runlength, run, 4);
+
+		/* Zero the bytes before i. */
+		run = _mm256_and_si256(run, _mm256_cmpgt_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(c)), first));
+
+		/* Inclusive prefix sums in each 128-bit half, then carry the low half into the high half. */
+		sum = _mm256_add_epi32(run, _mm256_slli_si256(run, 4));
+		sum = _mm256_add_epi32(sum, _mm256_slli_si256(sum, 8));
+		carry = _mm256_shuffle_epi32(_mm256_permute2x128_si256(sum, sum, 0x08), _MM_SHUFFLE(3, 3, 3, 3));
+		sum = _mm256_add_epi32(_mm256_add_epi32(sum, carry), base);
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sum, target)));
+		if (mask) {
+			k = bit_scan_forward(mask);
+			_mm256_storeu_si256((__m256i *)sums, sum);
+			_mm256_storeu_si256((__m256i *)runs, run);
+			*n_idx += sums[k] - runs[k];
+			return(c + k);
+		}
+		base = _mm256_permutevar8x32_epi32(sum, _mm256_set1_epi32(7));
+	}
+	return(SUBINDEX_BLOCKSIZE);
+}
+
+#endif
+
+static FIND_RUN_BYTE find_run_byte = find_run_byte_scalar;
+
+/*
+ * Select the run scan for this cpu.  This is done once, by the first driver that is
+ * opened, because lookups in other drivers may be reading find_run_byte.
+ */
+static void select_find_run_byte(void)
+{
+#ifdef EGDB_SSE2
+	find_run_byte = check_cpu_has_avx2() ? find_run_byte_avx2 : find_run_byte_sse2;
+#endif
+}
+
+static std::once_flag find_run_byte_once;
+
 namespace {
 
 /*
- * Returns EGDB_WIN, EGDB_LOSS, EGDB_DRAW, EGDB_UNKNOWN, or EGDB_NOT_IN_CACHE.
- * If the position is in an 'incomplete' subdivision, like 5men vs. 4men, it
- * might also return EGDB_DRAW_OR_LOSS or EEGDB_WIN_OR_DRAW.
- * First it converts the position to an index. 
- * Then it determines which block contains the index.
- * It may load that block from disk if it's not already in cache.
- * Finally it reads and decompresses the block to find
- * the value of the position.
- * If the value is not already in a cache buffer, the action depends on
- * the argument cl.  If cl is true, DB_NOT_IN_CACHE is returned, 
- * otherwise the disk block is read and cached and the value is obtained.
+ * Set the slice and color of a position to look up, reversing the position if the db
+ * stores its slice reversed.  Returns the value of the position if the piece counts
+ * give it, otherwise PROBE_PENDING.
  */
-int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
+int probe_slice(DBHANDLE *hdat, PROBE *probe, EGDB_POSITION const *p, int color)
 {
-	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
-	uint32_t index;
-	int64_t index64;
 	int bm, bk, wm, wk;
-	int i, subslicenum;
-	int idx_blocknum, subidx_blocknum;	
-	int blocknum;
-	int returnvalue;
-	unsigned char *diskblock;
-	INDEX n_idx;
-	INDEX *indices;
-	unsigned char byte;
-	EGDB_POSITION revpos;
-	DBP *dbp;
-	CPRSUBDB *dbpointer;
 
 	/* Start tracking db stats here. */
 	++hdat->lookup_stats.db_requests;
 
 	/* set bm, bk, wm, wk. */
-	bm = bitcount64(p->black & ~p->king);
-	wm = bitcount64(p->white & ~p->king);
-	bk = bitcount64(p->black & p->king);
-	wk = bitcount64(p->white & p->king);
+	get_piece_counts(p, &bm, &bk, &wm, &wk);
 	
 	/* If one side has nothing, return appropriate value. */
 	if ((bm + bk) == 0) {
@@ -312,27 +419,51 @@ int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
 
 	/* Reverse the position if material is dominated by white. */
 	if (needs_reversal(bm, bk, wm, wk, color)) {
-		reverse((BOARD *)&revpos, (BOARD *)p);
-		p = &revpos;
+		reverse((BOARD *)&probe->pos, (BOARD *)p);
 		color = OTHER_COLOR(color);
 		using std::swap;
 		swap(bm, wm);
 		swap(bk, wk);
 	}
+	else
+		probe->pos = *p;
+
+	probe->bm = bm;
+	probe->bk = bk;
+	probe->wm = wm;
+	probe->wk = wk;
+	probe->color = color;
+	return(PROBE_PENDING);
+}
+
 
-	index64 = position_to_index_slice(p, bm, bk, wm, wk);
+/*
+ * Find the subdb that holds the index of a probe.  Returns the value of the position
+ * if the subdb is not present or is all one value, otherwise PROBE_PENDING.
+ */
+int probe_subdb(DBHANDLE *hdat, PROBE *probe)
+{
+	int subslicenum;
+	DBP *dbp;
+	CPRSUBDB *dbpointer;
 
-	subslicenum = (int)(index64 / (int64_t)MAX_SUBSLICE_INDICES);
-	index = (uint32_t)(index64 - (int64_t)subslicenum * (int64_t)MAX_SUBSLICE_INDICES);
+	subslicenum = (int)(probe->index / (int64_t)MAX_SUBSLICE_INDICES);
+	probe->subindex = (uint32_t)(probe->index - (int64_t)subslicenum * (int64_t)MAX_SUBSLICE_INDICES);
 
 	/* get pointer to db. */
-	dbp = hdat->cprsubdatabase + DBOFFSET(bm, bk, wm, wk, color);
+	dbp = hdat->cprsubdatabase + DBOFFSET(probe->bm, probe->bk, probe->wm, probe->wk, probe->color);
 	dbpointer = dbp->subdb;
 
 	/* check presence. */
 	if (dbpointer == 0) {
 		++hdat->lookup_stats.db_not_present_requests;
-		return(EGDB_UNKNOWN);
+
+		/* Determine if both side-to-move colors are unavailable. */
+		dbp = hdat->cprsubdatabase + DBOFFSET(probe->bm, probe->bk, probe->wm, probe->wk, OTHER_COLOR(probe->color));
+		if (dbp->subdb)
+			return(EGDB_UNKNOWN);
+		else
+			return(EGDB_SUBDB_UNAVAILABLE);
 	}
 
 	dbpointer += subslicenum;
@@ -347,111 +478,69 @@ int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
 		return(dbpointer->singlevalue);
 	}
 
-	/* See if this is an autoloaded block. */
-	if (dbpointer->file->file_cache) {
-		++hdat->lookup_stats.autoload_hits;
-
-		/* Do a binary search to find the exact subindex. */
-		indices = dbpointer->autoload_subindices;
-
-		subidx_blocknum = find_block(dbpointer->first_subidx_block, 
-									dbpointer->num_idx_blocks * NUM_SUBINDICES - (NUM_SUBINDICES - 1 - dbpointer->last_subidx_block),
-									indices, index);
-
-		diskblock = dbpointer->file->file_cache + (subidx_blocknum * SUBINDEX_BLOCKSIZE) +
-					dbpointer->first_idx_block * IDX_BLOCKSIZE;
-		n_idx = indices[subidx_blocknum];
-		i = 0;
-		if (subidx_blocknum == dbpointer->first_subidx_block)
-			i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
-	}
-	else {		/* Not an autoloaded block. */
-		int ccbi;
-		CCB *ccbp;
-
-		/* We know the index and the database, so look in 
-		 * the indices array to find the right index block.
-		 */
-		indices = dbpointer->indices;
-		idx_blocknum = find_block(0, dbpointer->num_idx_blocks, indices, index);
-
-		/* See if blocknumber is already in cache. */
-		blocknum = (dbpointer->first_idx_block + idx_blocknum) / IDX_BLOCKS_PER_CACHE_BLOCK;
+	probe->subdb = dbpointer;
+	return(PROBE_PENDING);
+}
 
-		{ // BEGIN CRITICAL SECTION
-		        std::lock_guard<LOCK_TYPE> guard(egdb_lock);
 
-                        /* Is this block already cached? */
-                        ccbi = dbpointer->file->cache_bufferi[blocknum];
-                        if (ccbi != UNDEFINED_BLOCK_ID) {
+/*
+ * Find the subindex block of cache block ccbp that holds index, where the block is index
+ * block idx_blocknum of dbpointer.  Sets *i to the byte to start searching from and
+ * *n_idx to its first index.  The caller holds egdb_lock.
+ */
+unsigned char *find_cached_subindex(CPRSUBDB *dbpointer, CCB *ccbp, int idx_blocknum, INDEX index, int *i, INDEX *n_idx)
+{
+	int subidx_blocknum;
+	INDEX *indices;
 
-                                /* Already cached.  Update the lru list. */
-                                ccbp = update_lru<CCB>(hdat, ccbi);
-                        }
-                        else {
+	/* Do a binary search to find the exact subindex.  This is complicated a bit by the
+	 * problem that there may be a boundary between the end of one subdb and the start of
+	 * the next in this block.  For any subindex block that contains one of these
+	 * boundaries, the subindex stored is the ending block (0 is implied for the
+	 * starting block).  Therefore the binary search cannot use the first subindex of
+	 * a subdb.  We check for this separately.
+	 */
+	indices = ccbp->subindices;
+	if (idx_blocknum == 0 && (dbpointer->single_subidx_block ||
+					dbpointer->first_subidx_block == NUM_SUBINDICES - 1 ||
+					indices[dbpointer->first_subidx_block + 1] > index)) {
+		subidx_blocknum = dbpointer->first_subidx_block;
+		*n_idx = 0;
+		*i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
+	}
+	else {
+		int first, last;
+		if (idx_blocknum == 0)
+			first = dbpointer->first_subidx_block + 1;
+		else
+			first = 0;
+		if (idx_blocknum == (dbpointer->num_idx_blocks - 1) / IDX_BLOCKS_PER_CACHE_BLOCK)
+			last = dbpointer->last_subidx_block + 1;
+		else
+			last = NUM_SUBINDICES;
+		subidx_blocknum = find_block(first, last, indices, index);
 
-                                /* we must load it.
-                                 * if the lookup was a "conditional lookup", we don't load the block.
-                                 */
-                                if (cl) return(EGDB_NOT_IN_CACHE);
+		*n_idx = indices[subidx_blocknum];
+		*i = 0;
+	}
+	return(ccbp->data + subidx_blocknum * SUBINDEX_BLOCKSIZE);
+}
 
-                                /* If necessary load this block from disk, update lru list. */
-                                ccbp = load_blocknum<CCB>(hdat, dbpointer, blocknum);
-                        }
 
-                        /* Do a binary search to find the exact subindex.  This is complicated a bit by the
-                         * problem that there may be a boundary between the end of one subdb and the start of
-                         * the next in this block.  For any subindex block that contains one of these
-                         * boundaries, the subindex stored is the ending block (0 is implied for the
-                         * starting block).  Therefore the binary search cannot use the first subindex of
-                         * a subdb.  We check for this separately.
-                         */
-                        indices = ccbp->subindices;
-                        if (idx_blocknum == 0 && (dbpointer->single_subidx_block ||
-                                                        dbpointer->first_subidx_block == NUM_SUBINDICES - 1 ||
-                                                        indices[dbpointer->first_subidx_block + 1] > index)) {
-                                subidx_blocknum = dbpointer->first_subidx_block;
-                                n_idx = 0;
-                                i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
-                        }
-                        else {
-                                int first, last;
-                                if (idx_blocknum == 0)
-                                        first = dbpointer->first_subidx_block + 1;
-                                else
-                                        first = 0;
-                                if (idx_blocknum == (dbpointer->num_idx_blocks - 1) / IDX_BLOCKS_PER_CACHE_BLOCK)
-                                        last = dbpointer->last_subidx_block + 1;
-                                else
-                                        last = NUM_SUBINDICES;
-                                subidx_blocknum = find_block(first, last, indices, index);
-
-                                n_idx = indices[subidx_blocknum];
-                                i = 0;
-                        }
-                        diskblock = ccbp->data + subidx_blocknum * SUBINDEX_BLOCKSIZE;
-		} // END CRITICAL SECTION
-	}
+/*
+ * Get the value of index from the subindex block of dbpointer at diskblock, searching
+ * from byte i whose first index is n_idx.
+ */
+int decode_value(DBHANDLE *hdat, CPRSUBDB *dbpointer, unsigned char const *diskblock, int i, INDEX n_idx, INDEX index)
+{
+	int returnvalue;
+	unsigned char byte;
 
 	/* The subindex block we were looking for is now pointed to by diskblock.
-	 * Do a linear search for the byte within the block.
+	 * Search it for the byte that holds index.
 	 */
 	if (dbpointer->haspartials) {
-
-		/* and move through the bytes until we overshoot index
-		 * set the start byte in this block: if it's block 0 of a db,
-		 * this can be !=0.
-		 */
-		while (n_idx <= index) {
-			n_idx += runlength_inc[diskblock[i]];
-			i++;
-		}
-
-		/* once we are out here, n>index
-		 * we overshot again, move back:
-		 */
-		i--;
-		n_idx -= runlength_inc[diskblock[i]];
+		i = (*find_run_byte)(runlength_inc, runlength16_inc, diskblock, i, index, &n_idx);
 
 		/* Do some simple error checking. */
 		if (i < 0 || i >= SUBINDEX_BLOCKSIZE) {
@@ -495,21 +584,7 @@ int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
 		return(returnvalue);
 	}
 	else {
-
-		/* and move through the bytes until we overshoot index
-		 * set the start byte in this block: if it's block 0 of a db,
-		 * this can be !=0.
-		 */
-		while (n_idx <= index) {
-			n_idx += runlength[diskblock[i]];
-			i++;
-		}
-
-		/* once we are out here, n>index
-		 * we overshot again, move back:
-		 */
-		i--;
-		n_idx -= runlength[diskblock[i]];
+		i = (*find_run_byte)(runlength, runlength16, diskblock, i, index, &n_idx);
 
 		/* Do some simple error checking. */
 		if (i < 0 || i >= SUBINDEX_BLOCKSIZE) {
@@ -562,8 +637,377 @@ int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
 	}
 }
 
+
+/*
+ * Get the value of index from a subdb whose file is autoloaded.
+ */
+int lookup_autoloaded(DBHANDLE *hdat, CPRSUBDB *dbpointer, INDEX index)
+{
+	int i, subidx_blocknum;
+	unsigned char *diskblock;
+	INDEX n_idx;
+	INDEX *indices;
+
+	++hdat->lookup_stats.autoload_hits;
+
+	/* Do a binary search to find the exact subindex. */
+	indices = dbpointer->autoload_subindices;
+
+	subidx_blocknum = find_block(dbpointer->first_subidx_block, 
+								dbpointer->num_idx_blocks * NUM_SUBINDICES - (NUM_SUBINDICES - 1 - dbpointer->last_subidx_block),
+								indices, index);
+
+	diskblock = dbpointer->file->file_cache + (subidx_blocknum * SUBINDEX_BLOCKSIZE) +
+				dbpointer->first_idx_block * IDX_BLOCKSIZE;
+	n_idx = indices[subidx_blocknum];
+	i = 0;
+	if (subidx_blocknum == dbpointer->first_subidx_block)
+		i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
+
+	return(decode_value(hdat, dbpointer, diskblock, i, n_idx, index));
+}
+
+
+/*
+ * Returns EGDB_WIN, EGDB_LOSS, EGDB_DRAW, EGDB_UNKNOWN, or EGDB_NOT_IN_CACHE.
+ * If the position is in an 'incomplete' subdivision, like 5men vs. 4men, it
+ * might also return EGDB_DRAW_OR_LOSS or EEGDB_WIN_OR_DRAW.
+ * First it converts the position to an index. 
+ * Then it determines which block contains the index.
+ * It may load that block from disk if it's not already in cache.
+ * Finally it reads and decompresses the block to find
+ * the value of the position.
+ * If the value is not already in a cache buffer, the action depends on
+ * the argument cl.  If cl is true, DB_NOT_IN_CACHE is returned, 
+ * otherwise the disk block is read and cached and the value is obtained.
+ */
+int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int i, value;
+	int idx_blocknum;
+	int blocknum;
+	unsigned char *diskblock;
+	INDEX n_idx;
+	PROBE probe;
+	CPRSUBDB *dbpointer;
+
+	value = probe_slice(hdat, &probe, p, color);
+	if (value != PROBE_PENDING)
+		return(value);
+
+	probe.index = position_to_index_slice(&probe.pos, probe.bm, probe.bk, probe.wm, probe.wk);
+	value = probe_subdb(hdat, &probe);
+	if (value != PROBE_PENDING)
+		return(value);
+
+	/* See if this is an autoloaded block. */
+	dbpointer = (CPRSUBDB *)probe.subdb;
+	if (dbpointer->file->file_cache)
+		return(lookup_autoloaded(hdat, dbpointer, probe.subindex));
+
+	/* Not an autoloaded block. */
+	{
+		int ccbi;
+		CCB *ccbp;
+
+		/* We know the index and the database, so look in 
+		 * the indices array to find the right index block.
+		 */
+		idx_blocknum = find_block(0, dbpointer->num_idx_blocks, dbpointer->indices, probe.subindex);
+
+		/* See if blocknumber is already in cache. */
+		blocknum = (dbpointer->first_idx_block + idx_blocknum) / IDX_BLOCKS_PER_CACHE_BLOCK;
+
+		{ // BEGIN CRITICAL SECTION
+		        std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+                        /* Is this block already cached? */
+                        ccbi = dbpointer->file->cache_bufferi[blocknum];
+                        if (ccbi != UNDEFINED_BLOCK_ID) {
+
+                                /* Already cached.  Update the lru list. */
+                                ccbp = update_lru<CCB>(hdat, ccbi);
+                        }
+                        else {
+
+                                /* we must load it.
+                                 * if the lookup was a "conditional lookup", we don't load the block.
+                                 */
+                                if (cl) return(EGDB_NOT_IN_CACHE);
+
+                                /* If necessary load this block from disk, update lru list. */
+                                ccbp = load_blocknum<CCB>(hdat, dbpointer, blocknum);
+                        }
+
+                        diskblock = find_cached_subindex(dbpointer, ccbp, idx_blocknum, probe.subindex, &i, &n_idx);
+		} // END CRITICAL SECTION
+	}
+
+	return(decode_value(hdat, dbpointer, diskblock, i, n_idx, probe.subindex));
+}
+
+
+/*
+ * Look up at most PROBE_BATCH_SIZE positions.  The positions are indexed together.
+ * The ones in blocks that are already cached are looked up in one hold of egdb_lock.
+ * The rest are sorted by block, so that each block is read from disk once for all of
+ * its positions.
+ */
+static void lookup_probe_batch(DBHANDLE *hdat, EGDB_POSITION const *positions, int const *colors, int n,
+						int *results, int cl)
+{
+	int i, k, m, first, value;
+	int ccbi;
+	unsigned char *diskblock;
+	INDEX n_idx;
+	CPRSUBDB *dbpointer;
+	CCB *ccbp;
+	PROBE probes[PROBE_BATCH_SIZE];
+
+	for (m = 0, k = 0; k < n; ++k) {
+		value = probe_slice(hdat, probes + m, positions + k, colors[k]);
+		if (value == PROBE_PENDING)
+			probes[m++].result = k;
+		else
+			results[k] = value;
+	}
+	index_probes(probes, m);
+
+	/* Keep the probes that need a cache block. */
+	for (first = 0, k = 0; k < m; ++k) {
+		value = probe_subdb(hdat, probes + k);
+		if (value != PROBE_PENDING) {
+			results[probes[k].result] = value;
+			continue;
+		}
+		dbpointer = (CPRSUBDB *)probes[k].subdb;
+		if (dbpointer->file->file_cache) {
+			results[probes[k].result] = lookup_autoloaded(hdat, dbpointer, probes[k].subindex);
+			continue;
+		}
+		probes[k].file = dbpointer->file;
+		probes[k].idx_blocknum = find_block(0, dbpointer->num_idx_blocks, dbpointer->indices, probes[k].subindex);
+		probes[k].blocknum = (dbpointer->first_idx_block + probes[k].idx_blocknum) / IDX_BLOCKS_PER_CACHE_BLOCK;
+		probes[first++] = probes[k];
+	}
+	m = first;
+	if (m == 0)
+		return;
+
+	/* Look up the probes whose blocks are cached, and keep the ones that must be read. */
+	{
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		for (first = 0, k = 0; k < m; ++k) {
+			dbpointer = (CPRSUBDB *)probes[k].subdb;
+			ccbi = dbpointer->file->cache_bufferi[probes[k].blocknum];
+			if (ccbi != UNDEFINED_BLOCK_ID) {
+				ccbp = update_lru<CCB>(hdat, ccbi);
+				diskblock = find_cached_subindex(dbpointer, ccbp, probes[k].idx_blocknum, probes[k].subindex, &i, &n_idx);
+				results[probes[k].result] = decode_value(hdat, dbpointer, diskblock, i, n_idx, probes[k].subindex);
+			}
+			else if (cl)
+				results[probes[k].result] = EGDB_NOT_IN_CACHE;
+			else
+				probes[first++] = probes[k];
+		}
+	}
+	m = first;
+	if (m > 1)
+		sort_probes(probes, m);
+
+	for (first = 0; first < m; first = k) {
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* Another thread may have read the block meanwhile. */
+		dbpointer = (CPRSUBDB *)probes[first].subdb;
+		ccbi = dbpointer->file->cache_bufferi[probes[first].blocknum];
+		if (ccbi != UNDEFINED_BLOCK_ID)
+			ccbp = update_lru<CCB>(hdat, ccbi);
+		else
+			ccbp = load_blocknum<CCB>(hdat, dbpointer, probes[first].blocknum);
+
+		for (k = first; k < m && probes[k].file == probes[first].file && probes[k].blocknum == probes[first].blocknum; ++k) {
+			dbpointer = (CPRSUBDB *)probes[k].subdb;
+			diskblock = find_cached_subindex(dbpointer, ccbp, probes[k].idx_blocknum, probes[k].subindex, &i, &n_idx);
+			results[probes[k].result] = decode_value(hdat, dbpointer, diskblock, i, n_idx, probes[k].subindex);
+		}
+	}
+}
+
+
+/*
+ * Look up n positions, PROBE_BATCH_SIZE at a time.
+ */
+void dblookup_batch(EGDB_DRIVER *handle, EGDB_POSITION const *positions, int const *colors, int n, int *results, int cl)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int i;
+
+	for (i = 0; i < n; i += PROBE_BATCH_SIZE)
+		lookup_probe_batch(hdat, positions + i, colors + i, (std::min)(n - i, PROBE_BATCH_SIZE), results + i, cl);
+}
+
+}
+
+/*
+ * Copy block blocknum of a db file into buffer for a slice scan.  A block that is in
+ * the lru cache is copied from there, otherwise it is read from the file without
+ * caching it, so that a scan does not flush the blocks that lookups are using.
+ * Returns 0 on success, 1 on a read error.
+ */
+static int read_scan_block(DBHANDLE *hdat, DBFILE *file, int blocknum, unsigned char *buffer)
+{
+	int ccbi;
+	std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+	ccbi = file->cache_bufferi[blocknum];
+	if (ccbi != UNDEFINED_BLOCK_ID) {
+		std::memcpy(buffer, hdat->ccbs[ccbi].data, CACHE_BLOCKSIZE);
+		return(0);
+	}
+	if (set_file_pointer(file->fp, (int64_t)blocknum * CACHE_BLOCKSIZE)) {
+		(*hdat->log_msg_fn)("seek failed\n");
+		return(1);
+	}
+	if (!read_file(file->fp, buffer, CACHE_BLOCKSIZE, CACHE_BLOCKSIZE)) {
+		(*hdat->log_msg_fn)("Error reading file\n");
+		return(1);
+	}
+	return(0);
+}
+
+
+/*
+ * Decode the index blocks of a scan task in order and pass their values to the scan
+ * callback as runs.  Each index block starts on a byte boundary at the index in
+ * subdb->indices[], so the tasks can be decoded independently.
+ */
+static void scan_task(SCAN_SLICE *scan, SCAN_TASK const *task)
+{
+	DBHANDLE *hdat = (DBHANDLE *)scan->hdat;
+	int i, k, n, value, idx_blocknum;
+	unsigned char byte;
+	unsigned char const *block;
+	unsigned char buffer[CACHE_BLOCKSIZE];
+	INDEX subslice_size, left;
+	CPRSUBDB *subdb;
+	SCAN_RUN run;
+
+	run.scan = scan;
+	run.index = task->subslice * MAX_SUBSLICE_INDICES;
+	run.count = 0;
+	run.value = INT_MIN;
+	subslice_size = (INDEX)(std::min)(scan->size - run.index, MAX_SUBSLICE_INDICES);
+
+	/* Use the subdbs that the tasks were made from. */
+	subdb = (CPRSUBDB *)scan->subdbs;
+	if (!subdb) {
+
+		/* Same as dblookup() for a slice that is not present. */
+		if (hdat->cprsubdatabase[DBOFFSET(scan->bm, scan->bk, scan->wm, scan->wk, OTHER_COLOR(scan->color))].subdb)
+			value = EGDB_UNKNOWN;
+		else
+			value = EGDB_SUBDB_UNAVAILABLE;
+		add_scan_run(&run, subslice_size, value);
+		end_scan_run(&run);
+		return;
+	}
+
+	subdb += task->subslice;
+	if (subdb->singlevalue != NOT_SINGLEVALUE) {
+		add_scan_run(&run, subslice_size, subdb->singlevalue);
+		end_scan_run(&run);
+		return;
+	}
+
+	run.index += subdb->indices[task->first_block];
+	for (idx_blocknum = task->first_block; idx_blocknum < task->first_block + task->num_blocks; ++idx_blocknum) {
+		if (subdb->file->file_cache)
+			block = subdb->file->file_cache + (size_t)(subdb->first_idx_block + idx_blocknum) * IDX_BLOCKSIZE;
+		else {
+			if (read_scan_block(hdat, subdb->file, subdb->first_idx_block + idx_blocknum, buffer)) {
+				scan->status = 1;
+				return;
+			}
+			block = buffer;
+		}
+
+		if (idx_blocknum < subdb->num_idx_blocks - 1)
+			left = subdb->indices[idx_blocknum + 1] - subdb->indices[idx_blocknum];
+		else
+			left = subslice_size - subdb->indices[idx_blocknum];
+		i = idx_blocknum == 0 ? subdb->startbyte : 0;
+		for ( ; left && i < IDX_BLOCKSIZE; ++i) {
+			byte = block[i];
+			if (subdb->haspartials) {
+				if (byte >= 36) {
+					n = (std::min)((INDEX)runlength_inc[byte], left);
+					if (add_scan_run(&run, n, compressed_value_inc[byte]))
+						return;
+					left -= n;
+				}
+				else {
+
+					/* 2 values packed in base 6. */
+					for (k = 0; k < 2 && left; ++k, --left, byte /= 6)
+						if (add_scan_run(&run, 1, byte % 6))
+							return;
+				}
+			}
+			else {
+				if (byte > 80) {
+					n = (std::min)((INDEX)runlength[byte], left);
+					if (add_scan_run(&run, n, compressed_value[byte] + 1))
+						return;
+					left -= n;
+				}
+				else {
+
+					/* 4 values packed in base 3. */
+					for (k = 0; k < 4 && left; ++k, --left, byte /= 3)
+						if (add_scan_run(&run, 1, byte % 3 + 1))
+							return;
+				}
+			}
+		}
+	}
+	end_scan_run(&run);
+}
+
+
+/*
+ * Scan a slice by decoding its compressed data in order.  See egdb_scan_slice().
+ */
+static int scan_slice(EGDB_DRIVER *handle, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context, int num_threads)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int k, first, num_blocks, num_subslices;
+	DBP *dbp;
+	CPRSUBDB *subdb;
+	SCAN_SLICE scan;
+
+	dbp = hdat->cprsubdatabase + DBOFFSET(bm, bk, wm, wk, color);
+	init_scan_slice(&scan, hdat, dbp->subdb, bm, bk, wm, wk, color, fn, context);
+	num_subslices = get_num_subslices(bm, bk, wm, wk, MAX_SUBSLICE_INDICES);
+	for (k = 0; k < num_subslices; ++k) {
+		subdb = dbp->subdb ? dbp->subdb + k : 0;
+		if (subdb && subdb->singlevalue == NOT_SINGLEVALUE)
+			num_blocks = subdb->num_idx_blocks;
+		else
+			num_blocks = 1;
+		for (first = 0; first < num_blocks; first += SCAN_TASK_BLOCKS) {
+			SCAN_TASK task = {k, first, (std::min)(SCAN_TASK_BLOCKS, num_blocks - first)};
+			scan.tasks.push_back(task);
+		}
+	}
+	run_scan_tasks(&scan, num_threads, scan_task);
+	return(scan.status);
 }
 
+
 static int init_autoload_subindices(DBHANDLE *hdat, DBFILE *file, int *allocated_bytes)
 {
 	int i, k, m, size;
@@ -571,7 +1015,7 @@ static int init_autoload_subindices(DBHANDLE *hdat, DBFILE *file, int *allocated
 	DBP *p;
 	INDEX index;
 	unsigned char *datap;
-	int *runlen_table;
+	int const *runlen_table;
 
 	*allocated_bytes = 0;
 	for (i = 0; i < DBSIZE; ++i) {
@@ -631,7 +1075,7 @@ static void assign_subindices(DBHANDLE *hdat, CPRSUBDB *subdb, CCB *ccbp)
 	int subi, end_subi, first_blocknum, idx_blocknum;
 	unsigned int m;
 	INDEX index;
-	int *runlen_table;
+	int const *runlen_table;
 
 	if (subdb->haspartials)
 		runlen_table = runlength_inc;
@@ -750,14 +1194,11 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	//init_lock(egdb_lock);
 	init_bitcount();
 
-	/* initialize binomial coefficients. */
-	initbicoef();
-
-	/* initialize runlength and lookup array. */
-	init_compression_tables();
+	/* select the run scan. */
+	std::call_once(find_run_byte_once, select_find_run_byte);
 
-	/* initialize man index base table. */
-	build_man_index_base();
+	/* select the indexing functions. */
+	init_indexing();
 
 	/* Allocate the cprsubdatabase array. */
 	hdat->cprsubdatabase = (DBP *)std::calloc(DBSIZE, sizeof(DBP));
@@ -854,7 +1295,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		/* Allocate buffers and read files for autoloaded dbs. */
 		if (hdat->dbfiles[i].autoload) {
 			size = hdat->dbfiles[i].num_cacheblocks * CACHE_BLOCKSIZE;
-			hdat->dbfiles[i].file_cache = (unsigned char *)aligned_large_alloc(size);
+			hdat->dbfiles[i].file_cache = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
 			allocated_bytes += size;
 			autoload_bytes += size;
 			if (hdat->dbfiles[i].file_cache == NULL) {
@@ -955,7 +1396,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		for (i = 0; i < hdat->cacheblocks; i += CACHE_ALLOC_COUNT) {
 			count = (std::min)(CACHE_ALLOC_COUNT, hdat->cacheblocks - i);
 			size = count * CACHE_BLOCKSIZE * sizeof(unsigned char);
-			blockp = (unsigned char *)aligned_large_alloc(size);
+			blockp = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
 			if (blockp == NULL) {
 				(*hdat->log_msg_fn)("aligned_large_alloc failure on cache buffers\n");
 				return(-1);
@@ -1537,7 +1978,8 @@ static EGDB_TYPE get_type(EGDB_DRIVER const *handle)
 
 }	// namespace detail
 
-EGDB_DRIVER *egdb_open_wld_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type)
+EGDB_DRIVER *egdb_open_wld_runlen(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options)
 {
 	int status;
 	EGDB_DRIVER *handle;
@@ -1553,6 +1995,7 @@ EGDB_DRIVER *egdb_open_wld_runlen(int pieces, int cache_mb, char const *director
 		return(0);
 	}
 	((DBHANDLE *)(handle->internal_data))->db_type = db_type;
+	((DBHANDLE *)(handle->internal_data))->options = *options;
 	status = initdblookup((DBHANDLE *)handle->internal_data, pieces, cache_mb, directory, msg_fn);
 	if (status) {
 		std::free(handle->internal_data);
@@ -1567,6 +2010,8 @@ EGDB_DRIVER *egdb_open_wld_runlen(int pieces, int cache_mb, char const *director
 	handle->close = detail::egdb_close;
 	handle->get_pieces = detail::get_pieces;
 	handle->get_type = detail::get_type;
+	handle->scan_slice = scan_slice;
+	handle->lookup_batch = dblookup_batch;
 	return(handle);
 }
 
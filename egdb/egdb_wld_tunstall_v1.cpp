@@ -20,6 +20,7 @@
 #include <ctime>
 #include <mutex>
 #include <utility>
+#include <vector>
 
 namespace egdb_interface {
 
@@ -109,6 +110,7 @@ typedef struct {
 
 typedef struct {
 	EGDB_TYPE db_type;
+	OPEN_OPTIONS options;			/* from egdb_open(). */
 	char db_filepath[MAXFILENAME];	/* Path to database files. */
 	int dbpieces;
 	int cacheblocks;				/* Total number of db cache blocks. */
@@ -573,6 +575,7 @@ static EGDB_STATS *get_db_stats(EGDB_DRIVER const *handle)
 	}
 #endif
 	hdat->lookup_stats.avg_ht_list_length = get_avg_ht_list_length(hdat);
+	hdat->lookup_stats.cache_page_size = get_cache_page_size(hdat);
 	return(&hdat->lookup_stats);
 }
 
@@ -598,6 +601,63 @@ static void read_blocknum_from_file(DBHANDLE *hdat, CCB *ccb)
 }
 
 
+/* The runs of each distinct symbol in value_runs, and the entry of each catalog symbol.
+ * Every symbol takes at least 4 bytes of value_runs.
+ */
+static RUN_ENDS run_ends[sizeof(value_runs) / 4];
+static unsigned short run_ends_index[ARRAY_SIZE(decompress_catalog)][256];
+
+static void init_run_ends(void)
+{
+	size_t i;
+	int j, k, count, end;
+	unsigned int offset;
+	RUN_ENDS *runs;
+	std::vector<int> entry(sizeof(value_runs), -1);
+
+	count = 0;
+	for (i = 0; i < ARRAY_SIZE(decompress_catalog); ++i) {
+		for (j = 0; j < 256; ++j) {
+			offset = decompress_catalog[i].value_runs[j];
+			if (entry[offset] < 0) {
+				entry[offset] = count;
+				runs = run_ends + count++;
+				for (end = 0, k = 0; k < MAX_SYMBOL_RUNS && value_runs[offset] != VALUE_RUNS_END; ++k, offset += 3) {
+					end += value_runs[offset + 1] + (value_runs[offset + 2] << 8);
+					runs->end[k] = (short)(std::min)(end, (int)INT16_MAX);
+					runs->value[k] = value_runs[offset];
+				}
+				for ( ; k < MAX_SYMBOL_RUNS; ++k)
+					runs->end[k] = INT16_MAX;
+			}
+			run_ends_index[i][j] = entry[decompress_catalog[i].value_runs[j]];
+		}
+	}
+}
+
+static std::once_flag run_ends_once;
+
+
+/*
+ * Return the value of the run that holds offset, an index relative to the start of the symbol.
+ */
+static int run_value(RUN_ENDS const *runs, int offset)
+{
+#ifdef EGDB_SSE2
+	int mask;
+
+	mask = _mm_movemask_epi8(_mm_cmpgt_epi16(_mm_load_si128((__m128i const *)runs->end), _mm_set1_epi16((short)offset)));
+	return(runs->value[bit_scan_forward(mask) / 2]);
+#else
+	int k;
+
+	for (k = 0; runs->end[k] <= offset; ++k)
+		;
+	return(runs->value[k]);
+#endif
+}
+
+
 /*
  * Return a pointer to a cache block.
  * Get the least recently used cache
@@ -679,7 +739,7 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
 	uint32_t index;
 	unsigned short *runlength;
-	unsigned short value_runs_offset;
+	RUN_ENDS const *runs;
 	int64_t index64;
 	int bm, bk, wm, wk;
 	int i, subslicenum;
@@ -697,10 +757,7 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	++hdat->lookup_stats.db_requests;
 
 	/* set bm, bk, wm, wk. */
-	bm = bitcount64(p->black & ~p->king);
-	wm = bitcount64(p->white & ~p->king);
-	bk = bitcount64(p->black & p->king);
-	wk = bitcount64(p->white & p->king);
+	get_piece_counts(p, &bm, &bk, &wm, &wk);
 	
 	/* If one side has nothing, return appropriate value. */
 	if ((bm + bk) == 0) {
@@ -882,14 +939,8 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 	/* finally, we have found the byte which describes the position we
 	 * wish to look up. it is diskblock[i].
 	 */
-	value_runs_offset = decompress_catalog[dbpointer->catalog_entry].value_runs[diskblock[i]];
-	while (1) {
-		n_idx += value_runs[value_runs_offset + 1] + (value_runs[value_runs_offset + 2] << 8);
-		if (n_idx > index)
-			break;
-		value_runs_offset += 3;
-	}
-	returnvalue = dbpointer->vmap[value_runs[value_runs_offset]];
+	runs = run_ends + run_ends_index[dbpointer->catalog_entry][diskblock[i]];
+	returnvalue = dbpointer->vmap[run_value(runs, (int)(index - n_idx))];
 	++hdat->lookup_stats.db_returns;
 
 	return(returnvalue);
@@ -1078,14 +1129,13 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	//init_lock(egdb_lock);
 	init_bitcount();
 
-	/* initialize binomial coefficients. */
-	initbicoef();
-
-	/* initialize runlength and lookup array. */
-	init_compression_tables();
+	/* initialize the run ends of the decompression catalogs.  This is done once, because
+	 * lookups in drivers that are already open may be reading them.
+	 */
+	std::call_once(run_ends_once, init_run_ends);
 
-	/* initialize man index base table. */
-	build_man_index_base();
+	/* select the indexing functions. */
+	init_indexing();
 
 	/* Allocate the cprsubdatabase array. */
 	hdat->cprsubdatabase = (DBP *)std::calloc(DBSIZE, sizeof(DBP));
@@ -1187,7 +1237,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		/* Allocate buffers and read files for autoloaded dbs. */
 		if (hdat->dbfiles[i].autoload) {
 			size = hdat->dbfiles[i].num_cacheblocks * (size_t)CACHE_BLOCKSIZE;
-			hdat->dbfiles[i].file_cache = (unsigned char *)aligned_large_alloc(size);
+			hdat->dbfiles[i].file_cache = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
 			allocated_bytes += size;
 			autoload_bytes += size;
 			if (hdat->dbfiles[i].file_cache == NULL) {
@@ -1285,7 +1335,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		for (i = 0; i < hdat->cacheblocks; i += CACHE_ALLOC_COUNT) {
 			count = (std::min)(CACHE_ALLOC_COUNT, hdat->cacheblocks - i);
 			size = count * CACHE_BLOCKSIZE * sizeof(unsigned char);
-			blockp = (unsigned char *)aligned_large_alloc(size);
+			blockp = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
 			if (blockp == NULL) {
 				(*hdat->log_msg_fn)("aligned_large_alloc failure on cache buffers\n");
 				return(-1);
@@ -1932,7 +1982,8 @@ static EGDB_TYPE get_type(EGDB_DRIVER const *handle)
 
 }	// namespace detail
 
-EGDB_DRIVER *egdb_open_wld_tun_v1(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type)
+EGDB_DRIVER *egdb_open_wld_tun_v1(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options)
 {
 	int status;
 	EGDB_DRIVER *handle;
@@ -1949,6 +2000,7 @@ EGDB_DRIVER *egdb_open_wld_tun_v1(int pieces, int cache_mb, char const *director
 		return(0);
 	}
 	((DBHANDLE *)(handle->internal_data))->db_type = db_type;
+	((DBHANDLE *)(handle->internal_data))->options = *options;
 	status = initdblookup((DBHANDLE *)handle->internal_data, pieces, cache_mb, directory, msg_fn);
 	if (status) {
 		egdb_close(handle);
@@ -12,14 +12,19 @@
 #include "engine/bool.h"
 #include "engine/project.h"	// ARRAY_SIZE
 #include "engine/reverse.h"
+#include "engine/table.h"
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <mutex>
+#include <thread>
 #include <utility>
+#include <vector>
 
 namespace egdb_interface {
 
@@ -30,13 +35,37 @@ namespace egdb_interface {
 #define SAME_PIECES_ONE_FILE 5
 #define MIN_AUTOLOAD_PIECES 5
 
-#define NUM_SUBINDICES 64
+/* Bytes of compressed data per subindex.  dblookup() scans up to this many bytes
+ * after finding the subindex.  Smaller values make the scans shorter, but each
+ * cache block and autoloaded block then needs IDX_BLOCKSIZE / SUBINDEX_BLOCKSIZE
+ * subindices of 4 bytes each.  It can be set to 8, 16, 32, or 64 when compiling.
+ */
+#ifndef TUN_V2_SUBINDEX_BLOCKSIZE
+#define TUN_V2_SUBINDEX_BLOCKSIZE 64
+#endif
+
+#if TUN_V2_SUBINDEX_BLOCKSIZE != 8 && TUN_V2_SUBINDEX_BLOCKSIZE != 16 && \
+	TUN_V2_SUBINDEX_BLOCKSIZE != 32 && TUN_V2_SUBINDEX_BLOCKSIZE != 64
+#error TUN_V2_SUBINDEX_BLOCKSIZE must be 8, 16, 32, or 64
+#endif
+
 #define IDX_BLOCKSIZE 4096
 #define CACHE_BLOCKSIZE IDX_BLOCKSIZE
-#define SUBINDEX_BLOCKSIZE (IDX_BLOCKSIZE / NUM_SUBINDICES)
+#define SUBINDEX_BLOCKSIZE TUN_V2_SUBINDEX_BLOCKSIZE
+#define NUM_SUBINDICES (IDX_BLOCKSIZE / SUBINDEX_BLOCKSIZE)
 
 #define MAXFILES 200		/* This is enough for an 8/9pc database. */
 
+/* A block is decoded after this many lookups miss the decoded cache, and only if
+ * its positions fit in DECODED_BLOCK_BYTES at 4 positions per byte.
+ */
+#define DECODE_PROMOTE_HITS 32
+#define DECODED_BLOCK_BYTES 16384
+
+#define MAX_NUMA_NODES 8
+#define READER_SHARDS 64		/* counters of lookups in progress, to spread them over cache lines. */
+#define MAX_REPLICATED_PIECES 6	/* autoloaded files up to this size get a copy on each numa node. */
+
 /* Having types with the same name as types in other files confuses the debugger. */
 #define DBFILE DBFILE_TUN_V2
 #define CPRSUBDB CPRSUBDB_TUN_V2
@@ -52,7 +81,8 @@ typedef struct {
 	char autoload;			/* statically load the whole file if true. */
 	char name[20];			/* db filename prefix. */
 	int num_cacheblocks;	/* number of cache blocks in this db file. */
-	unsigned char *file_cache;/* if not null the whole db file is here. */
+	std::atomic<unsigned char *> file_cache;	/* if not null the whole db file is here. */
+	std::atomic<unsigned char *> node_cache[MAX_NUMA_NODES];	/* copies of file_cache on each numa node, [0] is file_cache. */
 	FILE_HANDLE fp;
 	int *cache_bufferi;		/* An array of indices into cache_buffers[], indexed by block number. */
 #if LOG_HITS
@@ -63,9 +93,9 @@ typedef struct {
 // definition of a structure for compressed databases
 typedef struct CPRSUBDB {
 	char singlevalue;				/* WIN/LOSS/DRAW if single value, else NOT_SINGLEVALUE. */
-	unsigned char first_subidx_block;	/* modulus NUM_SUBINDICES */
+	unsigned short first_subidx_block;	/* modulus NUM_SUBINDICES */
 	unsigned char single_subidx_block;	/* true if only one subidx block in this subdb. */
-	unsigned char last_subidx_block;	/* modulus NUM_SUBINDICES */
+	unsigned short last_subidx_block;	/* modulus NUM_SUBINDICES */
 	short int startbyte;			/* offset into first index block of first data. */
 	int num_idx_blocks;				/* number of index blocks in this subdb. */
 	int first_idx_block;			/* index block containing the first data value. */
@@ -73,7 +103,7 @@ typedef struct CPRSUBDB {
 									/* allocated dynamically, to size [num_idx_blocks] */
 	char *catalogidx;				/* array of catalog indices, one for each block. */
 	unsigned char *vmap;			/* array of vmap descriptors, one for each block. */
-	INDEX *autoload_subindices;		/* subindices for autoloaded files. */
+	std::atomic<INDEX *> autoload_subindices;	/* subindices for autoloaded files. */
 	DBFILE *file;					/* file info for this subdb */
 	struct CPRSUBDB *next;			/* previous subdb in the same file that is not all one value. */
 	struct CPRSUBDB *prev;			/* next subdb in the same file that is not all one value. */
@@ -83,7 +113,7 @@ typedef struct CPRSUBDB {
 } CPRSUBDB;
 
 typedef struct {
-	CPRSUBDB *subdb;		/* an array of subdb pointers indexed by subslicenum. */
+	std::atomic<CPRSUBDB *> subdb;	/* an array of subdbs indexed by subslicenum, read by lookups without the lock. */
 	int num_subslices;
 } DBP;
 
@@ -97,11 +127,51 @@ typedef struct {
 	INDEX subindices[NUM_SUBINDICES];
 } CCB;
 
+/* An index block of a subdb decoded to 2-bit virtual values.  Lookups read it
+ * without the lock; seq is odd while the slot is being rewritten, and a lookup
+ * that sees seq change ignores what it read.
+ */
+typedef struct {
+	std::atomic<unsigned int> seq;
+	CPRSUBDB *subdb;		/* NULL if the slot is empty. */
+	int idx_blocknum;
+	INDEX first_index;		/* index of the first position in values[]. */
+	INDEX num_indices;
+	unsigned char *values;	/* DECODED_BLOCK_BYTES in decoded_buffers. */
+} DECODED_SLOT;
+
+/* A buffer that was replaced while lookups may still be reading it. */
+typedef struct {
+	void *ptr;
+	char large;				/* free with virtual_free() if true, else std::free(). */
+} RETIRED_BUF;
+
+/* A count of lookups in progress, padded so that each is on its own cache line. */
+typedef struct {
+	std::atomic<int> count;
+	char pad[64 - sizeof(std::atomic<int>)];
+} READER_COUNT;
+
 typedef struct {
 	EGDB_TYPE db_type;
+	OPEN_OPTIONS options;			/* from egdb_open(). */
 	char db_filepath[MAXFILENAME];	/* Path to database files. */
-	int dbpieces;
+	std::atomic<int> dbpieces;
 	int cacheblocks;				/* Total number of db cache blocks. */
+	int64_t index_bytes;			/* heap allocations for indexing, not including autoload and cache buffers. */
+	RETIRED_BUF *retired;			/* buffers to free on the next cache resize or close. */
+	int num_retired;
+	std::atomic<unsigned int> read_epoch;	/* lookups in progress are counted in readers[read_epoch & 1]. */
+	READER_COUNT readers[2][READER_SHARDS];	/* a shard for each cpu, modulo READER_SHARDS. */
+	int numa_nodes;					/* number of nodes that get replicas, 1 if not replicating. */
+	int node_ids[MAX_NUMA_NODES];	/* numa node number of each replica. */
+	int num_cpus;
+	unsigned char *cpu_node;		/* replica of each cpu, an index into node_ids. */
+	DECODED_SLOT *decoded;			/* decoded block cache, num_decoded is a power of 2. */
+	int num_decoded;
+	unsigned char *decoded_buffers;
+	unsigned char *decode_misses;	/* miss counts, num_decode_misses is a power of 2. */
+	int num_decode_misses;
 	void (*log_msg_fn)(char const*);		/* for status and error messages. */
 	DBP *cprsubdatabase;
 	CCB *ccbs;
@@ -114,6 +184,9 @@ typedef struct {
 
 static LOCK_TYPE egdb_lock;
 
+/* Serializes the calls that change the cache or the files of a driver. */
+static std::mutex resize_lock;
+
 /* A table of crc values for each database file. */
 static DBCRC dbcrc[] = {
 	{"db2.cpr1", 0x0319ba8c},
@@ -358,39 +431,28 @@ static DBCRC dbcrc[] = {
 
 
 /* Function prototypes. */
-static int parseindexfile(DBHANDLE *, DBFILE *, int64_t *allocated_bytes);
-static void build_file_table(DBHANDLE *hdat);
+static int parseindexfile(DBHANDLE *, DBP *dbtable, DBFILE *, int64_t *allocated_bytes);
+static void build_file_table(DBHANDLE *hdat, int pieces);
 static void build_autoload_list(DBHANDLE *hdat);
 static void assign_subindices(DBHANDLE *hdat, CPRSUBDB *subdb, CCB *ccbp);
 
 
-static char virtual_to_real[256][4];
-
-void init_virtual_to_real(void)
+/*
+ * A vmap byte packs a permutation of the 4 real values as vr0 + 4 * vr1 + 16 * vr2 + 64 * vr3.
+ * Bytes that are not permutations map to 0.
+ */
+constexpr bool is_vmap_permutation(int index)
 {
-	int vr0, vr1, vr2, vr3, index;
-
-	for (vr0 = 0; vr0 < 4; ++vr0) {
-		for (vr1 = 0; vr1 < 4; ++vr1) {
-			if (vr1 == vr0)
-				continue;
-			for (vr2 = 0; vr2 < 4; ++vr2) {
-				if (vr2 == vr1 || vr2 == vr0)
-					continue;
-				for (vr3 = 0; vr3 < 4; ++vr3) {
-					if (vr3 == vr0 || vr3 == vr1 || vr3 == vr2)
-						continue;
-					index = vr0 + vr1 * 4 + vr2 * 16 + vr3 * 64;
-					virtual_to_real[index][0] = vr0;
-					virtual_to_real[index][1] = vr1;
-					virtual_to_real[index][2] = vr2;
-					virtual_to_real[index][3] = vr3;
-				}
-			}
-		}
-	}
+	return(((1 << (index & 3)) | (1 << ((index >> 2) & 3)) | (1 << ((index >> 4) & 3)) | (1 << ((index >> 6) & 3))) == 0xf);
 }
 
+#define VIRTUAL_TO_REAL(index) {(char)(is_vmap_permutation(index) ? (index) & 3 : 0), \
+				(char)(is_vmap_permutation(index) ? ((index) >> 2) & 3 : 0), \
+				(char)(is_vmap_permutation(index) ? ((index) >> 4) & 3 : 0), \
+				(char)(is_vmap_permutation(index) ? ((index) >> 6) & 3 : 0)}
+
+static constexpr char virtual_to_real[256][4] = {TABLE_256(VIRTUAL_TO_REAL, 0)};
+
 
 namespace detail {
 
@@ -491,6 +553,7 @@ static EGDB_STATS *get_db_stats(EGDB_DRIVER const *handle)
 		}
 	}
 #endif
+	hdat->lookup_stats.cache_page_size = get_cache_page_size(hdat);
 	return(&hdat->lookup_stats);
 }
 
@@ -514,46 +577,358 @@ static void read_blocknum_from_file(DBHANDLE *hdat, CCB *ccb)
 }
 
 
+/* The runlength tables widened to 32 bits, so the simd scans can gather from them. */
+static uint32_t runlength32_v2[ARRAY_SIZE(decompress_catalog_v2)][256];
+
+static void init_runlength32_v2(void)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < ARRAY_SIZE(decompress_catalog_v2); ++i)
+		for (j = 0; j < 256; ++j)
+			runlength32_v2[i][j] = decompress_catalog_v2[i].runlength_table[j];
+}
+
+
+/* The runs of each distinct symbol in value_runs_v2, and the entry of each catalog symbol.
+ * Every symbol takes at least 4 bytes of value_runs_v2.
+ */
+static RUN_ENDS run_ends_v2[sizeof(value_runs_v2) / 4];
+static unsigned short run_ends_index_v2[ARRAY_SIZE(decompress_catalog_v2)][256];
+
+static void init_run_ends_v2(void)
+{
+	size_t i;
+	int j, k, count, end;
+	unsigned int offset;
+	RUN_ENDS *runs;
+	std::vector<int> entry(sizeof(value_runs_v2), -1);
+
+	count = 0;
+	for (i = 0; i < ARRAY_SIZE(decompress_catalog_v2); ++i) {
+		for (j = 0; j < 256; ++j) {
+			offset = decompress_catalog_v2[i].value_runs[j];
+			if (entry[offset] < 0) {
+				entry[offset] = count;
+				runs = run_ends_v2 + count++;
+				for (end = 0, k = 0; k < MAX_SYMBOL_RUNS && value_runs_v2[offset] != VALUE_RUNS_END; ++k, offset += 3) {
+					end += value_runs_v2[offset + 1] + (value_runs_v2[offset + 2] << 8);
+					runs->end[k] = (short)(std::min)(end, (int)INT16_MAX);
+					runs->value[k] = value_runs_v2[offset];
+				}
+				for ( ; k < MAX_SYMBOL_RUNS; ++k)
+					runs->end[k] = INT16_MAX;
+			}
+			run_ends_index_v2[i][j] = entry[decompress_catalog_v2[i].value_runs[j]];
+		}
+	}
+}
+
+
 /*
- * Returns EGDB_WIN, EGDB_LOSS, EGDB_DRAW, EGDB_UNKNOWN, or EGDB_NOT_IN_CACHE.
- * If the position is in an 'incomplete' subdivision, like 5men vs. 4men, it
- * might also return EGDB_DRAW_OR_LOSS or EEGDB_WIN_OR_DRAW.
- * First it converts the position to an index. 
- * Then it determines which block contains the index.
- * It may load that block from disk if it's not already in cache.
- * Finally it reads and decompresses the block to find
- * the value of the position.
- * If the value is not already in a cache buffer, the action depends on
- * the argument cl.  If cl is true, DB_NOT_IN_CACHE is returned, 
- * otherwise the disk block is read and cached and the value is obtained.
+ * Return the value of the run that holds offset, an index relative to the start of the symbol.
  */
-static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
+static int run_value(RUN_ENDS const *runs, int offset)
+{
+#ifdef EGDB_SSE2
+	int mask;
+
+	mask = _mm_movemask_epi8(_mm_cmpgt_epi16(_mm_load_si128((__m128i const *)runs->end), _mm_set1_epi16((short)offset)));
+	return(runs->value[bit_scan_forward(mask) / 2]);
+#else
+	int k;
+
+	for (k = 0; runs->end[k] <= offset; ++k)
+		;
+	return(runs->value[k]);
+#endif
+}
+
+
+/*
+ * Find the byte in a subindex block that holds the position at index, starting at
+ * byte i whose first index is *n_idx.  Returns the byte offset and sets *n_idx to its
+ * first index, or returns an offset outside the block if the block does not hold it.
+ * The sums of a block's runlengths fit in 31 bits, so the simd versions can use
+ * signed compares against the index relative to *n_idx.
+ */
+typedef int (*FIND_RUN_BYTE)(uint32_t const *runlength, unsigned char const *block, int i, INDEX index, INDEX *n_idx);
+
+static int find_run_byte_scalar(uint32_t const *runlength, unsigned char const *block, int i, INDEX index, INDEX *n_idx)
+{
+	INDEX n = *n_idx;
+
+	if (n > index)
+		return(-1);
+	for ( ; i < SUBINDEX_BLOCKSIZE; ++i) {
+		if (n + runlength[block[i]] > index) {
+			*n_idx = n;
+			return(i);
+		}
+		n += runlength[block[i]];
+	}
+	return(SUBINDEX_BLOCKSIZE);
+}
+
+#ifdef EGDB_SSE2
+
+static int find_run_byte_sse2(uint32_t const *runlength, unsigned char const *block, int i, INDEX index, INDEX *n_idx)
+{
+	int c, k, mask;
+	uint32_t sums[4], runs[4];
+	__m128i run, sum, base, target, first;
+
+	if (*n_idx > index)
+		return(-1);
+	target = _mm_set1_epi32((int)(std::min)(index - *n_idx, (INDEX)INT32_MAX));
+	first = _mm_set1_epi32(i - 1);
+	base = _mm_setzero_si128();
+	for (c = i & ~3; c < SUBINDEX_BLOCKSIZE; c += 4) {
+		run = _mm_setr_epi32(runlength[block[c]], runlength[block[c + 1]], 
+							runlength[block[c + 2]], runlength[block[c + 3]]);
+
+		/* Zero the bytes before i. */
+		run = _mm_and_si128(run, _mm_cmpgt_epi32(_mm_setr_epi32(c, c + 1, c + 2, c + 3), first));
+
+		/* Inclusive prefix sums. */
+		sum = _mm_add_epi32(run, _mm_slli_si128(run, 4));
+		sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+		sum = _mm_add_epi32(sum, base);
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(sum, target)));
+		if (mask) {
+			k = bit_scan_forward(mask);
+			_mm_storeu_si128((__m128i *)sums, sum);
+			_mm_storeu_si128((__m128i *)runs, run);
+			*n_idx += sums[k] - runs[k];
+			return(c + k);
+		}
+		base = _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	return(SUBINDEX_BLOCKSIZE);
+}
+
+
+TARGET_AVX2
+static int find_run_byte_avx2(uint32_t const *runlength, unsigned char const *block, int i, INDEX index, INDEX *n_idx)
+{
+	int c, k, mask;
+	uint32_t sums[8], runs[8];
+	__m256i run, sum, carry, base, target, first, lanes;
+
+	if (*n_idx > index)
+		return(-1);
+	target = _mm256_set1_epi32((int)(std::min)(index - *n_idx, (INDEX)INT32_MAX));
+	first = _mm256_set1_epi32(i - 1);
+	lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	base = _mm256_setzero_si256();
+	for (c = i & ~7; c < SUBINDEX_BLOCKSIZE; c += 8) {
+		run = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *)(block + c)));
+		run = _mm256_i32gather_epi32((int const *)runlength, run, 4);
+
+		/* Zero the bytes before i. */
+		run = _mm256_and_si256(run, _mm256_cmpgt_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(c)), first));
+
+		/* Inclusive prefix sums in each 128-bit half, then carry the low half into the high half. */
+		sum = _mm256_add_epi32(run, _mm256_slli_si256(run, 4));
+		sum = _mm256_add_epi32(sum, _mm256_slli_si256(sum, 8));
+		carry = _mm256_shuffle_epi32(_mm256_permute2x128_si256(sum, sum, 0x08), _MM_SHUFFLE(3, 3, 3, 3));
+		sum = _mm256_add_epi32(_mm256_add_epi32(sum, carry), base);
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sum, target)));
+		if (mask) {
+			k = bit_scan_forward(mask);
+			_mm256_storeu_si256((__m256i *)sums, sum);
+			_mm256_storeu_si256((__m256i *)runs, run);
+			*n_idx += sums[k] - runs[k];
+			return(c + k);
+		}
+		base = _mm256_permutevar8x32_epi32(sum, _mm256_set1_epi32(7));
+	}
+	return(SUBINDEX_BLOCKSIZE);
+}
+
+#endif
+
+static FIND_RUN_BYTE find_run_byte = find_run_byte_scalar;
+
+
+/*
+ * Build the runlength and run end tables of the decompression catalogs and select
+ * the run scan for this cpu.  This is done once, by the first driver that is opened,
+ * because lookups in other drivers may be reading them.
+ */
+static void init_decompress_tables_v2(void)
+{
+	init_runlength32_v2();
+	init_run_ends_v2();
+#ifdef EGDB_SSE2
+	find_run_byte = check_cpu_has_avx2() ? find_run_byte_avx2 : find_run_byte_sse2;
+#endif
+}
+
+static std::once_flag decompress_tables_once;
+
+
+static uint32_t decoded_hash(CPRSUBDB const *subdb, int idx_blocknum)
+{
+	uint64_t h;
+
+	h = ((uint64_t)(uintptr_t)subdb ^ ((uint64_t)idx_blocknum << 40)) * 0x9E3779B97F4A7C15ULL;
+	return((uint32_t)(h >> 32));
+}
+
+
+/*
+ * Return the virtual value of index from the decoded block cache, or -1 if 
+ * the block is not there.
+ */
+static int get_decoded_value(DBHANDLE *hdat, CPRSUBDB const *subdb, int idx_blocknum, INDEX index)
+{
+	int value;
+	unsigned int seq;
+	INDEX offset;
+	DECODED_SLOT *slot;
+
+	slot = hdat->decoded + (decoded_hash(subdb, idx_blocknum) & (hdat->num_decoded - 1));
+	seq = slot->seq.load(std::memory_order_acquire);
+	if ((seq & 1) || slot->subdb != subdb || slot->idx_blocknum != idx_blocknum)
+		return(-1);
+	offset = index - slot->first_index;
+	if (offset >= slot->num_indices)
+		return(-1);
+	value = (slot->values[offset / 4] >> (2 * (offset % 4))) & 3;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot->seq.load(std::memory_order_relaxed) != seq)
+		return(-1);
+	return(value);
+}
+
+
+/* Count a miss in the decoded block cache, return true if the block should be decoded. */
+static int count_decoded_miss(DBHANDLE *hdat, CPRSUBDB const *subdb, int idx_blocknum)
+{
+	unsigned char *count;
+
+	count = hdat->decode_misses + (decoded_hash(subdb, idx_blocknum) & (hdat->num_decode_misses - 1));
+	if (++*count < DECODE_PROMOTE_HITS)
+		return(0);
+	*count = 0;
+	return(1);
+}
+
+
+/* Set len 2-bit values starting at position pos to value. */
+static void fill_decoded_values(unsigned char *values, INDEX pos, INDEX len, int value)
+{
+	for ( ; len && (pos % 4); ++pos, --len)
+		values[pos / 4] |= value << (2 * (pos % 4));
+	std::memset(values + pos / 4, value * 0x55, len / 4);
+	pos += len & ~3;
+	for (len %= 4; len; ++pos, --len)
+		values[pos / 4] |= value << (2 * (pos % 4));
+}
+
+
+/*
+ * Decode the data of subdb in index block idx_blocknum into the decoded block cache,
+ * replacing the block that was in its slot.  block is the 4k block of compressed data.
+ * The caller holds egdb_lock.
+ */
+static void decode_block(DBHANDLE *hdat, CPRSUBDB *subdb, int idx_blocknum, unsigned char const *block)
+{
+	int k, m, start, end;
+	unsigned int seq;
+	INDEX count, pos, len, done, left;
+	uint32_t const *runlength;
+	unsigned short const *runs_index;
+	RUN_ENDS const *runs;
+	DECODED_SLOT *slot;
+
+	/* Find the bytes of this subdb in the block. */
+	start = idx_blocknum == 0 ? subdb->startbyte : 0;
+	if (idx_blocknum < subdb->num_idx_blocks - 1)
+		end = IDX_BLOCKSIZE;
+	else if (subdb->next && subdb->next->first_idx_block == subdb->first_idx_block + idx_blocknum)
+		end = subdb->next->startbyte;
+	else
+		end = (subdb->last_subidx_block + 1) * SUBINDEX_BLOCKSIZE;
+
+	runlength = runlength32_v2[(unsigned char)subdb->catalogidx[idx_blocknum]];
+	runs_index = run_ends_index_v2[(unsigned char)subdb->catalogidx[idx_blocknum]];
+	for (count = 0, m = start; m < end; ++m)
+		count += runlength[block[m]];
+	if (count > 4 * (INDEX)DECODED_BLOCK_BYTES)
+		return;
+
+	slot = hdat->decoded + (decoded_hash(subdb, idx_blocknum) & (hdat->num_decoded - 1));
+	seq = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	std::memset(slot->values, 0, (count + 3) / 4);
+	for (pos = 0, m = start; m < end; ++m) {
+		runs = run_ends_v2 + runs_index[block[m]];
+		left = runlength[block[m]];
+		for (done = 0, k = 0; done < left && k < MAX_SYMBOL_RUNS; ++k) {
+			len = (std::min)((INDEX)runs->end[k], left) - done;
+			fill_decoded_values(slot->values, pos, len, runs->value[k]);
+			pos += len;
+			done += len;
+		}
+	}
+	slot->subdb = subdb;
+	slot->idx_blocknum = idx_blocknum;
+	slot->first_index = idx_blocknum == 0 ? 0 : subdb->indices[idx_blocknum];
+	slot->num_indices = pos;
+	slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+
+/*
+ * Count a lookup that reads buffers which egdb_set_cache_mb() or egdb_shed_cache()
+ * can retire.  The count is made in the current epoch, and is made again if the
+ * epoch changes meanwhile, because wait_for_readers() may not have seen it.
+ * Returns the counter to pass to end_read().
+ */
+static std::atomic<int> *begin_read(DBHANDLE *hdat)
+{
+	int cpu;
+	unsigned int epoch;
+	std::atomic<int> *count;
+
+	cpu = get_current_cpu();
+	if (cpu < 0)
+		cpu = 0;
+	for ( ; ; ) {
+		epoch = hdat->read_epoch.load();
+		count = &hdat->readers[epoch & 1][cpu % READER_SHARDS].count;
+		count->fetch_add(1);
+		if (hdat->read_epoch.load() == epoch)
+			return(count);
+		count->fetch_sub(1, std::memory_order_release);
+	}
+}
+
+
+static void end_read(std::atomic<int> *count)
+{
+	count->fetch_sub(1, std::memory_order_release);
+}
+
+
+/*
+ * Set the slice and color that the db stores position p under in probe.  Returns the
+ * value of the position if it does not need the db data, otherwise PROBE_PENDING.
+ */
+static int probe_slice(DBHANDLE *hdat, PROBE *probe, EGDB_POSITION const *p, int color)
 {
-	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
-	uint32_t index;
-	unsigned short *runlength;
-	unsigned short value_runs_offset;
-	int64_t index64;
 	int bm, bk, wm, wk;
-	int i, subslicenum;
-	int idx_blocknum, subidx_blocknum;	
-	int blocknum;
-	int returnvalue, virtual_value;
-	unsigned char *diskblock;
-	EGDB_POSITION revpos;
-	INDEX n_idx;
-	INDEX *indices;
-	DBP *dbp;
-	CPRSUBDB *dbpointer;
 
 	/* Start tracking db stats here. */
 	++hdat->lookup_stats.db_requests;
 
 	/* set bm, bk, wm, wk. */
-	bm = bitcount64(p->black & ~p->king);
-	wm = bitcount64(p->white & ~p->king);
-	bk = bitcount64(p->black & p->king);
-	wk = bitcount64(p->white & p->king);
+	get_piece_counts(p, &bm, &bk, &wm, &wk);
 	
 	/* If one side has nothing, return appropriate value. */
 	if ((bm + bk) == 0) {
@@ -572,30 +947,49 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 
 	/* Reverse the position if material is dominated by white. */
 	if (needs_reversal(bm, bk, wm, wk, color)) {
-		reverse((BOARD *)&revpos, (BOARD *)p);
-		p = &revpos;
+		reverse((BOARD *)&probe->pos, (BOARD *)p);
 		color = OTHER_COLOR(color);
 		using std::swap;
 		swap(bm, wm);
 		swap(bk, wk);
 	}
+	else
+		probe->pos = *p;
+
+	probe->bm = bm;
+	probe->bk = bk;
+	probe->wm = wm;
+	probe->wk = wk;
+	probe->color = color;
+	return(PROBE_PENDING);
+}
 
-	index64 = position_to_index_slice(p, bm, bk, wm, wk);
 
-	subslicenum = (int)(index64 / (int64_t)MAX_SUBSLICE_INDICES);
-	index = (uint32_t)(index64 - (int64_t)subslicenum * (int64_t)MAX_SUBSLICE_INDICES);
+/*
+ * Find the subdb that holds the index of a probe.  Returns the value of the position
+ * if the subdb is not present, is all one value, or has the index block in the decoded
+ * block cache, otherwise PROBE_PENDING.
+ */
+static int probe_subdb(DBHANDLE *hdat, PROBE *probe)
+{
+	int subslicenum, virtual_value;
+	DBP *dbp;
+	CPRSUBDB *dbpointer;
+
+	subslicenum = (int)(probe->index / (int64_t)MAX_SUBSLICE_INDICES);
+	probe->subindex = (uint32_t)(probe->index - (int64_t)subslicenum * (int64_t)MAX_SUBSLICE_INDICES);
 
 	/* get pointer to db. */
-	dbp = hdat->cprsubdatabase + DBOFFSET(bm, bk, wm, wk, color);
-	dbpointer = dbp->subdb;
+	dbp = hdat->cprsubdatabase + DBOFFSET(probe->bm, probe->bk, probe->wm, probe->wk, probe->color);
+	dbpointer = dbp->subdb.load(std::memory_order_acquire);
 
 	/* check presence. */
 	if (dbpointer == 0) {
 		++hdat->lookup_stats.db_not_present_requests;
 
 		/* Determine if both side-to-move colors are unavailable. */
-		dbp = hdat->cprsubdatabase + DBOFFSET(bm, bk, wm, wk, OTHER_COLOR(color));
-		if (dbp->subdb)
+		dbp = hdat->cprsubdatabase + DBOFFSET(probe->bm, probe->bk, probe->wm, probe->wk, OTHER_COLOR(probe->color));
+		if (dbp->subdb.load(std::memory_order_acquire))
 			return(EGDB_UNKNOWN);
 		else
 			return(EGDB_SUBDB_UNAVAILABLE);
@@ -613,32 +1007,199 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
 		return(dbpointer->singlevalue);
 	}
 
+	/* See if the block is in the decoded block cache. */
+	probe->promote = 0;
+	if (hdat->num_decoded) {
+		probe->idx_blocknum = find_block(0, dbpointer->num_idx_blocks, dbpointer->indices, probe->subindex);
+		virtual_value = get_decoded_value(hdat, dbpointer, probe->idx_blocknum, probe->subindex);
+		if (virtual_value >= 0) {
+			++hdat->lookup_stats.decoded_hits;
+			++hdat->lookup_stats.db_returns;
+			return(virtual_to_real[dbpointer->vmap[probe->idx_blocknum]][virtual_value]);
+		}
+		probe->promote = count_decoded_miss(hdat, dbpointer, probe->idx_blocknum);
+	}
+
+	probe->subdb = dbpointer;
+	return(PROBE_PENDING);
+}
+
+
+/*
+ * Get the value of index from index block idx_blocknum of dbpointer, whose subindex
+ * block is at diskblock, searching from byte i whose first index is n_idx.
+ */
+static int decode_value(DBHANDLE *hdat, CPRSUBDB *dbpointer, int idx_blocknum, unsigned char const *diskblock,
+						int i, INDEX n_idx, INDEX index)
+{
+	uint32_t const *runlength;
+	RUN_ENDS const *runs;
+	int virtual_value;
+
+	/* The subindex block we were looking for is now pointed to by diskblock.
+	 * Search it for the byte that holds index.
+	 */
+	runlength = runlength32_v2[dbpointer->catalogidx[idx_blocknum]];
+	i = (*find_run_byte)(runlength, diskblock, i, index, &n_idx);
+
+	/* Do some simple error checking. */
+	if (i < 0 || i >= SUBINDEX_BLOCKSIZE) {
+		char msg[MAXMSG];
+
+		std::sprintf(msg, "db block array index outside block bounds: %d\nFile %s\n",
+					 i, dbpointer->file->name);
+		(*hdat->log_msg_fn)(msg);
+		return EGDB_UNKNOWN;
+	}
+
+	/* finally, we have found the byte which describes the position we
+	 * wish to look up. it is diskblock[i].
+	 */
+	runs = run_ends_v2 + run_ends_index_v2[dbpointer->catalogidx[idx_blocknum]][diskblock[i]];
+	virtual_value = run_value(runs, (int)(index - n_idx));
+	++hdat->lookup_stats.db_returns;
+
+	return(virtual_to_real[dbpointer->vmap[idx_blocknum]][virtual_value]);
+}
+
+
+/*
+ * Get the value of index from a subdb whose file is autoloaded, and decode its
+ * index block into the decoded block cache if promote is true.  Returns
+ * PROBE_PENDING if the file is not autoloaded.
+ */
+static int lookup_autoloaded(DBHANDLE *hdat, CPRSUBDB *dbpointer, INDEX index, int promote)
+{
+	int i, subidx_blocknum, idx_blocknum;
+	unsigned char *diskblock;
+	unsigned char *file_cache;
+	INDEX n_idx;
+	INDEX *indices;
+
+	/* egdb_set_cache_mb() can change these while we run.  It stores file_cache with
+	 * release after the subindices and replicas, clears it first, and does not free
+	 * the old buffers until the lookups counted by begin_read() have finished.
+	 */
+	file_cache = dbpointer->file->file_cache.load(std::memory_order_acquire);
+	indices = dbpointer->autoload_subindices.load(std::memory_order_acquire);
+	if (!file_cache || !indices)
+		return(PROBE_PENDING);
+
+	++hdat->lookup_stats.autoload_hits;
+
+	/* Read the copy on this cpu's numa node if there is one. */
+	if (hdat->numa_nodes > 1) {
+		unsigned char *replica;
+		int cpu = get_current_cpu();
+
+		if (cpu >= 0 && cpu < hdat->num_cpus) {
+			replica = dbpointer->file->node_cache[hdat->cpu_node[cpu]].load(std::memory_order_acquire);
+			if (replica)
+				file_cache = replica;
+		}
+	}
+
+	/* Do a binary search to find the exact subindex. */
+	subidx_blocknum = find_block(dbpointer->first_subidx_block, 
+								dbpointer->num_idx_blocks * NUM_SUBINDICES - (NUM_SUBINDICES - 1 - dbpointer->last_subidx_block),
+								indices, index);
+	idx_blocknum = subidx_blocknum / NUM_SUBINDICES;
+	diskblock = file_cache + (subidx_blocknum * (size_t)SUBINDEX_BLOCKSIZE) +
+				dbpointer->first_idx_block * (size_t)IDX_BLOCKSIZE;
+	n_idx = indices[subidx_blocknum];
+	i = 0;
+	if (subidx_blocknum == dbpointer->first_subidx_block)
+		i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
+
+	if (promote) {
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* The file may have been demoted since we read file_cache. */
+		if (dbpointer->file->file_cache.load(std::memory_order_relaxed) &&
+					dbpointer->autoload_subindices.load(std::memory_order_relaxed) == indices)
+			decode_block(hdat, dbpointer, idx_blocknum,
+						file_cache + (dbpointer->first_idx_block + idx_blocknum) * (size_t)IDX_BLOCKSIZE);
+	}
+
+	return(decode_value(hdat, dbpointer, idx_blocknum, diskblock, i, n_idx, index));
+}
+
+
+/*
+ * Find the subindex block of cache block ccbp that holds index, where the block is index
+ * block idx_blocknum of dbpointer.  Sets *i to the byte to start searching from and
+ * *n_idx to its first index.  The caller holds egdb_lock.
+ */
+static unsigned char *find_cached_subindex(CPRSUBDB *dbpointer, CCB *ccbp, int idx_blocknum, INDEX index,
+						int *i, INDEX *n_idx)
+{
+	int subidx_blocknum;
+	INDEX *indices;
+
+	/* Do a binary search to find the exact subindex.  This is complicated a bit by the
+	 * problem that there may be a boundary between the end of one subdb and the start of
+	 * the next in this block.  For any subindex block that contains one of these
+	 * boundaries, the subindex stored is the ending block (0 is implied for the
+	 * starting block).  Therefore the binary search cannot use the first subindex of
+	 * a subdb.  We check for this separately.
+	 */
+	indices = ccbp->subindices;
+	if (idx_blocknum == 0 && (dbpointer->single_subidx_block ||
+					dbpointer->first_subidx_block == NUM_SUBINDICES - 1 ||
+					indices[dbpointer->first_subidx_block + 1] > index)) {
+		subidx_blocknum = dbpointer->first_subidx_block;
+		*n_idx = 0;
+		*i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
+	}
+	else {
+		int first, last;
+		if (idx_blocknum == 0)
+			first = dbpointer->first_subidx_block + 1;
+		else
+			first = 0;
+		if (idx_blocknum == dbpointer->num_idx_blocks - 1)
+			last = dbpointer->last_subidx_block + 1;
+		else
+			last = NUM_SUBINDICES;
+		subidx_blocknum = find_block(first, last, indices, index);
+		*n_idx = indices[subidx_blocknum];
+		*i = 0;
+	}
+	return(ccbp->data + subidx_blocknum * SUBINDEX_BLOCKSIZE);
+}
+
+
+/*
+ * Get the value of a probe whose subdb has data, from the autoloaded file or the lru cache.
+ * The caller has counted the lookup with begin_read().
+ */
+static int lookup_probe(DBHANDLE *hdat, PROBE *probe, int cl)
+{
+	int i, value;
+	int idx_blocknum;
+	int blocknum;
+	unsigned char *diskblock;
+	INDEX n_idx;
+	CPRSUBDB *dbpointer;
+
 	/* See if this is an autoloaded block. */
-	if (dbpointer->file->file_cache) {
-		++hdat->lookup_stats.autoload_hits;
-
-		/* Do a binary search to find the exact subindex. */
-		indices = dbpointer->autoload_subindices;
-		subidx_blocknum = find_block(dbpointer->first_subidx_block, 
-									dbpointer->num_idx_blocks * NUM_SUBINDICES - (NUM_SUBINDICES - 1 - dbpointer->last_subidx_block),
-									indices, index);
-		blocknum = subidx_blocknum / NUM_SUBINDICES + dbpointer->first_idx_block;
-		diskblock = dbpointer->file->file_cache + (subidx_blocknum * (size_t)SUBINDEX_BLOCKSIZE) +
-					dbpointer->first_idx_block * (size_t)IDX_BLOCKSIZE;
-		n_idx = indices[subidx_blocknum];
-		i = 0;
-		if (subidx_blocknum == dbpointer->first_subidx_block)
-			i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
-	}
-	else {		/* Not an autoloaded block. */
+	dbpointer = (CPRSUBDB *)probe->subdb;
+	value = lookup_autoloaded(hdat, dbpointer, probe->subindex, probe->promote);
+	if (value != PROBE_PENDING)
+		return(value);
+
+	/* Not an autoloaded block. */
+	{
 		int ccbi;
 		CCB *ccbp;
 
 		/* We know the index and the database, so look in 
 		 * the indices array to find the right index block.
 		 */
-		indices = dbpointer->indices;
-		idx_blocknum = find_block(0, dbpointer->num_idx_blocks, indices, index);
+		if (hdat->num_decoded)
+			idx_blocknum = probe->idx_blocknum;
+		else
+			idx_blocknum = find_block(0, dbpointer->num_idx_blocks, dbpointer->indices, probe->subindex);
 
 		/* See if blocknumber is already in cache. */
 		blocknum = dbpointer->first_idx_block + idx_blocknum;
@@ -664,93 +1225,332 @@ static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int
                                 ccbp = load_blocknum<CCB>(hdat, dbpointer, blocknum);
                         }
 
-                        /* Do a binary search to find the exact subindex.  This is complicated a bit by the
-                         * problem that there may be a boundary between the end of one subdb and the start of
-                         * the next in this block.  For any subindex block that contains one of these
-                         * boundaries, the subindex stored is the ending block (0 is implied for the
-                         * starting block).  Therefore the binary search cannot use the first subindex of
-                         * a subdb.  We check for this separately.
-                         */
-                        indices = ccbp->subindices;
-                        if (idx_blocknum == 0 && (dbpointer->single_subidx_block ||
-                                                        dbpointer->first_subidx_block == NUM_SUBINDICES - 1 ||
-                                                        indices[dbpointer->first_subidx_block + 1] > index)) {
-                                subidx_blocknum = dbpointer->first_subidx_block;
-                                n_idx = 0;
-                                i = dbpointer->startbyte - subidx_blocknum * SUBINDEX_BLOCKSIZE;
-                        }
-                        else {
-                                int first, last;
-                                if (idx_blocknum == 0)
-                                        first = dbpointer->first_subidx_block + 1;
-                                else
-                                        first = 0;
-                                if (idx_blocknum == dbpointer->num_idx_blocks - 1)
-                                        last = dbpointer->last_subidx_block + 1;
-                                else
-                                        last = NUM_SUBINDICES;
-                                subidx_blocknum = find_block(first, last, indices, index);
-                                n_idx = indices[subidx_blocknum];
-                                i = 0;
-                        }
-                        diskblock = ccbp->data + subidx_blocknum * SUBINDEX_BLOCKSIZE;
-		} // END CRITICAL SECTION
-	}
+                        diskblock = find_cached_subindex(dbpointer, ccbp, idx_blocknum, probe->subindex, &i, &n_idx);
 
-	/* The subindex block we were looking for is now pointed to by diskblock.
-	 * Do a linear search for the byte within the block.
-	 */
-	runlength = decompress_catalog_v2[dbpointer->catalogidx[blocknum - dbpointer->first_idx_block]].runlength_table;
-	while (n_idx <= index) {
-		n_idx += runlength[diskblock[i]];
-		i++;
+                        if (probe->promote)
+                                decode_block(hdat, dbpointer, idx_blocknum, ccbp->data);
+		} // END CRITICAL SECTION
 	}
 
-	/* once we are out here, n>index
-	 * we overshot again, move back:
-	 */
-	i--;
-	n_idx -= runlength[diskblock[i]];
-
-	/* Do some simple error checking. */
-	if (i < 0 || i >= SUBINDEX_BLOCKSIZE) {
-		char msg[MAXMSG];
+	return(decode_value(hdat, dbpointer, idx_blocknum, diskblock, i, n_idx, probe->subindex));
+}
 
-		std::sprintf(msg, "db block array index outside block bounds: %d\nFile %s\n",
-					 i, dbpointer->file->name);
-		(*hdat->log_msg_fn)(msg);
-		return EGDB_UNKNOWN;
-	}
 
-	/* finally, we have found the byte which describes the position we
-	 * wish to look up. it is diskblock[i].
-	 */
-	value_runs_offset = decompress_catalog_v2[dbpointer->catalogidx[blocknum - dbpointer->first_idx_block]].value_runs[diskblock[i]];
-	while (1) {
-		n_idx += value_runs_v2[value_runs_offset + 1] + (value_runs_v2[value_runs_offset + 2] << 8);
-		if (n_idx > index)
-			break;
-		value_runs_offset += 3;
-	}
-	virtual_value = value_runs_v2[value_runs_offset];
-	returnvalue = virtual_to_real[dbpointer->vmap[blocknum - dbpointer->first_idx_block]][virtual_value];
-	++hdat->lookup_stats.db_returns;
+/*
+ * Returns EGDB_WIN, EGDB_LOSS, EGDB_DRAW, EGDB_UNKNOWN, or EGDB_NOT_IN_CACHE.
+ * If the position is in an 'incomplete' subdivision, like 5men vs. 4men, it
+ * might also return EGDB_DRAW_OR_LOSS or EEGDB_WIN_OR_DRAW.
+ * First it converts the position to an index. 
+ * Then it determines which block contains the index.
+ * It may load that block from disk if it's not already in cache.
+ * Finally it reads and decompresses the block to find
+ * the value of the position.
+ * If the value is not already in a cache buffer, the action depends on
+ * the argument cl.  If cl is true, DB_NOT_IN_CACHE is returned, 
+ * otherwise the disk block is read and cached and the value is obtained.
+ */
+static int dblookup(EGDB_DRIVER *handle, EGDB_POSITION const *p, int color, int cl)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int value;
+	PROBE probe;
+	std::atomic<int> *readers;
+
+	value = probe_slice(hdat, &probe, p, color);
+	if (value != PROBE_PENDING)
+		return(value);
+
+	probe.index = position_to_index_slice(&probe.pos, probe.bm, probe.bk, probe.wm, probe.wk);
+	value = probe_subdb(hdat, &probe);
+	if (value != PROBE_PENDING)
+		return(value);
+
+	/* The buffers that the rest of the lookup reads can be retired by a cache resize. */
+	readers = begin_read(hdat);
+	value = lookup_probe(hdat, &probe, cl);
+	end_read(readers);
+	return(value);
+}
+
+
+/*
+ * Look up at most PROBE_BATCH_SIZE positions.  The positions are indexed together.
+ * The ones in blocks that are already cached are looked up in one hold of egdb_lock.
+ * The rest are sorted by block, so that each block is read from disk once for all of
+ * its positions.
+ */
+static void lookup_probe_batch(DBHANDLE *hdat, EGDB_POSITION const *positions, int const *colors, int n,
+						int *results, int cl)
+{
+	int i, k, m, first, value;
+	int ccbi, decoded_blocknum;
+	unsigned char *diskblock;
+	INDEX n_idx;
+	CPRSUBDB *dbpointer, *decoded_subdb;
+	CCB *ccbp;
+	std::atomic<int> *readers;
+	PROBE probes[PROBE_BATCH_SIZE];
+
+	for (m = 0, k = 0; k < n; ++k) {
+		value = probe_slice(hdat, probes + m, positions + k, colors[k]);
+		if (value == PROBE_PENDING)
+			probes[m++].result = k;
+		else
+			results[k] = value;
+	}
+	index_probes(probes, m);
+
+	/* Keep the probes that need a cache block. */
+	readers = begin_read(hdat);
+	for (first = 0, k = 0; k < m; ++k) {
+		value = probe_subdb(hdat, probes + k);
+		if (value == PROBE_PENDING) {
+			dbpointer = (CPRSUBDB *)probes[k].subdb;
+			value = lookup_autoloaded(hdat, dbpointer, probes[k].subindex, probes[k].promote);
+		}
+		if (value != PROBE_PENDING) {
+			results[probes[k].result] = value;
+			continue;
+		}
+		if (!hdat->num_decoded)
+			probes[k].idx_blocknum = find_block(0, dbpointer->num_idx_blocks, dbpointer->indices, probes[k].subindex);
+		probes[k].file = dbpointer->file;
+		probes[k].blocknum = dbpointer->first_idx_block + probes[k].idx_blocknum;
+		probes[first++] = probes[k];
+	}
+	m = first;
+
+	/* Look up the probes whose blocks are cached, and keep the ones that must be read. 
+	 * Several probes of a block can ask for it to be decoded; it is done once if they
+	 * are together.
+	 */
+	decoded_subdb = 0;
+	decoded_blocknum = -1;
+	if (m > 0) {
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		for (first = 0, k = 0; k < m; ++k) {
+			dbpointer = (CPRSUBDB *)probes[k].subdb;
+			ccbi = dbpointer->file->cache_bufferi[probes[k].blocknum];
+			if (ccbi == UNDEFINED_BLOCK_ID) {
+				if (cl)
+					results[probes[k].result] = EGDB_NOT_IN_CACHE;
+				else
+					probes[first++] = probes[k];
+				continue;
+			}
+			ccbp = update_lru<CCB>(hdat, ccbi);
+			diskblock = find_cached_subindex(dbpointer, ccbp, probes[k].idx_blocknum, probes[k].subindex, &i, &n_idx);
+			if (probes[k].promote && (dbpointer != decoded_subdb || probes[k].idx_blocknum != decoded_blocknum)) {
+				decode_block(hdat, dbpointer, probes[k].idx_blocknum, ccbp->data);
+				decoded_subdb = dbpointer;
+				decoded_blocknum = probes[k].idx_blocknum;
+			}
+			results[probes[k].result] = decode_value(hdat, dbpointer, probes[k].idx_blocknum, diskblock, i, n_idx,
+									probes[k].subindex);
+		}
+		m = first;
+	}
+	if (m > 1)
+		sort_probes(probes, m);
+
+	for (first = 0; first < m; first = k) {
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* Another thread may have read the block meanwhile. */
+		dbpointer = (CPRSUBDB *)probes[first].subdb;
+		ccbi = dbpointer->file->cache_bufferi[probes[first].blocknum];
+		if (ccbi != UNDEFINED_BLOCK_ID)
+			ccbp = update_lru<CCB>(hdat, ccbi);
+		else
+			ccbp = load_blocknum<CCB>(hdat, dbpointer, probes[first].blocknum);
+
+		for (k = first; k < m && probes[k].file == probes[first].file && probes[k].blocknum == probes[first].blocknum; ++k) {
+			dbpointer = (CPRSUBDB *)probes[k].subdb;
+			diskblock = find_cached_subindex(dbpointer, ccbp, probes[k].idx_blocknum, probes[k].subindex, &i, &n_idx);
+			if (probes[k].promote && (dbpointer != decoded_subdb || probes[k].idx_blocknum != decoded_blocknum)) {
+				decode_block(hdat, dbpointer, probes[k].idx_blocknum, ccbp->data);
+				decoded_subdb = dbpointer;
+				decoded_blocknum = probes[k].idx_blocknum;
+			}
+			results[probes[k].result] = decode_value(hdat, dbpointer, probes[k].idx_blocknum, diskblock, i, n_idx,
+									probes[k].subindex);
+		}
+	}
+	end_read(readers);
+}
+
+
+/*
+ * Look up n positions, PROBE_BATCH_SIZE at a time.
+ */
+static void dblookup_batch(EGDB_DRIVER *handle, EGDB_POSITION const *positions, int const *colors, int n,
+						int *results, int cl)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int i;
+
+	for (i = 0; i < n; i += PROBE_BATCH_SIZE)
+		lookup_probe_batch(hdat, positions + i, colors + i, (std::min)(n - i, PROBE_BATCH_SIZE), results + i, cl);
+}
+
+/*
+ * Copy block blocknum of a db file into buffer for a slice scan.  A block that is
+ * autoloaded or in the lru cache is copied from there, otherwise it is read from the
+ * file without caching it, so that a scan does not flush the blocks that lookups are
+ * using.  Returns 0 on success, 1 on a read error.
+ */
+static int read_scan_block(DBHANDLE *hdat, DBFILE *file, int blocknum, unsigned char *buffer)
+{
+	int ccbi;
+	unsigned char *file_cache;
+	std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+	/* Buffers are retired under the lock, so they stay valid while we hold it. */
+	file_cache = file->file_cache.load(std::memory_order_relaxed);
+	if (file_cache) {
+		std::memcpy(buffer, file_cache + blocknum * (size_t)CACHE_BLOCKSIZE, CACHE_BLOCKSIZE);
+		return(0);
+	}
+	ccbi = file->cache_bufferi[blocknum];
+	if (ccbi != UNDEFINED_BLOCK_ID) {
+		std::memcpy(buffer, hdat->ccbs[ccbi].data, CACHE_BLOCKSIZE);
+		return(0);
+	}
+	if (set_file_pointer(file->fp, (int64_t)blocknum * CACHE_BLOCKSIZE)) {
+		(*hdat->log_msg_fn)("seek failed\n");
+		return(1);
+	}
+	if (!read_file(file->fp, buffer, CACHE_BLOCKSIZE, CACHE_BLOCKSIZE)) {
+		(*hdat->log_msg_fn)("Error reading file\n");
+		return(1);
+	}
+	return(0);
+}
+
+
+/*
+ * Decode the index blocks of a scan task in order and pass their values to the scan
+ * callback as runs.  Each index block starts on a byte boundary at the index in
+ * subdb->indices[] and has its own catalog and vmap, so the tasks can be decoded
+ * independently.
+ */
+static void scan_task(SCAN_SLICE *scan, SCAN_TASK const *task)
+{
+	DBHANDLE *hdat = (DBHANDLE *)scan->hdat;
+	int i, value, idx_blocknum;
+	unsigned int offset;
+	char const *vmap;
+	unsigned char buffer[CACHE_BLOCKSIZE];
+	unsigned short const *runlength, *value_runs;
+	INDEX subslice_size, left, symbol_left, n;
+	CPRSUBDB *subdb;
+	SCAN_RUN run;
+
+	run.scan = scan;
+	run.index = task->subslice * MAX_SUBSLICE_INDICES;
+	run.count = 0;
+	run.value = INT_MIN;
+	subslice_size = (INDEX)(std::min)(scan->size - run.index, MAX_SUBSLICE_INDICES);
 
-	return(returnvalue);
+	/* Use the subdbs that the tasks were made from, even if egdb_extend() has added them since. */
+	subdb = (CPRSUBDB *)scan->subdbs;
+	if (!subdb) {
+
+		/* Same as dblookup() for a slice that is not present. */
+		if (hdat->cprsubdatabase[DBOFFSET(scan->bm, scan->bk, scan->wm, scan->wk, OTHER_COLOR(scan->color))].subdb.load(std::memory_order_acquire))
+			value = EGDB_UNKNOWN;
+		else
+			value = EGDB_SUBDB_UNAVAILABLE;
+		add_scan_run(&run, subslice_size, value);
+		end_scan_run(&run);
+		return;
+	}
+
+	subdb += task->subslice;
+	if (subdb->singlevalue != NOT_SINGLEVALUE) {
+		add_scan_run(&run, subslice_size, subdb->singlevalue);
+		end_scan_run(&run);
+		return;
+	}
+
+	run.index += subdb->indices[task->first_block];
+	for (idx_blocknum = task->first_block; idx_blocknum < task->first_block + task->num_blocks; ++idx_blocknum) {
+		if (read_scan_block(hdat, subdb->file, subdb->first_idx_block + idx_blocknum, buffer)) {
+			scan->status = 1;
+			return;
+		}
+
+		if (idx_blocknum < subdb->num_idx_blocks - 1)
+			left = subdb->indices[idx_blocknum + 1] - subdb->indices[idx_blocknum];
+		else
+			left = subslice_size - subdb->indices[idx_blocknum];
+		runlength = decompress_catalog_v2[(unsigned char)subdb->catalogidx[idx_blocknum]].runlength_table;
+		value_runs = decompress_catalog_v2[(unsigned char)subdb->catalogidx[idx_blocknum]].value_runs;
+		vmap = virtual_to_real[subdb->vmap[idx_blocknum]];
+		i = idx_blocknum == 0 ? subdb->startbyte : 0;
+		for ( ; left && i < IDX_BLOCKSIZE; ++i) {
+
+			/* Each symbol is a list of (value, length) runs in value_runs_v2. */
+			symbol_left = (std::min)((INDEX)runlength[buffer[i]], left);
+			left -= symbol_left;
+			for (offset = value_runs[buffer[i]]; symbol_left && value_runs_v2[offset] != VALUE_RUNS_END; offset += 3) {
+				n = (std::min)((INDEX)(value_runs_v2[offset + 1] + (value_runs_v2[offset + 2] << 8)), symbol_left);
+				if (add_scan_run(&run, n, vmap[value_runs_v2[offset]]))
+					return;
+				symbol_left -= n;
+			}
+		}
+	}
+	end_scan_run(&run);
+}
+
+
+/*
+ * Scan a slice by decoding its compressed data in order.  See egdb_scan_slice().
+ */
+static int scan_slice(EGDB_DRIVER *handle, int bm, int bk, int wm, int wk, int color,
+						EGDB_SCAN_FN fn, void *context, int num_threads)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int k, first, num_blocks, num_subslices;
+	DBP *dbp;
+	CPRSUBDB *subdbs, *subdb;
+	SCAN_SLICE scan;
+
+	dbp = hdat->cprsubdatabase + DBOFFSET(bm, bk, wm, wk, color);
+	subdbs = dbp->subdb.load(std::memory_order_acquire);
+	init_scan_slice(&scan, hdat, subdbs, bm, bk, wm, wk, color, fn, context);
+	num_subslices = get_num_subslices(bm, bk, wm, wk, MAX_SUBSLICE_INDICES);
+	for (k = 0; k < num_subslices; ++k) {
+		subdb = subdbs ? subdbs + k : 0;
+		if (subdb && subdb->singlevalue == NOT_SINGLEVALUE)
+			num_blocks = subdb->num_idx_blocks;
+		else
+			num_blocks = 1;
+		for (first = 0; first < num_blocks; first += SCAN_TASK_BLOCKS) {
+			SCAN_TASK task = {k, first, (std::min)(SCAN_TASK_BLOCKS, num_blocks - first)};
+			scan.tasks.push_back(task);
+		}
+	}
+	run_scan_tasks(&scan, num_threads, scan_task);
+	return(scan.status);
 }
 
-static int init_autoload_subindices(DBHANDLE *hdat, DBFILE *file, size_t *allocated_bytes)
+
+static int init_autoload_subindices(DBHANDLE *hdat, DBP *dbtable, DBFILE *file, unsigned char *file_cache, size_t *allocated_bytes)
 {
 	int i, k, m, size;
 	int first_subi, num_subi, subi, blocknum;
 	DBP *p;
 	INDEX index;
+	INDEX *subindices;
 	unsigned char *datap;
 	unsigned short *runlen_table;
 
 	*allocated_bytes = 0;
 	for (i = 0; i < DBSIZE; ++i) {
-		p = hdat->cprsubdatabase + i;
+		p = dbtable + i;
 		if (p->subdb != NULL) {
 			for (k = 0; k < p->num_subslices; ++k) {
 				if (p->subdb[k].file == file && p->subdb[k].singlevalue == NOT_SINGLEVALUE) {
@@ -761,8 +1561,8 @@ static int init_autoload_subindices(DBHANDLE *hdat, DBFILE *file, size_t *alloca
 								(NUM_SUBINDICES - 1 - p->subdb[k].last_subidx_block);
 
 					size = num_subi * sizeof(INDEX);
-					p->subdb[k].autoload_subindices = (INDEX *)std::malloc(size);
-					if (p->subdb[k].autoload_subindices == NULL) {
+					subindices = (INDEX *)std::malloc(size);
+					if (subindices == NULL) {
 						(*hdat->log_msg_fn)("Cannot allocate memory for autoload subindices array\n");
 						return(1);
 					}
@@ -770,9 +1570,9 @@ static int init_autoload_subindices(DBHANDLE *hdat, DBFILE *file, size_t *alloca
 
 					/* Zero all subindices up to first_subi. */
 					for (subi = 0; subi <= first_subi; ++subi)
-						p->subdb[k].autoload_subindices[subi] = 0;
+						subindices[subi] = 0;
 
-					datap = p->subdb[k].file->file_cache + IDX_BLOCKSIZE * (size_t)p->subdb[k].first_idx_block;
+					datap = file_cache + IDX_BLOCKSIZE * (size_t)p->subdb[k].first_idx_block;
 
 					index = 0;
 					subi = first_subi;
@@ -784,13 +1584,16 @@ static int init_autoload_subindices(DBHANDLE *hdat, DBFILE *file, size_t *alloca
 							subi = m / SUBINDEX_BLOCKSIZE;
 							if (subi >= num_subi)
 								break;
-							p->subdb[k].autoload_subindices[subi] = index;
+							subindices[subi] = index;
 
 							blocknum = m / CACHE_BLOCKSIZE;
 							runlen_table = decompress_catalog_v2[p->subdb[k].catalogidx[blocknum]].runlength_table;
 						}
 						index += runlen_table[datap[m]];
 					}
+
+					/* Lookups do not use it until file_cache is stored with release. */
+					p->subdb[k].autoload_subindices.store(subindices, std::memory_order_relaxed);
 				}
 			}
 		}
@@ -863,19 +1666,701 @@ static CPRSUBDB *find_first_subdb(DBHANDLE *hdat, DBFILE *file, int blocknumnum)
 	int first_blocknum, last_blocknum;
 	DBP *p;
 
-	for (i = 0; i < DBSIZE; ++i) {
-		p = hdat->cprsubdatabase + i;
-		if (p->subdb != NULL) {
-			for (k = 0; k < p->num_subslices; ++k) {
-				if (p->subdb[k].file == file) {
-					first_blocknum = p->subdb[k].first_idx_block;
-					last_blocknum = p->subdb[k].first_idx_block + p->subdb[k].num_idx_blocks - 1;
-					if (blocknumnum >= first_blocknum && blocknumnum <= last_blocknum)
-						return(p->subdb + k);
-				}
+	for (i = 0; i < DBSIZE; ++i) {
+		p = hdat->cprsubdatabase + i;
+		if (p->subdb != NULL) {
+			for (k = 0; k < p->num_subslices; ++k) {
+				if (p->subdb[k].file == file) {
+					first_blocknum = p->subdb[k].first_idx_block;
+					last_blocknum = p->subdb[k].first_idx_block + p->subdb[k].num_idx_blocks - 1;
+					if (blocknumnum >= first_blocknum && blocknumnum <= last_blocknum)
+						return(p->subdb + k);
+				}
+			}
+		}
+	}
+	return(0);
+}
+
+
+#define MIN_AUTOLOAD_RATIO .18
+#define MAX_AUTOLOAD_RATIO .35
+
+/*
+ * Return the number of mb of db files to autoload when there are
+ * cache_mb_avail mb available for autoload and lru cache buffers.
+ */
+static int get_max_autoload(DBHANDLE *hdat, int cache_mb_avail)
+{
+	int i;
+	int max_autoload;
+	int64_t total_dbsize;
+
+	/* Find the total size of all the files that will be used. */
+	total_dbsize = 0;
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		if (hdat->dbfiles[i].is_present)
+			total_dbsize += (int64_t)hdat->dbfiles[i].num_cacheblocks * CACHE_BLOCKSIZE;
+	}
+
+	/* Calculate how much cache mb to autoload. */
+	if (total_dbsize / ONE_MB - cache_mb_avail < 20)
+		max_autoload = 1 + (int)(total_dbsize / ONE_MB);		/* Autoload everything. */
+	else if (cache_mb_avail < 15) {
+		cache_mb_avail = 15;
+		max_autoload = (int)(cache_mb_avail * MIN_AUTOLOAD_RATIO);
+	}
+	else if (cache_mb_avail > 1000)
+		max_autoload = (int)(cache_mb_avail * MAX_AUTOLOAD_RATIO);
+	else
+		max_autoload = (int)((float)cache_mb_avail * (float)(MIN_AUTOLOAD_RATIO + cache_mb_avail * (MAX_AUTOLOAD_RATIO - MIN_AUTOLOAD_RATIO) / 1000.0));
+	return(max_autoload);
+}
+
+
+/*
+ * Select the files that will be autoloaded, using files_autoload_order[].
+ * Autoload files with the least number of kings first, and use number of pieces
+ * as a second criterea.  Everything up to MIN_AUTOLOAD_PIECES is always autoloaded.
+ * autoload[MAXFILES] is indexed like dbfiles[], and is set to 1 for each file to autoload.
+ */
+static void choose_autoload_files(DBHANDLE *hdat, int max_autoload, char *autoload)
+{
+	int i;
+	size_t size;
+	DBFILE *f;
+
+	std::memset(autoload, 0, MAXFILES * sizeof(autoload[0]));
+	size = 0;
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->files_autoload_order[i];
+		if (!f || !f->is_present || f->pieces > hdat->dbpieces)
+			continue;
+
+		size += f->num_cacheblocks;
+		if (f->pieces <= MIN_AUTOLOAD_PIECES || (int)((int64_t)((int64_t)size * (int64_t)CACHE_BLOCKSIZE) / ONE_MB) <= max_autoload)
+			autoload[f - hdat->dbfiles] = 1;
+	}
+}
+
+
+/*
+ * Find the numa nodes and the node of each cpu, if the numa option is on.
+ * Node numbers can have gaps, so replicas are numbered by their position in
+ * node_ids rather than by node number.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int init_numa(DBHANDLE *hdat)
+{
+	int i, j, node, count;
+	char msg[MAXMSG];
+
+	hdat->numa_nodes = 1;
+	hdat->node_ids[0] = 0;
+	if (!hdat->options.numa)
+		return(0);
+
+	count = (std::min)(get_numa_nodes(hdat->node_ids, MAX_NUMA_NODES), MAX_NUMA_NODES);
+	if (count <= 1) {
+		(*hdat->log_msg_fn)("NUMA mode: only one node, not replicating\n");
+		return(0);
+	}
+
+	hdat->num_cpus = get_cpu_count();
+	hdat->cpu_node = (unsigned char *)std::malloc(hdat->num_cpus);
+	if (!hdat->cpu_node) {
+		(*hdat->log_msg_fn)("Cannot allocate memory for cpu_node\n");
+		return(1);
+	}
+	hdat->numa_nodes = count;
+	for (i = 0; i < hdat->num_cpus; ++i) {
+		node = get_cpu_numa_node(i);
+		hdat->cpu_node[i] = 0;
+		for (j = 0; j < hdat->numa_nodes; ++j)
+			if (hdat->node_ids[j] == node)
+				hdat->cpu_node[i] = j;
+	}
+	std::sprintf(msg, "NUMA mode: %d nodes, %d cpus\n", hdat->numa_nodes, hdat->num_cpus);
+	(*hdat->log_msg_fn)(msg);
+	return(0);
+}
+
+
+/*
+ * Copy a small autoloaded file to each numa node, so lookups can read it from
+ * local memory.  file_cache is moved to the first node and is used as its copy.
+ * Nodes that cannot get a copy use file_cache.  Returns the number of bytes allocated.
+ */
+static int64_t replicate_file(DBHANDLE *hdat, DBFILE *f, unsigned char *file_cache, unsigned char **node_cache)
+{
+	int node;
+	int64_t allocated_bytes;
+	size_t size;
+	char msg[MAXMSG];
+
+	for (node = 0; node < MAX_NUMA_NODES; ++node)
+		node_cache[node] = 0;
+	if (hdat->numa_nodes <= 1 || f->pieces > MAX_REPLICATED_PIECES)
+		return(0);
+
+	size = f->num_cacheblocks * (size_t)CACHE_BLOCKSIZE;
+	bind_memory_to_node(file_cache, size, hdat->node_ids[0]);
+	node_cache[0] = file_cache;
+	allocated_bytes = 0;
+	for (node = 1; node < hdat->numa_nodes; ++node) {
+		node_cache[node] = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
+		if (!node_cache[node]) {
+			std::sprintf(msg, "Cannot allocate memory for %s on numa node %d\n", f->name, hdat->node_ids[node]);
+			(*hdat->log_msg_fn)(msg);
+			continue;
+		}
+
+		/* Bind before the copy touches the pages. */
+		bind_memory_to_node(node_cache[node], size, hdat->node_ids[node]);
+		std::memcpy(node_cache[node], file_cache, size);
+		allocated_bytes += size;
+	}
+	return(allocated_bytes);
+}
+
+
+static void free_replicas(DBFILE *f)
+{
+	int node;
+
+	for (node = 1; node < MAX_NUMA_NODES; ++node) {
+		if (f->node_cache[node])
+			virtual_free(f->node_cache[node]);
+	}
+	for (node = 0; node < MAX_NUMA_NODES; ++node)
+		f->node_cache[node].store(0, std::memory_order_relaxed);
+}
+
+
+/*
+ * Open the data file of f with a handle of its own.  Logs a message and returns
+ * NULLPTR if the file cannot be opened, or if its path does not fit in MAXFILENAME.
+ */
+static FILE_HANDLE open_data_file(DBHANDLE *hdat, DBFILE *f)
+{
+	FILE_HANDLE fp;
+	char name[MAXFILENAME];
+	char msg[MAXMSG + MAXFILENAME];
+
+	if (std::snprintf(name, sizeof(name), "%s%s.cpr1", hdat->db_filepath, f->name) >= (int)sizeof(name)) {
+		std::snprintf(msg, sizeof(msg), "Path too long for %s.cpr1\n", f->name);
+		(*hdat->log_msg_fn)(msg);
+		return(NULLPTR);
+	}
+	fp = open_file(name);
+	if (fp == NULLPTR) {
+		std::snprintf(msg, sizeof(msg), "Cannot open %s\n", name);
+		(*hdat->log_msg_fn)(msg);
+	}
+	return(fp);
+}
+
+
+/*
+ * Open the data file of a db that is present.  If the db is autoloaded then read 
+ * the whole file into memory, otherwise allocate its cache_bufferi[] array.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int open_dbfile(DBHANDLE *hdat, DBP *dbtable, DBFILE *f, int64_t *allocated_bytes, int64_t *autoload_bytes)
+{
+	int j, stat;
+	size_t size;
+	unsigned char *file_cache;
+	unsigned char *node_cache[MAX_NUMA_NODES];
+
+	f->fp = open_data_file(hdat, f);
+	if (f->fp == NULLPTR)
+		return(1);
+
+	/* Allocate buffers and read files for autoloaded dbs. */
+	if (f->autoload) {
+		size = f->num_cacheblocks * (size_t)CACHE_BLOCKSIZE;
+		file_cache = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
+		f->file_cache.store(file_cache, std::memory_order_relaxed);
+		*allocated_bytes += size;
+		*autoload_bytes += size;
+		if (file_cache == NULL) {
+			(*hdat->log_msg_fn)("Cannot allocate memory for autoload array\n");
+			return(1);
+		}
+
+		/* Seek to the beginning of the file. */
+		if (set_file_pointer(f->fp, 0)) {
+			(*hdat->log_msg_fn)("autoload seek failed\n");
+			return(-1);
+		}
+
+		read_file(f->fp, file_cache, size, get_page_size());
+
+		/* Close the db file, we are done with it. */
+		close_file(f->fp);
+		f->fp = NULLPTR;
+
+		/* Allocate the subindices. */
+		stat = init_autoload_subindices(hdat, dbtable, f, file_cache, &size);
+		if (stat)
+			return(1);
+
+		*allocated_bytes += size;
+		*autoload_bytes += size;
+
+		/* No lookups can reach this file until its subdbs are published. */
+		size = (size_t)replicate_file(hdat, f, file_cache, node_cache);
+		for (j = 0; j < MAX_NUMA_NODES; ++j)
+			f->node_cache[j].store(node_cache[j], std::memory_order_relaxed);
+		*allocated_bytes += size;
+		*autoload_bytes += size;
+	}
+	else {
+		/* These slices are not autoloaded.
+		 * Allocate the array of indices into ccbs[].
+		 * Each array entry is either an index into ccbs or -1 if that cache block is not loaded.
+		 */
+		size = f->num_cacheblocks * sizeof(f->cache_bufferi[0]);
+		f->cache_bufferi = (int *)std::malloc(size);
+		*allocated_bytes += size;
+		if (f->cache_bufferi == NULL) {
+			(*hdat->log_msg_fn)("Cannot allocate memory for cache_bufferi array\n");
+			return(-1);
+		}
+
+		/* Init these buffer indices to UNDEFINED_BLOCK_ID, means that cache block is not loaded. */
+		for (j = 0; j < f->num_cacheblocks; ++j)
+			f->cache_bufferi[j] = UNDEFINED_BLOCK_ID;
+	}
+	return(0);
+}
+
+
+/*
+ * Allocate hdat->cacheblocks ccbs and their cache buffers, and
+ * initialize the lru list.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int alloc_lru_cache(DBHANDLE *hdat)
+{
+	int i, j, count;
+	size_t size;
+	char msg[MAXMSG];
+	unsigned char *blockp;		/* Base address of an allocate group of cache buffers. */
+
+	/* Allocate the CCB array. */
+	size = hdat->cacheblocks * sizeof(CCB);
+	hdat->ccbs = (CCB *)std::malloc(size);
+	if (!hdat->ccbs) {
+		(*hdat->log_msg_fn)("Cannot allocate memory for ccbs\n");
+		return(1);
+	}
+
+	std::memset(hdat->ccbs, 0, size);
+
+	/* Init the lru list. */
+	for (i = 0; i < hdat->cacheblocks; ++i) {
+		hdat->ccbs[i].next = i + 1;
+		hdat->ccbs[i].prev = i - 1;
+		hdat->ccbs[i].blocknum = UNDEFINED_BLOCK_ID;
+	}
+	hdat->ccbs[hdat->cacheblocks - 1].next = 0;
+	hdat->ccbs[0].prev = hdat->cacheblocks - 1;
+	hdat->ccbs_top = 0;
+
+	if (hdat->cacheblocks > 0) {
+		std::sprintf(msg, "Allocating %d cache buffers of size %d\n",
+					hdat->cacheblocks, CACHE_BLOCKSIZE);
+		(*hdat->log_msg_fn)(msg);
+	}
+
+	/* Allocate the cache buffers in groups of CACHE_ALLOC_COUNT at a time. */
+	for (i = 0; i < hdat->cacheblocks; i += CACHE_ALLOC_COUNT) {
+		count = (std::min)(CACHE_ALLOC_COUNT, hdat->cacheblocks - i);
+		size = count * CACHE_BLOCKSIZE * sizeof(unsigned char);
+		blockp = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
+		if (blockp == NULL) {
+			(*hdat->log_msg_fn)("aligned_large_alloc failure on cache buffers\n");
+			return(-1);
+		}
+		if (hdat->numa_nodes > 1)
+			interleave_memory(blockp, size, hdat->node_ids, hdat->numa_nodes);
+
+		/* Assign the ccb data pointers. */
+		for (j = 0; j < count; ++j)
+			hdat->ccbs[i + j].data = blockp + j * CACHE_BLOCKSIZE * sizeof(unsigned char);
+	}
+	return(0);
+}
+
+
+/*
+ * Allocate a decoded block cache of at most mb megabytes.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int alloc_decoded_cache(DBHANDLE *hdat, int mb)
+{
+	int i, slots;
+	char msg[MAXMSG];
+
+	if (mb <= 0)
+		return(0);
+
+	/* Use a power of 2 number of slots, so the hash can be masked. */
+	for (slots = 1; 2 * (int64_t)slots * DECODED_BLOCK_BYTES <= (int64_t)mb * ONE_MB; slots *= 2)
+		;
+	hdat->decoded = (DECODED_SLOT *)std::calloc(slots, sizeof(DECODED_SLOT));
+	hdat->decoded_buffers = (unsigned char *)aligned_large_alloc(slots * (size_t)DECODED_BLOCK_BYTES, hdat->options.large_pages);
+	hdat->num_decode_misses = (std::max)(4096, 8 * slots);
+	hdat->decode_misses = (unsigned char *)std::calloc(hdat->num_decode_misses, 1);
+	if (!hdat->decoded || !hdat->decoded_buffers || !hdat->decode_misses) {
+		(*hdat->log_msg_fn)("Cannot allocate memory for decoded block cache\n");
+		return(1);
+	}
+	for (i = 0; i < slots; ++i)
+		hdat->decoded[i].values = hdat->decoded_buffers + i * (size_t)DECODED_BLOCK_BYTES;
+	hdat->num_decoded = slots;
+
+	std::sprintf(msg, "Allocating %d decoded block buffers of size %d\n", slots, DECODED_BLOCK_BYTES);
+	(*hdat->log_msg_fn)(msg);
+	return(0);
+}
+
+
+/*
+ * Keep a buffer that lookups may still be reading until free_retired_buffers().
+ * large is true for buffers from aligned_large_alloc().  The caller holds egdb_lock.
+ */
+static void retire_buffer(DBHANDLE *hdat, void *ptr, int large)
+{
+	RETIRED_BUF *p;
+
+	if (!ptr)
+		return;
+
+	p = (RETIRED_BUF *)std::realloc(hdat->retired, (hdat->num_retired + 1) * sizeof(RETIRED_BUF));
+	if (!p) {
+		/* Leak it rather than free something that may be in use. */
+		(*hdat->log_msg_fn)("Cannot allocate memory for retired buffer list\n");
+		return;
+	}
+	hdat->retired = p;
+	hdat->retired[hdat->num_retired].ptr = ptr;
+	hdat->retired[hdat->num_retired].large = large;
+	++hdat->num_retired;
+}
+
+
+/*
+ * Wait until the lookups that may have read a retired buffer have finished.
+ * Lookups that begin after the epoch is advanced see the pointers that replaced
+ * the retired buffers.  The caller must not hold egdb_lock, which the lookups
+ * being waited for may need, and holds resize_lock unless the driver is closing.
+ */
+static void wait_for_readers(DBHANDLE *hdat)
+{
+	int i;
+	unsigned int epoch;
+
+	epoch = hdat->read_epoch.fetch_add(1);
+	for (i = 0; i < READER_SHARDS; ++i)
+		while (hdat->readers[epoch & 1][i].count.load(std::memory_order_acquire))
+			std::this_thread::yield();
+}
+
+
+/*
+ * Free the retired buffers once no lookup can be reading them.  This is
+ * where their memory goes back to the os.
+ */
+static void free_retired_buffers(DBHANDLE *hdat)
+{
+	int i;
+
+	if (hdat->num_retired == 0)
+		return;
+
+	wait_for_readers(hdat);
+	for (i = 0; i < hdat->num_retired; ++i) {
+		if (hdat->retired[i].large)
+			virtual_free(hdat->retired[i].ptr);
+		else
+			std::free(hdat->retired[i].ptr);
+	}
+	std::free(hdat->retired);
+	hdat->retired = 0;
+	hdat->num_retired = 0;
+}
+
+
+/*
+ * Stop autoloading a file and look up its positions through the lru cache.
+ */
+static int demote_file(DBHANDLE *hdat, DBFILE *f)
+{
+	int i, k;
+	char msg[MAXMSG];
+	DBP *p;
+
+	/* Files that were autoloaded by initdblookup() were closed after reading them. */
+	if (f->fp == NULLPTR) {
+		f->fp = open_data_file(hdat, f);
+		if (f->fp == NULLPTR)
+			return(1);
+	}
+	if (!f->cache_bufferi) {
+		f->cache_bufferi = (int *)std::malloc(f->num_cacheblocks * sizeof(f->cache_bufferi[0]));
+		if (f->cache_bufferi == NULL) {
+			(*hdat->log_msg_fn)("Cannot allocate memory for cache_bufferi array\n");
+			return(1);
+		}
+		for (i = 0; i < f->num_cacheblocks; ++i)
+			f->cache_bufferi[i] = UNDEFINED_BLOCK_ID;
+	}
+
+	{ // BEGIN CRITICAL SECTION
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* Clear file_cache before the subindices, dblookup() reads them in the other order. */
+		retire_buffer(hdat, f->file_cache.load(std::memory_order_relaxed), 1);
+		f->file_cache.store(0, std::memory_order_release);
+		f->autoload = 0;
+		for (i = 1; i < MAX_NUMA_NODES; ++i)
+			retire_buffer(hdat, f->node_cache[i].load(std::memory_order_relaxed), 1);
+		for (i = 0; i < MAX_NUMA_NODES; ++i)
+			f->node_cache[i].store(0, std::memory_order_release);
+		for (i = 0; i < DBSIZE; ++i) {
+			p = hdat->cprsubdatabase + i;
+			if (p->subdb != NULL) {
+				for (k = 0; k < p->num_subslices; ++k) {
+					if (p->subdb[k].file == f && p->subdb[k].autoload_subindices) {
+						retire_buffer(hdat, p->subdb[k].autoload_subindices.load(std::memory_order_relaxed), 0);
+						p->subdb[k].autoload_subindices.store(0, std::memory_order_release);
+					}
+				}
+			}
+		}
+	} // END CRITICAL SECTION
+
+	std::snprintf(msg, sizeof(msg), "demote %s\n", f->name);
+	(*hdat->log_msg_fn)(msg);
+	return(0);
+}
+
+
+/*
+ * Read a whole file into memory and stop using the lru cache for it.
+ * The file keeps its fp and cache_bufferi[], because a lookup that started
+ * before the file was promoted may still use them.
+ */
+static int promote_file(DBHANDLE *hdat, DBFILE *f)
+{
+	int i, stat;
+	size_t size;
+	char msg[MAXMSG];
+	FILE_HANDLE fp;
+	unsigned char *file_cache;
+	unsigned char *node_cache[MAX_NUMA_NODES];
+
+	/* Use a separate handle, lookups are reading f->fp. */
+	fp = open_data_file(hdat, f);
+	if (fp == NULLPTR)
+		return(1);
+
+	size = f->num_cacheblocks * (size_t)CACHE_BLOCKSIZE;
+	file_cache = (unsigned char *)aligned_large_alloc(size, hdat->options.large_pages);
+	if (file_cache == NULL) {
+		close_file(fp);
+		(*hdat->log_msg_fn)("Cannot allocate memory for autoload array\n");
+		return(1);
+	}
+	read_file(fp, file_cache, size, get_page_size());
+	close_file(fp);
+
+	/* The subindices are not used until file_cache is set. */
+	stat = init_autoload_subindices(hdat, hdat->cprsubdatabase, f, file_cache, &size);
+	if (stat) {
+		virtual_free(file_cache);
+		return(1);
+	}
+	replicate_file(hdat, f, file_cache, node_cache);
+
+	{ // BEGIN CRITICAL SECTION
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* Release the lru buffers that hold blocks of this file. */
+		for (i = 0; i < hdat->cacheblocks; ++i) {
+			if (hdat->ccbs[i].blocknum != UNDEFINED_BLOCK_ID && hdat->ccbs[i].subdb->file == f) {
+				f->cache_bufferi[hdat->ccbs[i].blocknum] = UNDEFINED_BLOCK_ID;
+				hdat->ccbs[i].blocknum = UNDEFINED_BLOCK_ID;
+			}
+		}
+		/* Store file_cache last, with release, so a lookup that sees it also sees the subindices and replicas. */
+		for (i = 0; i < MAX_NUMA_NODES; ++i)
+			f->node_cache[i].store(node_cache[i], std::memory_order_release);
+		f->file_cache.store(file_cache, std::memory_order_release);
+		f->autoload = 1;
+	} // END CRITICAL SECTION
+
+	std::snprintf(msg, sizeof(msg), "autoload %s\n", f->name);
+	(*hdat->log_msg_fn)(msg);
+	return(0);
+}
+
+
+/*
+ * Remove lru cache buffers in whole groups of CACHE_ALLOC_COUNT, 
+ * so there are at least cacheblocks left.  The most recently used
+ * blocks are kept; those in the groups that are removed are copied
+ * into the ccbs of less recently used blocks.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int shrink_lru_cache(DBHANDLE *hdat, int cacheblocks)
+{
+	int i, k, v;
+	int *order;		/* the kept ccbs in lru order. */
+	char *kept;
+
+	cacheblocks = ROUND_UP(cacheblocks, CACHE_ALLOC_COUNT);
+	if (cacheblocks >= hdat->cacheblocks)
+		return(0);
+
+	order = (int *)std::malloc(cacheblocks * sizeof(order[0]));
+	kept = (char *)std::calloc(hdat->cacheblocks, sizeof(kept[0]));
+	if (!order || !kept) {
+		std::free(order);
+		std::free(kept);
+		(*hdat->log_msg_fn)("Cannot allocate memory to shrink cache\n");
+		return(1);
+	}
+
+	{ // BEGIN CRITICAL SECTION
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* Find the cacheblocks most recently used ccbs. */
+		for (k = cacheblocks - 1, i = hdat->ccbs[hdat->ccbs_top].prev; k >= 0; --k, i = hdat->ccbs[i].prev) {
+			order[k] = i;
+			kept[i] = 1;
+		}
+
+		/* Unhook the blocks that are dropped from the groups being removed. */
+		for (i = cacheblocks; i < hdat->cacheblocks; ++i)
+			if (!kept[i] && hdat->ccbs[i].blocknum != UNDEFINED_BLOCK_ID)
+				hdat->ccbs[i].subdb->file->cache_bufferi[hdat->ccbs[i].blocknum] = UNDEFINED_BLOCK_ID;
+
+		/* Move the kept blocks in the groups being removed into the ccbs
+		 * below cacheblocks that are not kept.  There are the same number of each.
+		 */
+		v = 0;
+		for (k = 0; k < cacheblocks; ++k) {
+			i = order[k];
+			if (i < cacheblocks)
+				continue;
+
+			while (kept[v])
+				++v;
+			if (hdat->ccbs[v].blocknum != UNDEFINED_BLOCK_ID)
+				hdat->ccbs[v].subdb->file->cache_bufferi[hdat->ccbs[v].blocknum] = UNDEFINED_BLOCK_ID;
+			hdat->ccbs[v].blocknum = hdat->ccbs[i].blocknum;
+			hdat->ccbs[v].subdb = hdat->ccbs[i].subdb;
+			std::memcpy(hdat->ccbs[v].subindices, hdat->ccbs[i].subindices, sizeof(hdat->ccbs[v].subindices));
+			std::memcpy(hdat->ccbs[v].data, hdat->ccbs[i].data, CACHE_BLOCKSIZE);
+			if (hdat->ccbs[v].blocknum != UNDEFINED_BLOCK_ID)
+				hdat->ccbs[v].subdb->file->cache_bufferi[hdat->ccbs[v].blocknum] = v;
+			kept[v] = 1;
+			order[k] = v;
+		}
+
+		/* Relink the kept ccbs in lru order. */
+		for (k = 0; k < cacheblocks; ++k) {
+			hdat->ccbs[order[k]].next = order[k < cacheblocks - 1 ? k + 1 : 0];
+			hdat->ccbs[order[k]].prev = order[k > 0 ? k - 1 : cacheblocks - 1];
+		}
+		hdat->ccbs_top = order[0];
+
+		for (i = cacheblocks; i < hdat->cacheblocks; i += CACHE_ALLOC_COUNT)
+			retire_buffer(hdat, hdat->ccbs[i].data, 1);
+		hdat->cacheblocks = cacheblocks;
+	} // END CRITICAL SECTION
+
+	std::free(order);
+	std::free(kept);
+	return(0);
+}
+
+
+/*
+ * Add lru cache buffers so there are cacheblocks of them.  The new buffers 
+ * become the least recently used.  If the last group of buffers is only
+ * partly used, it is replaced by a whole group so that every group still
+ * starts at a multiple of CACHE_ALLOC_COUNT.
+ */
+static int grow_lru_cache(DBHANDLE *hdat, int cacheblocks)
+{
+	int i, j, k, count, first, old;
+	CCB *ccbs, *old_ccbs;
+	unsigned char *blockp;
+
+	old = hdat->cacheblocks;
+	ccbs = (CCB *)std::malloc(cacheblocks * sizeof(CCB));
+	if (!ccbs) {
+		(*hdat->log_msg_fn)("Cannot allocate memory for ccbs\n");
+		return(1);
+	}
+	std::memset(ccbs, 0, cacheblocks * sizeof(CCB));
+
+	first = old - old % CACHE_ALLOC_COUNT;
+	for (i = first; i < cacheblocks; i += CACHE_ALLOC_COUNT) {
+		count = (std::min)(CACHE_ALLOC_COUNT, cacheblocks - i);
+		blockp = (unsigned char *)aligned_large_alloc(count * CACHE_BLOCKSIZE * sizeof(unsigned char), hdat->options.large_pages);
+		if (blockp == NULL) {
+			for (k = first; k < i; k += CACHE_ALLOC_COUNT)
+				virtual_free(ccbs[k].data);
+			std::free(ccbs);
+			(*hdat->log_msg_fn)("aligned_large_alloc failure on cache buffers\n");
+			return(1);
+		}
+		if (hdat->numa_nodes > 1)
+			interleave_memory(blockp, count * CACHE_BLOCKSIZE * sizeof(unsigned char), hdat->node_ids, hdat->numa_nodes);
+		for (j = 0; j < count; ++j)
+			ccbs[i + j].data = blockp + j * CACHE_BLOCKSIZE * sizeof(unsigned char);
+	}
+
+	{ // BEGIN CRITICAL SECTION
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		for (i = 0; i < old; ++i) {
+			blockp = ccbs[i].data;
+			ccbs[i] = hdat->ccbs[i];
+			if (i >= first) {
+				std::memcpy(blockp, hdat->ccbs[i].data, CACHE_BLOCKSIZE);
+				ccbs[i].data = blockp;
 			}
 		}
-	}
+		if (first < old)
+			retire_buffer(hdat, hdat->ccbs[first].data, 1);
+
+		for (i = old; i < cacheblocks; ++i) {
+			ccbs[i].next = i + 1;
+			ccbs[i].prev = i - 1;
+			ccbs[i].blocknum = UNDEFINED_BLOCK_ID;
+		}
+
+		/* Insert the new ccbs at the lru end of the list. */
+		k = ccbs[hdat->ccbs_top].prev;
+		ccbs[k].next = old;
+		ccbs[old].prev = k;
+		ccbs[cacheblocks - 1].next = hdat->ccbs_top;
+		ccbs[hdat->ccbs_top].prev = cacheblocks - 1;
+		hdat->ccbs_top = old;
+
+		old_ccbs = hdat->ccbs;
+		hdat->ccbs = ccbs;
+		hdat->cacheblocks = cacheblocks;
+	} // END CRITICAL SECTION
+
+	std::free(old_ccbs);
 	return(0);
 }
 
@@ -893,18 +2378,15 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 {
 	int i, j, stat;
 	int t0, t1, t2, t3;
-	char dbname[MAXFILENAME];
 	char msg[MAXMSG];
 	int64_t allocated_bytes;		/* keep track of heap allocations in bytes. */
 	int64_t autoload_bytes;			/* keep track of autoload allocations in bytes. */
-	int cache_mb_avail;
 	int max_autoload;
-	int64_t total_dbsize;
 	size_t size;
 	int count;
+	char autoload[MAXFILES];
 	DBFILE *f;
 	CPRSUBDB *subdb;
-	unsigned char *blockp;		/* Base address of an allocate group of cache buffers. */
 
 	t0 = std::clock();
 
@@ -920,6 +2402,8 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	hdat->log_msg_fn = msg_fn;
 	allocated_bytes = 0;
 	autoload_bytes = 0;
+	if (init_numa(hdat))
+		return(1);
 
 	std::sprintf(msg, "Available RAM: %dmb\n", get_mem_available_mb());
 	(*hdat->log_msg_fn)(msg);
@@ -927,15 +2411,11 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	//init_lock(egdb_lock);
 	init_bitcount();
 
-	/* initialize binomial coefficients. */
-	initbicoef();
-
-	/* initialize runlength and lookup array. */
-	init_compression_tables();
-	init_virtual_to_real();
+	/* initialize the runlengths and run ends of the decompression catalogs. */
+	std::call_once(decompress_tables_once, init_decompress_tables_v2);
 
-	/* initialize man index base table. */
-	build_man_index_base();
+	/* select the indexing functions. */
+	init_indexing();
 
 	/* Allocate the cprsubdatabase array. */
 	hdat->cprsubdatabase = (DBP *)std::calloc(DBSIZE, sizeof(DBP));
@@ -946,7 +2426,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	allocated_bytes += DBSIZE * sizeof(DBP);
 
 	/* Build table of db filenames. */
-	build_file_table(hdat);
+	build_file_table(hdat, pieces);
 
 	/* Parse index files. */
 	for (i = 0; i < hdat->numdbfiles; ++i) {
@@ -955,7 +2435,7 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		if (hdat->dbfiles[i].pieces > pieces)
 			break;
 
-		stat = parseindexfile(hdat, hdat->dbfiles + i, &allocated_bytes);
+		stat = parseindexfile(hdat, hdat->cprsubdatabase, hdat->dbfiles + i, &allocated_bytes);
 
 		/* Check for errors from parseindexfile. */
 		if (stat)
@@ -967,44 +2447,13 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	std::sprintf(msg, "Reading index files took %.0f secs\n", tdiff_secs(t1, t0));
 	(*hdat->log_msg_fn)(msg);
 
-	/* Find the total size of all the files that will be used. */
-	total_dbsize = 0;
-	for (i = 0; i < hdat->numdbfiles; ++i) {
-		if (hdat->dbfiles[i].is_present)
-			total_dbsize += (int64_t)hdat->dbfiles[i].num_cacheblocks * CACHE_BLOCKSIZE;
-	}
-
-#define MIN_AUTOLOAD_RATIO .18
-#define MAX_AUTOLOAD_RATIO .35
-
-	/* Calculate how much cache mb to autoload. */
-	cache_mb_avail = (int)(cache_mb - allocated_bytes / ONE_MB);
-	if (total_dbsize / ONE_MB - cache_mb_avail < 20)
-		max_autoload = 1 + (int)(total_dbsize / ONE_MB);		/* Autoload everything. */
-	else if (cache_mb_avail < 15) {
-		cache_mb_avail = 15;
-		max_autoload = (int)(cache_mb_avail * MIN_AUTOLOAD_RATIO);
-	}
-	else if (cache_mb_avail > 1000)
-		max_autoload = (int)(cache_mb_avail * MAX_AUTOLOAD_RATIO);
-	else
-		max_autoload = (int)((float)cache_mb_avail * (float)(MIN_AUTOLOAD_RATIO + cache_mb_avail * (MAX_AUTOLOAD_RATIO - MIN_AUTOLOAD_RATIO) / 1000.0));
-
-	/* Select the files that will be autoloaded.  Autoload files with the least number of kings first,
-	 * and use number of pieces as a second criterea.
-	 * First force autoload everything up to 5 pieces;
-	 */
+	/* Select the files that will be autoloaded. */
+	max_autoload = get_max_autoload(hdat, (int)(cache_mb - allocated_bytes / ONE_MB));
 	build_autoload_list(hdat);
-
-	size = 0;
-
+	choose_autoload_files(hdat, max_autoload, autoload);
 	for (i = 0; i < hdat->numdbfiles; ++i) {
 		f = hdat->files_autoload_order[i];
-		if (!f || !f->is_present || f->autoload)
-			continue;
-
-		size += f->num_cacheblocks;
-		if (f->pieces <= MIN_AUTOLOAD_PIECES || (int)((int64_t)((int64_t)size * (int64_t)CACHE_BLOCKSIZE) / ONE_MB) <= max_autoload) {
+		if (f && autoload[f - hdat->dbfiles]) {
 			f->autoload = 1;
 			std::sprintf(msg, "autoload %s\n", f->name);
 			(*hdat->log_msg_fn)(msg);
@@ -1021,63 +2470,11 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 		if (!hdat->dbfiles[i].is_present)
 			continue;
 
-		std::sprintf(dbname, "%s%s.cpr1", hdat->db_filepath, hdat->dbfiles[i].name);
-		hdat->dbfiles[i].fp = open_file(dbname);
-		if (hdat->dbfiles[i].fp == NULLPTR) {
-			std::sprintf(msg, "Cannot open %s\n", dbname);
-			(*hdat->log_msg_fn)(msg);
+		stat = open_dbfile(hdat, hdat->cprsubdatabase, hdat->dbfiles + i, &allocated_bytes, &autoload_bytes);
+		if (stat)
 			return(1);
-		}
-
-		/* Allocate buffers and read files for autoloaded dbs. */
-		if (hdat->dbfiles[i].autoload) {
-			size = hdat->dbfiles[i].num_cacheblocks * (size_t)CACHE_BLOCKSIZE;
-			hdat->dbfiles[i].file_cache = (unsigned char *)aligned_large_alloc(size);
-			allocated_bytes += size;
-			autoload_bytes += size;
-			if (hdat->dbfiles[i].file_cache == NULL) {
-				(*hdat->log_msg_fn)("Cannot allocate memory for autoload array\n");
-				return(1);
-			}
-
-			/* Seek to the beginning of the file. */
-			if (set_file_pointer(hdat->dbfiles[i].fp, 0)) {
-				(*hdat->log_msg_fn)("autoload seek failed\n");
-				return(-1);
-			}
-
-			read_file(hdat->dbfiles[i].fp, hdat->dbfiles[i].file_cache, size, get_page_size());
-
-			/* Close the db file, we are done with it. */
-			close_file(hdat->dbfiles[i].fp);
-			hdat->dbfiles[i].fp = NULLPTR;
-
-			/* Allocate the subindices. */
-			stat = init_autoload_subindices(hdat, hdat->dbfiles + i, &size);
-			if (stat)
-				return(1);
-
-			allocated_bytes += size;
-			autoload_bytes += size;
-		}
-		else {
-			/* These slices are not autoloaded.
-			 * Allocate the array of indices into ccbs[].
-			 * Each array entry is either an index into ccbs or -1 if that cache block is not loaded.
-			 */
-			size = hdat->dbfiles[i].num_cacheblocks * sizeof(hdat->dbfiles[i].cache_bufferi[0]);
-			hdat->dbfiles[i].cache_bufferi = (int *)std::malloc(size);
-			allocated_bytes += size;
-			if (hdat->dbfiles[i].cache_bufferi == NULL) {
-				(*hdat->log_msg_fn)("Cannot allocate memory for cache_bufferi array\n");
-				return(-1);
-			}
-
-			/* Init these buffer indices to UNDEFINED_BLOCK_ID, means that cache block is not loaded. */
-			for (j = 0; j < hdat->dbfiles[i].num_cacheblocks; ++j)
-				hdat->dbfiles[i].cache_bufferi[j] = UNDEFINED_BLOCK_ID;
-		}
 	}
+	hdat->index_bytes = allocated_bytes - autoload_bytes;
 	std::sprintf(msg, "Allocated %dkb for indexing\n", (int)((allocated_bytes - autoload_bytes) / 1024));
 	(*hdat->log_msg_fn)(msg);
 	std::sprintf(msg, "Allocated %dkb for permanent slice caches\n", (int)(autoload_bytes / 1024));
@@ -1108,46 +2505,8 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 			hdat->cacheblocks = (std::min)(hdat->cacheblocks, i);
 		}
 
-		/* Allocate the CCB array. */
-		size = hdat->cacheblocks * sizeof(CCB);
-		hdat->ccbs = (CCB *)std::malloc(size);
-		if (!hdat->ccbs) {
-			(*hdat->log_msg_fn)("Cannot allocate memory for ccbs\n");
+		if (alloc_lru_cache(hdat))
 			return(1);
-		}
-
-		std::memset(hdat->ccbs, 0, size);
-
-		/* Init the lru list. */
-		for (i = 0; i < hdat->cacheblocks; ++i) {
-			hdat->ccbs[i].next = i + 1;
-			hdat->ccbs[i].prev = i - 1;
-			hdat->ccbs[i].blocknum = UNDEFINED_BLOCK_ID;
-		}
-		hdat->ccbs[hdat->cacheblocks - 1].next = 0;
-		hdat->ccbs[0].prev = hdat->cacheblocks - 1;
-		hdat->ccbs_top = 0;
-
-		if (hdat->cacheblocks > 0) {
-			std::sprintf(msg, "Allocating %d cache buffers of size %d\n",
-						hdat->cacheblocks, CACHE_BLOCKSIZE);
-			(*hdat->log_msg_fn)(msg);
-		}
-
-		/* Allocate the cache buffers in groups of CACHE_ALLOC_COUNT at a time. */
-		for (i = 0; i < hdat->cacheblocks; i += CACHE_ALLOC_COUNT) {
-			count = (std::min)(CACHE_ALLOC_COUNT, hdat->cacheblocks - i);
-			size = count * CACHE_BLOCKSIZE * sizeof(unsigned char);
-			blockp = (unsigned char *)aligned_large_alloc(size);
-			if (blockp == NULL) {
-				(*hdat->log_msg_fn)("aligned_large_alloc failure on cache buffers\n");
-				return(-1);
-			}
-
-			/* Assign the ccb data pointers. */
-			for (j = 0; j < count; ++j)
-				hdat->ccbs[i + j].data = blockp + j * CACHE_BLOCKSIZE * sizeof(unsigned char);
-		}
 
 		/* Preload the cache blocks with data.
 		 * First do the slices from the preload table.
@@ -1187,6 +2546,9 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 	else
 		hdat->cacheblocks = 0;
 
+	if (alloc_decoded_cache(hdat, hdat->options.decoded_cache_mb))
+		return(1);
+
 	std::sprintf(msg, "Available RAM: %dmb\n", get_mem_available_mb());
 	(*hdat->log_msg_fn)(msg);
 
@@ -1195,10 +2557,11 @@ static int initdblookup(DBHANDLE *hdat, int pieces, int cache_mb, char const *fi
 
 
 /*
- * Parse an index file and write all information in cprsubdatabase[].
+ * Parse an index file and write all information in dbtable[], which is
+ * either cprsubdatabase[] or a staging table that is published later.
  * A nonzero return value means some kind of error occurred.
  */
-static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
+static int parseindexfile(DBHANDLE *hdat, DBP *dbtable, DBFILE *f, int64_t *allocated_bytes)
 {
 	int stat0, stat;
 	char name[MAXFILENAME];
@@ -1284,7 +2647,7 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 			color = EGDB_WHITE;
 
 		/* Get the subdb node. */
-		dbp = hdat->cprsubdatabase + DBOFFSET(bm, bk, wm, wk, color);
+		dbp = dbtable + DBOFFSET(bm, bk, wm, wk, color);
 
 		/* If we have not allocated a subslice table for this subdb, then
 		 * do it now.
@@ -1456,7 +2819,7 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 	std::fclose(fp);
 
 	if (prev) {
-		prev->last_subidx_block = (unsigned char)(((LOWORD32(filesize) - 1) % IDX_BLOCKSIZE) / SUBINDEX_BLOCKSIZE);
+		prev->last_subidx_block = (unsigned short)(((LOWORD32(filesize) - 1) % IDX_BLOCKSIZE) / SUBINDEX_BLOCKSIZE);
 	
 		/* Check the total number of index blocks in this database. */
 		if (f->num_cacheblocks != count + prev->first_idx_block) {
@@ -1473,9 +2836,11 @@ static int parseindexfile(DBHANDLE *hdat, DBFILE *f, int64_t *allocated_bytes)
 
 
 /*
- * Build the table of db filenames.
+ * Build the table of db filenames for up to pieces pieces.
+ * Entries below hdat->numdbfiles are already in the table and are left
+ * alone, so this can also append the files for a larger pieces count.
  */
-static void build_file_table(DBHANDLE *hdat)
+static void build_file_table(DBHANDLE *hdat, int pieces)
 {
 	int count;
 	int npieces;
@@ -1485,13 +2850,15 @@ static void build_file_table(DBHANDLE *hdat)
 	count = 0;
 	for (npieces = 2; npieces <= MAXPIECES; ++npieces) {
 		if (npieces <= SAME_PIECES_ONE_FILE) {
-			std::sprintf(hdat->dbfiles[count].name, "db%d", npieces);
-			hdat->dbfiles[count].pieces = npieces;
-			hdat->dbfiles[count].max_pieces_1side = (std::min)(npieces - 1, MAXPIECE);
+			if (count >= hdat->numdbfiles) {
+				std::sprintf(hdat->dbfiles[count].name, "db%d", npieces);
+				hdat->dbfiles[count].pieces = npieces;
+				hdat->dbfiles[count].max_pieces_1side = (std::min)(npieces - 1, MAXPIECE);
+			}
 			++count;
 		}
 		else {
-			if (npieces > hdat->dbpieces)
+			if (npieces > pieces)
 				continue;
 			for (nb = 1; nb < npieces; ++nb) {
 				if (nb > MAXPIECE)
@@ -1506,9 +2873,11 @@ static void build_file_table(DBHANDLE *hdat)
 						if (nbm + nbk == nwm + nwk && nwk > nbk)
 							continue;
 
-						std::sprintf(hdat->dbfiles[count].name, "db%d-%d%d%d%d", npieces, nbm, nbk, nwm, nwk);
-						hdat->dbfiles[count].pieces = npieces;
-						hdat->dbfiles[count].max_pieces_1side = nbm + nbk;
+						if (count >= hdat->numdbfiles) {
+							std::sprintf(hdat->dbfiles[count].name, "db%d-%d%d%d%d", npieces, nbm, nbk, nwm, nwk);
+							hdat->dbfiles[count].pieces = npieces;
+							hdat->dbfiles[count].max_pieces_1side = nbm + nbk;
+						}
 						++count;
 					}
 				}
@@ -1561,7 +2930,7 @@ static void build_autoload_list(DBHANDLE *hdat)
 							continue;
 					}
 
-					f = dbp->subdb->file;
+					f = dbp->subdb.load(std::memory_order_relaxed)->file;
 					if (!f->is_present)
 						continue;
 
@@ -1600,15 +2969,16 @@ static int egdb_close(EGDB_DRIVER *handle)
 		if (!hdat->dbfiles[i].is_present)
 			continue;
 
+		free_replicas(hdat->dbfiles + i);
 		if (hdat->dbfiles[i].file_cache) {
 			virtual_free(hdat->dbfiles[i].file_cache);
 			hdat->dbfiles[i].file_cache = 0;
 		}
-		else {
-			if (hdat->dbfiles[i].cache_bufferi) {
-				std::free(hdat->dbfiles[i].cache_bufferi);
-				hdat->dbfiles[i].cache_bufferi = 0;
-			}
+
+		/* A file that was promoted to autoload by egdb_set_cache_mb() keeps its cache_bufferi. */
+		if (hdat->dbfiles[i].cache_bufferi) {
+			std::free(hdat->dbfiles[i].cache_bufferi);
+			hdat->dbfiles[i].cache_bufferi = 0;
 		}
 
 		if (hdat->dbfiles[i].fp != NULLPTR)
@@ -1617,7 +2987,7 @@ static int egdb_close(EGDB_DRIVER *handle)
 		hdat->dbfiles[i].num_cacheblocks = 0;
 		hdat->dbfiles[i].fp = NULLPTR;
 	}
-	std::memset(hdat->dbfiles, 0, sizeof(hdat->dbfiles));
+	std::memset((void *)hdat->dbfiles, 0, sizeof(hdat->dbfiles));
 
 	for (i = 0; i < DBSIZE; ++i) {
 		p = hdat->cprsubdatabase + i;
@@ -1636,12 +3006,332 @@ static int egdb_close(EGDB_DRIVER *handle)
 		}
 	}
 	std::free(hdat->cprsubdatabase);
+	std::free(hdat->cpu_node);
+	std::free(hdat->decoded);
+	std::free(hdat->decode_misses);
+	if (hdat->decoded_buffers)
+		virtual_free(hdat->decoded_buffers);
+	free_retired_buffers(hdat);
 	std::free(hdat);
 	std::free(handle);
 	return(0);
 }
 
 
+/*
+ * Free the subdbs in a staging table, and undo the file table entries of 
+ * an extension that could not be completed.
+ */
+static void discard_extension(DBHANDLE *hdat, DBP *staging, int old_numdbfiles)
+{
+	int i, k;
+	DBFILE *f;
+	DBP *p;
+
+	for (i = 0; i < DBSIZE; ++i) {
+		p = staging + i;
+		if (p->subdb != NULL) {
+			for (k = 0; k < p->num_subslices; ++k) {
+				if (p->subdb[k].indices)
+					std::free(p->subdb[k].indices);
+				if (p->subdb[k].vmap)
+					std::free(p->subdb[k].vmap);
+				if (p->subdb[k].catalogidx)
+					std::free(p->subdb[k].catalogidx);
+				if (p->subdb[k].autoload_subindices)
+					std::free(p->subdb[k].autoload_subindices);
+			}
+			std::free(p->subdb);
+		}
+	}
+	std::free(staging);
+
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->dbfiles + i;
+		if (f->pieces <= hdat->dbpieces)
+			continue;
+
+		free_replicas(f);
+		if (f->file_cache)
+			virtual_free(f->file_cache);
+		if (f->cache_bufferi)
+			std::free(f->cache_bufferi);
+		if (f->fp != NULLPTR)
+			close_file(f->fp);
+		f->is_present = 0;
+		f->autoload = 0;
+		f->num_cacheblocks = 0;
+		f->file_cache = 0;
+		f->cache_bufferi = 0;
+		f->fp = NULLPTR;
+	}
+	std::memset((void *)(hdat->dbfiles + old_numdbfiles), 0, (hdat->numdbfiles - old_numdbfiles) * sizeof(hdat->dbfiles[0]));
+	hdat->numdbfiles = old_numdbfiles;
+}
+
+
+/*
+ * Attach the db files for more pieces to an open driver.
+ * The new index files are parsed into a staging table while lookups continue
+ * to use the current configuration.  When everything is ready the new
+ * subdbs are published into cprsubdatabase[] while holding egdb_lock.  
+ * Files for the new pieces are autoloaded only if they are in the forced
+ * autoload range, others share the existing lru cache.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int extend_dblookup(EGDB_DRIVER *handle, int pieces)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int i, stat, needed;
+	int old_numdbfiles;
+	int64_t allocated_bytes, autoload_bytes;
+	char msg[MAXMSG];
+	DBFILE *f;
+	DBP *staging;
+	std::lock_guard<std::mutex> resize_guard(resize_lock);
+
+	pieces = (std::min)(pieces, MAXPIECES);
+	if (pieces <= hdat->dbpieces)
+		return(0);
+
+	staging = (DBP *)std::calloc(DBSIZE, sizeof(DBP));
+	if (!staging) {
+		(*hdat->log_msg_fn)("Out of memory allocating cprsubdatabase.\n");
+		return(1);
+	}
+
+	/* Append the new files to the table of db filenames. */
+	old_numdbfiles = hdat->numdbfiles;
+	build_file_table(hdat, pieces);
+
+	/* Parse the index files that were not used before. */
+	allocated_bytes = 0;
+	autoload_bytes = 0;
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->dbfiles + i;
+		if (f->pieces <= hdat->dbpieces)
+			continue;
+		if (f->pieces > pieces)
+			break;
+
+		stat = parseindexfile(hdat, staging, f, &allocated_bytes);
+		if (stat) {
+			discard_extension(hdat, staging, old_numdbfiles);
+			return(1);
+		}
+		if (f->is_present && f->pieces <= MIN_AUTOLOAD_PIECES) {
+			f->autoload = 1;
+			std::sprintf(msg, "autoload %s\n", f->name);
+			(*hdat->log_msg_fn)(msg);
+		}
+	}
+
+	/* Open the new files. */
+	needed = 0;
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->dbfiles + i;
+		if (f->pieces <= hdat->dbpieces || !f->is_present)
+			continue;
+
+		stat = open_dbfile(hdat, staging, f, &allocated_bytes, &autoload_bytes);
+		if (stat) {
+			discard_extension(hdat, staging, old_numdbfiles);
+			return(1);
+		}
+		if (!f->autoload)
+			needed += f->num_cacheblocks;
+	}
+
+	/* If everything was autoloaded before there is no lru cache yet. 
+	 * No lookups can reach the ccbs until the new subdbs are published.
+	 */
+	if (needed && hdat->cacheblocks == 0) {
+		hdat->cacheblocks = (std::min)(MIN_CACHE_BUF_BYTES / CACHE_BLOCKSIZE, needed);
+		if (alloc_lru_cache(hdat)) {
+			discard_extension(hdat, staging, old_numdbfiles);
+			return(1);
+		}
+	}
+
+	std::sprintf(msg, "Allocated %dkb for indexing\n", (int)((allocated_bytes - autoload_bytes) / 1024));
+	(*hdat->log_msg_fn)(msg);
+	std::sprintf(msg, "Allocated %dkb for permanent slice caches\n", (int)(autoload_bytes / 1024));
+	(*hdat->log_msg_fn)(msg);
+
+	{ // BEGIN CRITICAL SECTION
+		std::lock_guard<LOCK_TYPE> guard(egdb_lock);
+
+		/* Publish the new subdbs.  The subdb arrays are moved, not copied, so
+		 * the linked lists built by parseindexfile() stay valid.  The subdb
+		 * pointer is stored with release after the entries are complete, and 
+		 * lookups that do not take the lock load it with acquire, so they see
+		 * either NULL or a usable table.
+		 */
+		for (i = 0; i < DBSIZE; ++i) {
+			if (staging[i].subdb.load(std::memory_order_relaxed)) {
+				hdat->cprsubdatabase[i].num_subslices = staging[i].num_subslices;
+				hdat->cprsubdatabase[i].subdb.store(staging[i].subdb.load(std::memory_order_relaxed), std::memory_order_release);
+			}
+		}
+		hdat->dbpieces.store(pieces, std::memory_order_release);
+	} // END CRITICAL SECTION
+
+	hdat->index_bytes += allocated_bytes - autoload_bytes;
+
+	std::free(staging);
+	build_autoload_list(hdat);
+	return(0);
+}
+
+
+/*
+ * Change the amount of ram used by the driver to cache_mb.
+ * Files are demoted from autoload and lru cache buffers are removed before
+ * anything new is allocated, so the old and new sizes are not needed at the same time.
+ * Lookups continue while this runs.  Buffers that they may still be reading are
+ * freed once the lookups that started before them have finished.  If the call fails
+ * they are freed by the next call, or when the driver is closed.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int set_cache_mb(EGDB_DRIVER *handle, int cache_mb)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int i, stat, needed, cacheblocks;
+	int64_t autoload_bytes;
+	char autoload[MAXFILES];
+	char msg[MAXMSG];
+	DBFILE *f;
+	std::lock_guard<std::mutex> resize_guard(resize_lock);
+
+	free_retired_buffers(hdat);
+
+	/* Choose the autoloaded files and number of lru cache buffers the same way as initdblookup(). */
+	choose_autoload_files(hdat, get_max_autoload(hdat, (int)(cache_mb - hdat->index_bytes / ONE_MB)), autoload);
+	autoload_bytes = 0;
+	needed = 0;
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->dbfiles + i;
+		if (!f->is_present || f->pieces > hdat->dbpieces)
+			continue;
+		if (autoload[i])
+			autoload_bytes += (int64_t)f->num_cacheblocks * (CACHE_BLOCKSIZE + NUM_SUBINDICES * sizeof(INDEX));
+		else
+			needed += f->num_cacheblocks;
+	}
+
+	if (needed == 0)
+		cacheblocks = 0;
+	else if ((hdat->index_bytes + autoload_bytes + MIN_CACHE_BUF_BYTES) / ONE_MB >= cache_mb)
+		cacheblocks = (std::min)(MIN_CACHE_BUF_BYTES / CACHE_BLOCKSIZE, needed);
+	else {
+		cacheblocks = (int)(((int64_t)cache_mb * (int64_t)ONE_MB - hdat->index_bytes - autoload_bytes) / 
+					(int64_t)(CACHE_BLOCKSIZE + sizeof(CCB)));
+		cacheblocks = (std::min)(cacheblocks, needed);
+	}
+
+	/* Once there are lru cache buffers keep at least one group of them, because
+	 * a lookup that started before a file was promoted can still use them.
+	 */
+	if (hdat->cacheblocks > 0)
+		cacheblocks = (std::max)(cacheblocks, (std::min)(CACHE_ALLOC_COUNT, hdat->cacheblocks));
+
+	/* If everything was autoloaded there are no ccbs yet, and no lookups can use them until a file is demoted. */
+	if (hdat->cacheblocks == 0 && cacheblocks > 0) {
+		hdat->cacheblocks = cacheblocks;
+		if (alloc_lru_cache(hdat))
+			return(1);
+	}
+
+	/* Release memory first. */
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->dbfiles + i;
+		if (f->file_cache && !autoload[i]) {
+			stat = demote_file(hdat, f);
+			if (stat)
+				return(1);
+		}
+	}
+	if (cacheblocks < hdat->cacheblocks) {
+		stat = shrink_lru_cache(hdat, cacheblocks);
+		if (stat)
+			return(1);
+	}
+	free_retired_buffers(hdat);
+
+	/* Now allocate. */
+	for (i = 0; i < hdat->numdbfiles; ++i) {
+		f = hdat->dbfiles + i;
+		if (f->is_present && f->pieces <= hdat->dbpieces && !f->file_cache && autoload[i]) {
+			stat = promote_file(hdat, f);
+			if (stat)
+				return(1);
+		}
+	}
+	if (cacheblocks > hdat->cacheblocks) {
+		stat = grow_lru_cache(hdat, cacheblocks);
+		if (stat)
+			return(1);
+	}
+	free_retired_buffers(hdat);
+
+	std::sprintf(msg, "Using %d cache buffers of size %d\n", hdat->cacheblocks, CACHE_BLOCKSIZE);
+	(*hdat->log_msg_fn)(msg);
+	return(0);
+}
+
+
+/*
+ * Release at least mb of cache memory because the system is short of memory.
+ * The least recently used lru cache blocks go first, down to one group of
+ * buffers, then autoloaded files, starting with the last ones in the autoload
+ * order.  The files for up to MIN_AUTOLOAD_PIECES pieces are kept.
+ * The memory is returned to the os once the lookups that were reading it have
+ * finished.  Use egdb_set_cache_mb() to grow the cache again.
+ * A nonzero return value means some kind of error occurred.
+ */
+static int shed_cache(EGDB_DRIVER *handle, int mb)
+{
+	DBHANDLE *hdat = (DBHANDLE *)handle->internal_data;
+	int i, stat, cacheblocks;
+	int64_t bytes, released;
+	char msg[MAXMSG];
+	DBFILE *f;
+	std::lock_guard<std::mutex> resize_guard(resize_lock);
+
+	free_retired_buffers(hdat);
+
+	bytes = (int64_t)mb * ONE_MB;
+	released = 0;
+	if (hdat->cacheblocks > CACHE_ALLOC_COUNT) {
+		cacheblocks = hdat->cacheblocks - (int)(bytes / CACHE_BLOCKSIZE);
+		cacheblocks = (std::max)(CACHE_ALLOC_COUNT, (cacheblocks / CACHE_ALLOC_COUNT) * CACHE_ALLOC_COUNT);
+		if (cacheblocks < hdat->cacheblocks) {
+			released = (int64_t)(hdat->cacheblocks - cacheblocks) * CACHE_BLOCKSIZE;
+			stat = shrink_lru_cache(hdat, cacheblocks);
+			if (stat)
+				return(1);
+		}
+	}
+
+	/* Demoted files need the lru cache.  Don't allocate one when memory is short. */
+	for (i = hdat->numdbfiles - 1; i >= 0 && released < bytes && hdat->cacheblocks > 0; --i) {
+		f = hdat->files_autoload_order[i];
+		if (!f || !f->file_cache || f->pieces <= MIN_AUTOLOAD_PIECES)
+			continue;
+
+		stat = demote_file(hdat, f);
+		if (stat)
+			return(1);
+		released += (int64_t)f->num_cacheblocks * CACHE_BLOCKSIZE;
+	}
+	free_retired_buffers(hdat);
+
+	std::sprintf(msg, "Released %dmb of cache memory\n", (int)(released / ONE_MB));
+	(*hdat->log_msg_fn)(msg);
+	return(0);
+}
+
+
 static int verify_crc(EGDB_DRIVER const *handle, void (*msg_fn)(char const*), int *abort, EGDB_VERIFY_MSGS *msgs)
 {
 	int i;
@@ -1756,7 +3446,8 @@ static EGDB_TYPE get_type(EGDB_DRIVER const *handle)
 
 }	// namespace detail
 
-EGDB_DRIVER *egdb_open_wld_tun_v2(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type)
+EGDB_DRIVER *egdb_open_wld_tun_v2(int pieces, int cache_mb, char const *directory, void (*msg_fn)(char const*), EGDB_TYPE db_type,
+								OPEN_OPTIONS const *options)
 {
 	int status;
 	EGDB_DRIVER *handle;
@@ -1773,6 +3464,7 @@ EGDB_DRIVER *egdb_open_wld_tun_v2(int pieces, int cache_mb, char const *director
 		return(0);
 	}
 	((DBHANDLE *)(handle->internal_data))->db_type = db_type;
+	((DBHANDLE *)(handle->internal_data))->options = *options;
 	status = initdblookup((DBHANDLE *)handle->internal_data, pieces, cache_mb, directory, msg_fn);
 	if (status) {
 		egdb_close(handle);
@@ -1787,6 +3479,11 @@ EGDB_DRIVER *egdb_open_wld_tun_v2(int pieces, int cache_mb, char const *director
 	handle->close = detail::egdb_close;
 	handle->get_pieces = detail::get_pieces;
 	handle->get_type = detail::get_type;
+	handle->extend = detail::extend_dblookup;
+	handle->set_cache_mb = detail::set_cache_mb;
+	handle->shed_cache = detail::shed_cache;
+	handle->scan_slice = scan_slice;
+	handle->lookup_batch = dblookup_batch;
 	return(handle);
 }
 
@@ -33,9 +33,17 @@
 	inline
 	int get_mem_available_mb(void)
 	{
-		MEMORYSTATUS memstat;
-		GlobalMemoryStatus(&memstat);
-		return((int)(memstat.dwAvailPhys / (1024 * 1024)));
+		MEMORYSTATUSEX memstat;
+		memstat.dwLength = sizeof(memstat);
+		GlobalMemoryStatusEx(&memstat);
+		return((int)(memstat.ullAvailPhys / (1024 * 1024)));
+	}
+
+	/* There are no cgroups on Windows. */
+	inline
+	int get_cgroup_mem_available_mb(void)
+	{
+		return(-1);
 	}
 
 	inline
@@ -46,11 +54,62 @@
 		return((cpuinfo[2] >> 23) & 1);
 	}
 
+	/* The os must also save the ymm registers, which is the osxsave bit and xcr0 bits 1 and 2. */
+	inline
+	bool check_cpu_has_avx2()
+	{
+		int cpuinfo[4] = { -1 };
+		__cpuid(cpuinfo, 1);
+		if (!((cpuinfo[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6)
+			return(false);
+		__cpuidex(cpuinfo, 7, 0);
+		return((cpuinfo[1] >> 5) & 1);
+	}
+
+	/* Code compiled for bmi2 may also use bmi1 and popcnt. */
+	inline
+	bool check_cpu_has_bmi2()
+	{
+		int cpuinfo[4] = { -1 };
+		if (!check_cpu_has_popcount())
+			return(false);
+		__cpuidex(cpuinfo, 7, 0);
+		return(((cpuinfo[1] >> 3) & 1) && ((cpuinfo[1] >> 8) & 1));
+	}
+
+	/* pext is microcoded on amd and hygon cpus before family 0x19 (zen 3), where it 
+	 * is much slower than the popcnt code.  The vendor is checked by the first 4 
+	 * letters of "AuthenticAMD" and "HygonGenuine" in ebx.
+	 */
+	inline
+	bool check_cpu_has_fast_pext()
+	{
+		int family;
+		int cpuinfo[4] = { -1 };
+
+		if (!check_cpu_has_bmi2())
+			return(false);
+		__cpuid(cpuinfo, 0);
+		if (cpuinfo[1] != 0x68747541 && cpuinfo[1] != 0x6f677948)
+			return(true);
+		__cpuid(cpuinfo, 1);
+		family = (cpuinfo[0] >> 8) & 0xf;
+		if (family == 0xf)
+			family += (cpuinfo[0] >> 20) & 0xff;
+		return(family >= 0x19);
+	}
+
 	}	// namespace
 
 #else
 
+	#include <cstdio>
+	#include <cstring>
+	#include <stdint.h>
 	#include <unistd.h>
+	#if defined(__x86_64__) || defined(__i386__)
+		#include <cpuid.h>
+	#endif
 
 	namespace egdb_interface {
 
@@ -68,10 +127,138 @@
 		return sysconf(_SC_PAGESIZE);
 	}
 
+	/* Read the first number in a file, return -1 if there isn't one. */
+	inline
+	int64_t read_file_int64(char const *name)
+	{
+		long long value;
+		std::FILE *fp = std::fopen(name, "r");
+		if (!fp)
+			return(-1);
+		if (std::fscanf(fp, "%lld", &value) != 1)
+			value = -1;
+		std::fclose(fp);
+		return(value);
+	}
+
+	/* Use MemAvailable from /proc/meminfo, which includes the reclaimable page cache.
+	 * Fall back to total physical memory on kernels that don't have it.
+	 */
 	inline
 	int get_mem_available_mb(void)
 	{
-		return (int)(sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / (1024 * 1024));
+		char line[128];
+		long long kb;
+		std::FILE *fp = std::fopen("/proc/meminfo", "r");
+
+		if (fp) {
+			while (std::fgets(line, sizeof(line), fp)) {
+				if (std::sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+					std::fclose(fp);
+					return((int)(kb / 1024));
+				}
+			}
+			std::fclose(fp);
+		}
+		return (int)((int64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / (1024 * 1024));
+	}
+
+	/* Get the path of this process's cgroup from /proc/self/cgroup.  The cgroup v2 
+	 * line is "0::path"; for v1 it is the line whose controllers include "memory".
+	 * Returns false if there is no such line.
+	 */
+	inline
+	bool get_cgroup_path(bool v2, char *path, size_t size)
+	{
+		char line[MAXFILENAME + 64];
+		char *controllers, *name, *tok;
+		bool found;
+		std::FILE *fp = std::fopen("/proc/self/cgroup", "r");
+
+		if (!fp)
+			return(false);
+		found = false;
+		while (!found && std::fgets(line, sizeof(line), fp)) {
+			line[std::strcspn(line, "\n")] = 0;
+			controllers = std::strchr(line, ':');
+			if (!controllers)
+				continue;
+			*controllers++ = 0;
+			name = std::strchr(controllers, ':');
+			if (!name)
+				continue;
+			*name++ = 0;
+			if (v2)
+				found = std::strcmp(line, "0") == 0 && *controllers == 0;
+			else {
+				for (tok = std::strtok(controllers, ","); tok && !found; tok = std::strtok(0, ","))
+					found = std::strcmp(tok, "memory") == 0;
+			}
+			if (found)
+				std::snprintf(path, size, "%s", name);
+		}
+		std::fclose(fp);
+		return(found);
+	}
+
+	/* Return the least memory left under the limits of the cgroup at path below mount
+	 * and of its ancestors, in bytes, or -1 if none of them has a limit.  Without a
+	 * cgroup namespace, as in some containers, only the ancestors may be visible
+	 * under mount; the others are skipped.
+	 */
+	inline
+	int64_t get_cgroup_mem_left(char const *mount, char const *path, char const *limit_file, char const *usage_file)
+	{
+		char dir[MAXFILENAME];
+		char name[2 * MAXFILENAME];
+		char *slash;
+		int64_t limit, usage, left;
+
+		left = -1;
+		std::snprintf(dir, sizeof(dir), "%s", path);
+		for (;;) {
+			std::snprintf(name, sizeof(name), "%s%s/%s", mount, dir, limit_file);
+			limit = read_file_int64(name);		/* v2 "max" reads as -1 */
+
+			/* v1 reports an unlimited group as a huge number. */
+			if (limit > 0 && limit < ((int64_t)1 << 60)) {
+				std::snprintf(name, sizeof(name), "%s%s/%s", mount, dir, usage_file);
+				usage = read_file_int64(name);
+				if (usage < 0)
+					usage = 0;
+				if (usage > limit)
+					usage = limit;
+				if (left < 0 || limit - usage < left)
+					left = limit - usage;
+			}
+			slash = std::strrchr(dir, '/');
+			if (!slash)
+				break;
+			*slash = 0;
+		}
+		return(left);
+	}
+
+	/* Return the memory left under the cgroup limits of this process, 
+	 * or -1 if there is no limit.  Try cgroup v2 first, then v1.
+	 */
+	inline
+	int get_cgroup_mem_available_mb(void)
+	{
+		char path[MAXFILENAME];
+		int64_t left;
+
+		if (!get_cgroup_path(true, path, sizeof(path)))
+			path[0] = 0;
+		left = get_cgroup_mem_left("/sys/fs/cgroup", path, "memory.max", "memory.current");
+		if (left < 0) {
+			if (!get_cgroup_path(false, path, sizeof(path)))
+				path[0] = 0;
+			left = get_cgroup_mem_left("/sys/fs/cgroup/memory", path, "memory.limit_in_bytes", "memory.usage_in_bytes");
+		}
+		if (left < 0)
+			return(-1);
+		return((int)(left / (1024 * 1024)));
 	}
 
 	inline
@@ -80,6 +267,52 @@
 		return __builtin_cpu_supports("popcnt");
 	}
 
+	inline
+	bool check_cpu_has_avx2()
+	{
+	#if defined(__x86_64__) || defined(__i386__)
+		return __builtin_cpu_supports("avx2");
+	#else
+		return false;
+	#endif
+	}
+
+	/* Code compiled for bmi2 may also use bmi1 and popcnt. */
+	inline
+	bool check_cpu_has_bmi2()
+	{
+	#if defined(__x86_64__) || defined(__i386__)
+		return __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("popcnt");
+	#else
+		return false;
+	#endif
+	}
+
+	/* pext is microcoded on amd and hygon cpus before family 0x19 (zen 3), where it 
+	 * is much slower than the popcnt code.  The vendor is checked by the first 4 
+	 * letters of "AuthenticAMD" and "HygonGenuine" in ebx.
+	 */
+	inline
+	bool check_cpu_has_fast_pext()
+	{
+	#if defined(__x86_64__) || defined(__i386__)
+		unsigned int eax, ebx, ecx, edx, family;
+
+		if (!check_cpu_has_bmi2())
+			return(false);
+		__cpuid(0, eax, ebx, ecx, edx);
+		if (ebx != 0x68747541 && ebx != 0x6f677948)
+			return(true);
+		__cpuid(1, eax, ebx, ecx, edx);
+		family = (eax >> 8) & 0xf;
+		if (family == 0xf)
+			family += (eax >> 20) & 0xff;
+		return(family >= 0x19);
+	#else
+		return false;
+	#endif
+	}
+
 	}	// namespace
 #endif
 
@@ -87,6 +320,17 @@
 // Memory
 // ------
 
+namespace egdb_interface {
+
+/* How aligned_large_alloc() gets its memory.  Only used on Linux. */
+enum LARGE_PAGE_MODE {
+	LARGE_PAGES_OFF,		/* normal pages. */
+	LARGE_PAGES_THP,		/* transparent huge pages, if the kernel allows them. */
+	LARGE_PAGES_HUGETLB,	/* pages from the hugetlbfs pool, or THP if the pool is empty. */
+};
+
+}	// namespace
+
 #ifdef _MSC_VER
 
 	#ifdef USE_WIN_API
@@ -96,7 +340,7 @@
 		namespace egdb_interface {
 
 		inline
-		void *aligned_large_alloc(size_t size)
+		void *aligned_large_alloc(size_t size, LARGE_PAGE_MODE mode)
 		{
 			return VirtualAlloc(0, size, MEM_COMMIT, PAGE_READWRITE);
 		}
@@ -107,6 +351,12 @@
 			VirtualFree(ptr, 0, MEM_RELEASE);
 		}
 
+		inline
+		unsigned long get_large_page_size(void *ptr)
+		{
+			return get_page_size();
+		}
+
 		}	// namespace
 	#else
 
@@ -117,7 +367,7 @@
 		namespace egdb_interface {
 
 		inline
-		void *aligned_large_alloc(size_t size)
+		void *aligned_large_alloc(size_t size, LARGE_PAGE_MODE mode)
 		{
 			// https://msdn.microsoft.com/en-us/library/8z34s9c6.aspx
 			// NOTE: order of arguments is (size, alignment)
@@ -130,30 +380,294 @@
 			_aligned_free(ptr);
 		}
 
+		inline
+		unsigned long get_large_page_size(void *ptr)
+		{
+			return get_page_size();
+		}
+
 		}	// namespace
 	#endif
 
 #else
 
+	#include <cstdio>
 	#include <cstdlib>
+	#include <map>
+	#include <mutex>
+	#include <sys/mman.h>
 
 	namespace egdb_interface {
 
+	/* The size of a transparent huge page, usually 2mb. */
+	inline
+	size_t get_huge_page_size()
+	{
+		static size_t size = 0;
+
+		if (size == 0) {
+			int64_t value = read_file_int64("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+			size = value > 0 ? (size_t)value : 2 * 1024 * 1024;
+		}
+		return(size);
+	}
+
+	/* The lengths of the mappings made by aligned_large_alloc(), for munmap(). */
 	inline
-	void *aligned_large_alloc(size_t size)
+	std::map<void *, size_t> &large_allocs(std::mutex **lock)
 	{
-		// http://en.cppreference.com/w/c/memory/aligned_alloc
-		// NOTE: order of arguments is (alignment, size)
-		return aligned_alloc(get_allocation_granularity(), size);
+		static std::mutex allocs_lock;
+		static std::map<void *, size_t> allocs;
+
+		*lock = &allocs_lock;
+		return(allocs);
+	}
+
+	/* Allocations of a huge page or more are aligned to a huge page, so that 
+	 * the kernel can back them with huge pages and save tlb misses.
+	 */
+	inline
+	void *aligned_large_alloc(size_t size, LARGE_PAGE_MODE mode)
+	{
+		size_t huge, length;
+		char *base, *ptr;
+		std::mutex *lock;
+
+		huge = get_huge_page_size();
+		base = (char *)MAP_FAILED;
+		if (mode == LARGE_PAGES_HUGETLB && size >= huge) {
+			length = (size + huge - 1) / huge * huge;
+			base = (char *)mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			ptr = base;
+		}
+		if (base == MAP_FAILED && mode != LARGE_PAGES_OFF && size >= huge) {
+
+			/* Map an extra huge page and trim the ends to get the alignment. */
+			length = (size + get_page_size() - 1) / get_page_size() * get_page_size();
+			base = (char *)mmap(0, length + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base == MAP_FAILED)
+				return(0);
+			ptr = (char *)(((uintptr_t)base + huge - 1) & ~(uintptr_t)(huge - 1));
+			if (ptr > base)
+				munmap(base, ptr - base);
+			if (base + length + huge > ptr + length)
+				munmap(ptr + length, base + length + huge - (ptr + length));
+			madvise(ptr, length, MADV_HUGEPAGE);
+		}
+		else if (base == MAP_FAILED) {
+			length = size;
+			ptr = (char *)mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED)
+				return(0);
+		}
+
+		std::map<void *, size_t> &allocs = large_allocs(&lock);
+		std::lock_guard<std::mutex> guard(*lock);
+		allocs[ptr] = length;
+		return(ptr);
 	}
 
 	inline
 	void virtual_free(void *ptr)
 	{
-		std::free(ptr);
+		std::mutex *lock;
+		std::map<void *, size_t> &allocs = large_allocs(&lock);
+		std::lock_guard<std::mutex> guard(*lock);
+		std::map<void *, size_t>::iterator it = allocs.find(ptr);
+
+		if (it != allocs.end()) {
+			munmap(ptr, it->second);
+			allocs.erase(it);
+		}
+	}
+
+	/* Return the size of the pages that the kernel is using for the memory at ptr.
+	 * Transparent huge pages show up as AnonHugePages in the mapping's smaps entry,
+	 * hugetlbfs pages as its KernelPageSize.
+	 */
+	inline
+	unsigned long get_large_page_size(void *ptr)
+	{
+		char line[256];
+		unsigned long start, end, kb;
+		bool found = false;
+		unsigned long page_size = get_page_size();
+		std::FILE *fp = std::fopen("/proc/self/smaps", "r");
+
+		if (!fp)
+			return(page_size);
+		while (std::fgets(line, sizeof(line), fp)) {
+			if (std::sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+				if (found)
+					break;
+				found = ((uintptr_t)ptr >= start && (uintptr_t)ptr < end);
+			}
+			else if (found && std::sscanf(line, "KernelPageSize: %lu kB", &kb) == 1 && kb * 1024 > page_size)
+				page_size = kb * 1024;
+			else if (found && std::sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 && kb > 0)
+				page_size = (unsigned long)get_huge_page_size();
+		}
+		std::fclose(fp);
+		return(page_size);
+	}
+
+	}	// namespace
+#endif
+
+// ----
+// NUMA
+// ----
+
+#ifdef _MSC_VER
+
+	namespace egdb_interface {
+
+	/* Memory cannot be moved to a node after it is allocated, so Windows uses one node. */
+	inline
+	int get_numa_nodes(int *nodes, int max_nodes)
+	{
+		if (max_nodes > 0)
+			nodes[0] = 0;
+		return(1);
+	}
+
+	inline
+	int get_cpu_count()
+	{
+		return(1);
+	}
+
+	inline
+	int get_cpu_numa_node(int cpu)
+	{
+		return(0);
+	}
+
+	inline
+	int get_current_cpu()
+	{
+		return(0);
+	}
+
+	inline
+	void bind_memory_to_node(void *ptr, size_t size, int node)
+	{
+	}
+
+	inline
+	void interleave_memory(void *ptr, size_t size, int const *nodes, int num_nodes)
+	{
+	}
+
+	}	// namespace
+
+#else
+
+	/* This does not use libnuma.  The topology comes from sysfs, and the memory 
+	 * policy is set with the mbind system call before the pages are first touched.
+	 */
+	#include <sched.h>
+	#include <sys/syscall.h>
+
+	namespace egdb_interface {
+
+	#define EGDB_MPOL_BIND 2
+	#define EGDB_MPOL_INTERLEAVE 3
+	#define EGDB_MPOL_MF_MOVE (1 << 1)		/* also move pages that were already touched. */
+
+	/* The online nodes are a list of ranges such as "0-1,4,6-7", and node numbers
+	 * can have gaps.  Stores the first max_nodes node numbers in nodes, and returns
+	 * how many nodes are listed, or 1 (node 0) if the kernel has no NUMA support.
+	 */
+	inline
+	int get_numa_nodes(int *nodes, int max_nodes)
+	{
+		int node, last, count;
+		char line[256];
+		char *p, *end;
+		std::FILE *fp = std::fopen("/sys/devices/system/node/online", "r");
+
+		count = 0;
+		if (fp) {
+			if (std::fgets(line, sizeof(line), fp)) {
+				for (p = line; ; p = end + 1) {
+					node = (int)std::strtol(p, &end, 10);
+					if (end == p)
+						break;
+					last = node;
+					if (*end == '-') {
+						p = end + 1;
+						last = (int)std::strtol(p, &end, 10);
+						if (end == p)
+							last = node;
+					}
+					for (; node <= last; ++node) {
+						if (count < max_nodes)
+							nodes[count] = node;
+						++count;
+					}
+					if (*end != ',')
+						break;
+				}
+			}
+			std::fclose(fp);
+		}
+		if (count == 0) {
+			if (max_nodes > 0)
+				nodes[0] = 0;
+			count = 1;
+		}
+		return(count);
+	}
+
+	inline
+	int get_cpu_count()
+	{
+		return((int)sysconf(_SC_NPROCESSORS_CONF));
+	}
+
+	inline
+	int get_cpu_numa_node(int cpu)
+	{
+		int node;
+		char name[80];
+
+		for (node = 0; node < 64; ++node) {
+			std::sprintf(name, "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+			if (access(name, F_OK) == 0)
+				return(node);
+		}
+		return(0);
+	}
+
+	/* sched_getcpu() is served from the vdso, so it is cheap enough to call on every lookup. */
+	inline
+	int get_current_cpu()
+	{
+		return(sched_getcpu());
+	}
+
+	inline
+	void bind_memory_to_node(void *ptr, size_t size, int node)
+	{
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, ptr, size, EGDB_MPOL_BIND, &mask, 8 * sizeof(mask), EGDB_MPOL_MF_MOVE);
+	}
+
+	/* Interleave the pages over the num_nodes node numbers in nodes. */
+	inline
+	void interleave_memory(void *ptr, size_t size, int const *nodes, int num_nodes)
+	{
+		int i;
+		unsigned long mask;
+
+		for (mask = 0, i = 0; i < num_nodes; ++i)
+			mask |= 1UL << nodes[i];
+		syscall(SYS_mbind, ptr, size, EGDB_MPOL_INTERLEAVE, &mask, 8 * sizeof(mask), 0);
 	}
 
 	}	// namespace
+
 #endif
 
 // --------
@@ -442,6 +956,51 @@
 
 #endif
 
+// ----
+// SIMD
+// ----
+
+/* EGDB_SSE2 is defined when the sse2 intrinsics can be used unconditionally.
+ * Functions marked TARGET_AVX2 may use avx2 intrinsics, but must only be 
+ * called if check_cpu_has_avx2() is true.
+ * EGDB_POPCNT and EGDB_BMI2 are defined when the 64-bit popcnt and bmi2 instructions
+ * can be compiled.  Functions marked TARGET_POPCNT must only be called if 
+ * check_cpu_has_popcount() is true, and functions marked TARGET_BMI2, which may 
+ * also use bmi1 and popcnt, only if check_cpu_has_bmi2() is true.
+ * ALWAYS_INLINE code takes on the target of the function it is inlined into, so
+ * it can be compiled once for each of them.
+ */
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+
+	#define EGDB_SSE2
+	#include <immintrin.h>
+
+	#ifdef _MSC_VER
+		#define TARGET_AVX2
+	#else
+		#define TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+
+	#if defined(_M_X64) || defined(__x86_64__)
+		#define EGDB_POPCNT
+		#define EGDB_BMI2
+		#ifdef _MSC_VER
+			#define TARGET_POPCNT
+			#define TARGET_BMI2
+		#else
+			#define TARGET_POPCNT __attribute__((target("popcnt")))
+			#define TARGET_BMI2 __attribute__((target("bmi,bmi2,popcnt")))
+		#endif
+	#endif
+
+#endif
+
+#ifdef _MSC_VER
+	#define ALWAYS_INLINE __forceinline
+#else
+	#define ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
 // -------
 // Strings
 // -------
@@ -455,10 +1014,13 @@
 	inline 
 	int strcasecmp(char const *a, char const *b) { return _stricmp(a, b); }
 
+	inline 
+	int strncasecmp(char const *a, char const *b, size_t n) { return _strnicmp(a, b, n); }
+
 	}	// namespace
 
 #else
 
-	#include<string.h>	// provides strcasecmp
+	#include<strings.h>	// provides strcasecmp, strncasecmp
 
 #endif
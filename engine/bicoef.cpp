@@ -1,61 +1,17 @@
 #include "engine/bicoef.h"
-#include <algorithm>
+#include "engine/table.h"
 #include <stdint.h>
-#include <cstdio>
-#include <cstdlib>
 
 namespace egdb_interface {
-bool did_initbicoef;
-unsigned int bicoef[MAXSQUARE_BICOEF + 1][MAXPIECES_BICOEF + 1];
 
+#define BICOEF(n, k) (unsigned int)binomial_coefficient(n, k)
+#define BICOEF_ROW(n) {BICOEF(n, 0), BICOEF(n, 1), BICOEF(n, 2), BICOEF(n, 3), BICOEF(n, 4), \
+						BICOEF(n, 5), BICOEF(n, 6), BICOEF(n, 7), BICOEF(n, 8)}
 
-/*
- * Return the number of ways to choose k objects from a set of n objects.
- */
-static unsigned int binomial_coefficient(int n, int k)
-{
-	int64_t result = 1;
-	int i;
+static_assert(MAXSQUARE_BICOEF == 50 && MAXPIECES_BICOEF == 8, "the bicoef initializer is written for 51 x 9");
 
-	i = k;
-	while (i) {
-		result *= (n - i + 1);
-		i--;
-	}
-
-	i = k;
-	while (i) {
-		result /= i;
-		i--;
-	}
-
-	return((unsigned int)(result));
-}
-
-
-/*
- * Initialize binomial coefficients table.
- */
-void initbicoef(void)
-{
-	int i, j;
-
-	for (i = 0; i <= MAXSQUARE_BICOEF; i++) {
-		for (j = 1; j <= (std::min)(MAXPIECES_BICOEF, i); j++) {
-
-			// choose j from i:
-			bicoef[i][j] = binomial_coefficient(i, j);
-		}
-		// define choosing 0 for simplicity 
-		bicoef[i][0] = 1;
-	}
-
-	// choosing n from 0: bicoef = 0
-	for (i = 1; i <= MAXPIECES_BICOEF; i++)
-		bicoef[0][i] = 0;
-
-	did_initbicoef = true;
-}
+constexpr unsigned int bicoef[MAXSQUARE_BICOEF + 1][MAXPIECES_BICOEF + 1] = {
+	TABLE_32(BICOEF_ROW, 0), TABLE_16(BICOEF_ROW, 32), TABLE_2(BICOEF_ROW, 48), BICOEF_ROW(50)
+};
 
 }	// namespace egdb_interface
-
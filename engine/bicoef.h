@@ -1,23 +1,30 @@
 #pragma once
 
 #include "Engine/project.h"
+#include <stdint.h>
 
 namespace egdb_interface {
 
 #define MAXSQUARE_BICOEF 50
 #define MAXPIECES_BICOEF 8
 
-extern unsigned int bicoef[MAXSQUARE_BICOEF + 1][MAXPIECES_BICOEF + 1];
-extern bool did_initbicoef;
+extern const unsigned int bicoef[MAXSQUARE_BICOEF + 1][MAXPIECES_BICOEF + 1];
+
+/*
+ * Return the number of ways to choose k objects from a set of n objects,
+ * for building tables at compile time.  Choosing k from n < k is 0.
+ */
+constexpr uint64_t binomial_coefficient(int n, int k)
+{
+	return(k == 0 ? 1 : binomial_coefficient(n, k - 1) * (uint64_t)(n - k + 1 > 0 ? n - k + 1 : 0) / k);
+}
 
 /*
  * Return the number of ways to choose k objects from a set of n objects.
  */
 inline unsigned int choose(int n, int k)
 {
-	assert(did_initbicoef);
 	return(bicoef[n][k]);
 }
 
-void initbicoef(void);
 }	// namespace egdb_interface
@@ -4,28 +4,29 @@
 
 namespace egdb_interface {
 
-extern bool did_init_bitcount;
 extern bool cpu_has_popcount;
-extern char bitcount_table[0x10000];
 
 void init_bitcount();
 
 
-inline int bitcount16_emul(uint16_t n)
+/* Bitcounts for cpus without the popcnt instruction, adding the bits in parallel. */
+inline int bitcount32_emul(uint32_t n)
 {
-	return(bitcount_table[n]);
+	n = n - ((n >> 1) & 0x55555555);
+	n = (n & 0x33333333) + ((n >> 2) & 0x33333333);
+	n = (n + (n >> 4)) & 0x0F0F0F0F;
+	return((int)((n * 0x01010101) >> 24));
 }
 
 
-inline int bitcount32_emul(uint32_t n)
+inline int bitcount16_emul(uint16_t n)
 {
-	return(bitcount_table[n & 0x0000FFFF] + bitcount_table[n >> 16]);
+	return(bitcount32_emul(n));
 }
 
 
 inline int bitcount16(uint16_t n)
 {
-	assert(did_init_bitcount);
 #ifdef ENVIRONMENT64
 	if (cpu_has_popcount)
 		return(bit_pop_count(n));
@@ -37,7 +38,6 @@ inline int bitcount16(uint16_t n)
 
 inline int bitcount(uint32_t n)
 {
-	assert(did_init_bitcount);
 #ifdef ENVIRONMENT64
 	if (cpu_has_popcount)
 		return(bit_pop_count(n));
@@ -47,25 +47,44 @@ inline int bitcount(uint32_t n)
 }
 
 
+inline int bitcount64_emul(uint64_t n)
+{
+	return(bitcount32_emul((uint32_t)(n & 0xffffffff)) + bitcount32_emul((uint32_t)(n >> 32)));
+}
+
+
 #ifdef ENVIRONMENT64
 
 inline int bitcount64(uint64_t n)
 {
-	assert(did_init_bitcount);
 	if (cpu_has_popcount)
 		return((int)bit_pop_count64(n));
 	else
-		return(bitcount32_emul((uint32_t)(n & 0xffffffff)) + bitcount32_emul((uint32_t)(n >> 32) & 0xffffffff));
+		return(bitcount64_emul(n));
 }
 
 #else
 
 inline int bitcount64(uint64_t n)
 {
-	assert(did_init_bitcount);
-	return(bitcount32_emul((uint32_t)(n & 0xffffffff)) + bitcount32_emul((uint32_t)(n >> 32) & 0xffffffff));
+	return(bitcount64_emul(n));
 }
 
 #endif
 
+
+/*
+ * bitcount64() without the runtime test, for code that is compiled once with and once 
+ * without popcnt and selected when the db is opened.  With popcnt true it must only
+ * run if check_cpu_has_popcount() is true.
+ */
+template <bool popcnt> ALWAYS_INLINE int bitcount64_isa(uint64_t n)
+{
+#ifdef ENVIRONMENT64
+	if (popcnt)
+		return((int)bit_pop_count64(n));
+#endif
+	return(bitcount64_emul(n));
+}
+
 }	// namespace egdb_interface
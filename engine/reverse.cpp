@@ -27,18 +27,23 @@ void init_reverse()
 }
 
 
+/*
+ * Mirror every square, bit -> mirrored(bit).  The board uses bits 0 to S50_bit, and the
+ * ghost squares are mirrors of each other, so this is a full 64-bit reverse shifted down
+ * by 63 - S50_bit.
+ */
 BITBOARD reverse_bitboard(BITBOARD bb)
 {
-	int bit;
 	uint64_t rev;
 
-	rev = 0;
-	while (bb) {
-		bit = LSB64(bb);
-		bb = clear_lsb(bb);
-		rev |= ((uint64_t)1 << mirrored(bit));
-	}
-	return(rev);
+	rev = bb;
+	rev = ((rev >> 1) & 0x5555555555555555ULL) | ((rev & 0x5555555555555555ULL) << 1);
+	rev = ((rev >> 2) & 0x3333333333333333ULL) | ((rev & 0x3333333333333333ULL) << 2);
+	rev = ((rev >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((rev & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	rev = ((rev >> 8) & 0x00FF00FF00FF00FFULL) | ((rev & 0x00FF00FF00FF00FFULL) << 8);
+	rev = ((rev >> 16) & 0x0000FFFF0000FFFFULL) | ((rev & 0x0000FFFF0000FFFFULL) << 16);
+	rev = (rev >> 32) | (rev << 32);
+	return(rev >> (63 - S50_bit));
 }
 
 }	// namespace egdb_interface
@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * TABLE_n(f, i) expands to the initializer list f(i), f(i + 1), ..., f(i + n - 1),
+ * so that a lookup table can be filled at compile time from a constexpr function.
+ */
+#define TABLE_1(f, i) f(i)
+#define TABLE_2(f, i) TABLE_1(f, i), TABLE_1(f, i + 1)
+#define TABLE_4(f, i) TABLE_2(f, i), TABLE_2(f, i + 2)
+#define TABLE_8(f, i) TABLE_4(f, i), TABLE_4(f, i + 4)
+#define TABLE_16(f, i) TABLE_8(f, i), TABLE_8(f, i + 8)
+#define TABLE_32(f, i) TABLE_16(f, i), TABLE_16(f, i + 16)
+#define TABLE_64(f, i) TABLE_32(f, i), TABLE_32(f, i + 32)
+#define TABLE_128(f, i) TABLE_64(f, i), TABLE_64(f, i + 64)
+#define TABLE_256(f, i) TABLE_128(f, i), TABLE_128(f, i + 128)
+#define TABLE_512(f, i) TABLE_256(f, i), TABLE_256(f, i + 256)
+#define TABLE_1024(f, i) TABLE_256(f, i), TABLE_256(f, i + 256), TABLE_256(f, i + 512), TABLE_256(f, i + 768)
+#define TABLE_4096(f, i) TABLE_1024(f, i), TABLE_1024(f, i + 1024), TABLE_1024(f, i + 2048), TABLE_1024(f, i + 3072)
+#define TABLE_8192(f, i) TABLE_4096(f, i), TABLE_4096(f, i + 4096)
+#define TABLE_16384(f, i) TABLE_4096(f, i), TABLE_4096(f, i + 4096), TABLE_4096(f, i + 8192), TABLE_4096(f, i + 12288)
+#define TABLE_65536(f, i) TABLE_16384(f, i), TABLE_16384(f, i + 16384), TABLE_16384(f, i + 32768), TABLE_16384(f, i + 49152)
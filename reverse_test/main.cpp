@@ -0,0 +1,59 @@
+#include "engine/board.h"
+#include "engine/bool.h"
+#include "engine/reverse.h"
+#include <cstdio>
+#include <stdint.h>
+
+using namespace egdb_interface;
+
+
+/*
+ * reverse_bitboard() as it was before it used a 64-bit bit reverse.
+ */
+static BITBOARD reverse_bitboard_loop(BITBOARD bb)
+{
+	int bit;
+	uint64_t rev;
+
+	rev = 0;
+	while (bb) {
+		bit = LSB64(bb);
+		bb = clear_lsb(bb);
+		rev |= ((uint64_t)1 << mirrored(bit));
+	}
+	return(rev);
+}
+
+
+static int check(BITBOARD bb)
+{
+	BITBOARD expected, got;
+
+	expected = reverse_bitboard_loop(bb);
+	got = reverse_bitboard(bb);
+	if (got != expected) {
+		std::printf("reverse of %016llx: expected %016llx, got %016llx\n",
+					(unsigned long long)bb, (unsigned long long)expected, (unsigned long long)got);
+		return(1);
+	}
+	return(0);
+}
+
+
+/*
+ * Both reverses work on each bit separately, so comparing them on every single
+ * square and every pair of squares covers all boards.
+ */
+int main()
+{
+	int i, j, nerrors;
+
+	nerrors = check(0);
+	for (i = 0; i <= S50_bit; ++i) {
+		nerrors += check((BITBOARD)1 << i);
+		for (j = i + 1; j <= S50_bit; ++j)
+			nerrors += check(((BITBOARD)1 << i) | ((BITBOARD)1 << j));
+	}
+	std::printf("Test complete, %d errors.\n", nerrors);
+	return(nerrors != 0);
+}